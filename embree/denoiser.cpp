@@ -0,0 +1,127 @@
+#include "denoiser.h"
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#include <tbb/parallel_for.h>
+#include "denoise_ispc.h"
+
+namespace embree {
+
+Denoiser::Denoiser(const glm::uvec2 &fb_dims, const glm::uvec2 &tile_size)
+    : fb_dims(fb_dims),
+      tile_size(tile_size),
+      color(fb_dims.x * fb_dims.y * 3, 0.f),
+      albedo(color.size(), 0.f),
+      normal(color.size(), 0.f),
+      filtered(color.size(), 0.f)
+{
+#ifdef ENABLE_OIDN
+    device = oidn::newDevice();
+    device.commit();
+
+    filter = device.newFilter("RT");
+    filter.setImage("color", color.data(), oidn::Format::Float3, fb_dims.x, fb_dims.y);
+    filter.setImage("albedo", albedo.data(), oidn::Format::Float3, fb_dims.x, fb_dims.y);
+    filter.setImage("normal", normal.data(), oidn::Format::Float3, fb_dims.x, fb_dims.y);
+    filter.setImage("output", filtered.data(), oidn::Format::Float3, fb_dims.x, fb_dims.y);
+    filter.set("hdr", true);
+    filter.commit();
+
+    const char *err = nullptr;
+    if (device.getError(err) != oidn::Error::None) {
+        throw std::runtime_error(std::string("Failed to create OIDN filter: ") + err);
+    }
+#else
+    scratch.resize(color.size(), 0.f);
+#endif
+}
+
+void Denoiser::gather_tile(const Tile &tile)
+{
+#ifdef ENABLE_OIDN
+    const bool demodulate = false;
+#else
+    const bool demodulate = true;
+#endif
+    ispc::denoise_gather_tile(tile.data,
+                              tile.albedo,
+                              tile.normal,
+                              tile.x,
+                              tile.y,
+                              tile.width,
+                              tile.height,
+                              tile.fb_width,
+                              demodulate,
+                              color.data(),
+                              albedo.data(),
+                              normal.data());
+}
+
+void Denoiser::denoise()
+{
+#ifdef ENABLE_OIDN
+    filter.execute();
+
+    const char *err = nullptr;
+    if (device.getError(err) != oidn::Error::None) {
+        throw std::runtime_error(std::string("OIDN denoising failed: ") + err);
+    }
+#else
+    if (atrous_iterations <= 0) {
+        std::copy(color.begin(), color.end(), filtered.begin());
+        return;
+    }
+
+    const glm::uvec2 ntiles(fb_dims.x / tile_size.x + (fb_dims.x % tile_size.x != 0 ? 1 : 0),
+                            fb_dims.y / tile_size.y + (fb_dims.y % tile_size.y != 0 ? 1 : 0));
+
+    // Ping-pong between the scratch and filtered buffers, ending in the filtered buffer
+    const float *src = color.data();
+    for (int i = 0; i < atrous_iterations; ++i) {
+        float *dst = (atrous_iterations - i) % 2 == 1 ? filtered.data() : scratch.data();
+        // The color falloff is tightened with each iteration as the noise is filtered out
+        const float iter_color_phi = color_phi * std::pow(2.f, -i);
+        tbb::parallel_for(uint32_t(0), ntiles.x * ntiles.y, [&](uint32_t tile_id) {
+            const glm::uvec2 tile = glm::uvec2(tile_id % ntiles.x, tile_id / ntiles.x);
+            const glm::uvec2 tile_pos = tile * tile_size;
+            const glm::uvec2 tile_end = glm::min(tile_pos + tile_size, fb_dims);
+            const glm::uvec2 actual_tile_dims = tile_end - tile_pos;
+
+            ispc::denoise_atrous_tile(src,
+                                      dst,
+                                      albedo.data(),
+                                      normal.data(),
+                                      tile_pos.x,
+                                      tile_pos.y,
+                                      actual_tile_dims.x,
+                                      actual_tile_dims.y,
+                                      fb_dims.x,
+                                      fb_dims.y,
+                                      1 << i,
+                                      iter_color_phi,
+                                      normal_phi,
+                                      albedo_phi);
+        });
+        src = dst;
+    }
+#endif
+}
+
+void Denoiser::scatter_tile(const Tile &tile, float *tile_color) const
+{
+#ifdef ENABLE_OIDN
+    const bool remodulate = false;
+#else
+    const bool remodulate = true;
+#endif
+    ispc::denoise_scatter_tile(filtered.data(),
+                               albedo.data(),
+                               tile.x,
+                               tile.y,
+                               tile.width,
+                               tile.height,
+                               tile.fb_width,
+                               remodulate,
+                               tile_color);
+}
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <vector>
+#include "embree_utils.h"
+#include <glm/glm.hpp>
+#ifdef ENABLE_OIDN
+#include <OpenImageDenoise/oidn.hpp>
+#endif
+
+namespace embree {
+
+/* Denoises the progressively accumulated frame using the first hit albedo and normal
+ * AOVs written by the kernel. Uses Open Image Denoise if it was found when building,
+ * otherwise falls back to an edge avoiding a-trous wavelet filter run with ISPC.
+ */
+class Denoiser {
+    glm::uvec2 fb_dims;
+    glm::uvec2 tile_size;
+    // Full frame RGB buffers, the tiles are gathered into these to filter across tiles
+    std::vector<float> color, albedo, normal, filtered, scratch;
+
+#ifdef ENABLE_OIDN
+    oidn::DeviceRef device;
+    oidn::FilterRef filter;
+#endif
+
+public:
+    // Iterations of the a-trous filter, the filter footprint doubles with each iteration
+    int atrous_iterations = 5;
+    // Edge stopping falloffs for the color, normal and albedo differences
+    float color_phi = 1.f;
+    float normal_phi = 0.1f;
+    float albedo_phi = 0.05f;
+
+    Denoiser(const glm::uvec2 &fb_dims, const glm::uvec2 &tile_size);
+
+    Denoiser(const Denoiser &) = delete;
+    Denoiser &operator=(const Denoiser &) = delete;
+
+    // Copy the tile's accumulated color and AOVs into the frame to be denoised
+    void gather_tile(const Tile &tile);
+
+    // Denoise the gathered frame. Must be called after all tiles have been gathered
+    void denoise();
+
+    // Write the tile's region of the denoised frame out to tile_color
+    void scatter_tile(const Tile &tile, float *tile_color) const;
+};
+}
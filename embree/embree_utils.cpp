@@ -1,21 +1,58 @@
 #include "embree_utils.h"
 #include <algorithm>
+#include <cmath>
 #include <iterator>
 #include <limits>
 #include <glm/ext.hpp>
+#include <glm/gtc/packing.hpp>
 
 namespace embree {
 
+namespace {
+
+uint32_t encode_octahedral_normal(glm::vec3 n)
+{
+    const float l1_norm = std::abs(n.x) + std::abs(n.y) + std::abs(n.z);
+    // Degenerate normals can't be projected onto the octahedron, so encode them as +Z
+    if (!(l1_norm > 0.f) || !std::isfinite(l1_norm)) {
+        return glm::packSnorm2x16(glm::vec2(0.f));
+    }
+    n = n / l1_norm;
+    glm::vec2 e(n.x, n.y);
+    if (n.z < 0.f) {
+        e.x = (1.f - std::abs(n.y)) * (n.x >= 0.f ? 1.f : -1.f);
+        e.y = (1.f - std::abs(n.x)) * (n.y >= 0.f ? 1.f : -1.f);
+    }
+    return glm::packSnorm2x16(e);
+}
+
+}
+
 Geometry::Geometry(RTCDevice &device,
                    const std::vector<glm::vec3> &verts,
                    const std::vector<glm::uvec3> &indices,
                    const std::vector<glm::vec3> &normals,
-                   const std::vector<glm::vec2> &uvs)
-    : index_buf(indices),
-      normal_buf(normals),
-      uv_buf(uvs),
-      geom(rtcNewGeometry(device, RTC_GEOMETRY_TYPE_TRIANGLE))
+                   const std::vector<glm::vec2> &uvs,
+                   const bool compact_attributes)
+    : index_buf(indices), geom(rtcNewGeometry(device, RTC_GEOMETRY_TYPE_TRIANGLE))
 {
+    if (compact_attributes && (!normals.empty() || !uvs.empty())) {
+        shading_attribs = (normals.empty() ? 0 : SHADING_VERTEX_HAS_NORMAL) |
+                          (uvs.empty() ? 0 : SHADING_VERTEX_HAS_UV);
+        shading_buf.resize(verts.size());
+        for (size_t i = 0; i < verts.size(); ++i) {
+            if (!normals.empty()) {
+                shading_buf[i].normal = encode_octahedral_normal(normals[i]);
+            }
+            if (!uvs.empty()) {
+                shading_buf[i].uv = glm::packHalf2x16(uvs[i]);
+            }
+        }
+    } else {
+        normal_buf = normals;
+        uv_buf = uvs;
+    }
+
     vertex_buf.reserve(verts.size());
     std::transform(
         verts.begin(), verts.end(), std::back_inserter(vertex_buf), [](const glm::vec3 &v) {
@@ -67,6 +104,11 @@ ISPCGeometry::ISPCGeometry(const Geometry &geom)
     if (!geom.uv_buf.empty()) {
         uv_buf = geom.uv_buf.data();
     }
+
+    if (!geom.shading_buf.empty()) {
+        shading_buf = geom.shading_buf.data();
+        shading_attribs = geom.shading_attribs;
+    }
 }
 
 TriangleMesh::TriangleMesh(RTCDevice &device, std::vector<std::shared_ptr<Geometry>> &geoms)
@@ -104,6 +146,7 @@ Instance::Instance(RTCDevice &device,
       mesh(mesh),
       object_to_world(xfm),
       world_to_object(glm::inverse(object_to_world)),
+      normal_matrix(glm::transpose(glm::mat3(world_to_object))),
       material_ids(material_ids)
 {
     rtcSetGeometryInstancedScene(handle, mesh->handle());
@@ -128,11 +171,16 @@ ISPCInstance::ISPCInstance(const Instance &instance)
 }
 
 TopLevelBVH::TopLevelBVH(RTCDevice &device, const std::vector<std::shared_ptr<Instance>> &inst)
-    : handle(rtcNewScene(device)), instances(inst)
+    : handle(rtcNewScene(device)), instances(inst), normal_matrices(instances.size() * 9, 0.f)
 {
-    for (const auto &i : instances) {
-        rtcAttachGeometry(handle, i->handle);
-        ispc_instances.push_back(*i);
+    for (size_t i = 0; i < instances.size(); ++i) {
+        rtcAttachGeometry(handle, instances[i]->handle);
+        ispc_instances.push_back(*instances[i]);
+
+        const float *m = glm::value_ptr(instances[i]->normal_matrix);
+        for (size_t j = 0; j < 9; ++j) {
+            normal_matrices[j * instances.size() + i] = m[j];
+        }
     }
     rtcCommitScene(handle);
 }
@@ -148,4 +196,9 @@ ISPCTexture2D::ISPCTexture2D(const Image &img)
     : width(img.width), height(img.height), channels(img.channels), data(img.img.data())
 {
 }
+
+ISPCTexture2D::ISPCTexture2D(void *cache, uint32_t cache_id, const Image &img)
+    : width(img.width), height(img.height), channels(4), cache(cache), cache_id(cache_id)
+{
+}
 }
@@ -6,16 +6,35 @@
 #include <embree3/rtcore.h>
 #include "lights.h"
 #include "material.h"
+#include "material_flags.h"
+#include "path_params.h"
 #include <glm/glm.hpp>
 
 namespace embree {
 
+// Bits in ShadingVertex attribute flags indicating which attributes are present
+#define SHADING_VERTEX_HAS_NORMAL 1
+#define SHADING_VERTEX_HAS_UV 2
+
+/* Compact interleaved shading attributes for a vertex: the normal is octahedral
+ * encoded as two snorm16 values, and the uv is stored as two half floats
+ */
+struct ShadingVertex {
+    uint32_t normal = 0;
+    uint32_t uv = 0;
+};
+
 struct Geometry {
     std::vector<glm::vec4> vertex_buf;
     std::vector<glm::uvec3> index_buf;
     std::vector<glm::vec3> normal_buf;
     std::vector<glm::vec2> uv_buf;
 
+    // If compact attributes are used the normals and uvs are stored in the
+    // shading vertex buffer instead of the normal and uv buffers
+    std::vector<ShadingVertex> shading_buf;
+    uint32_t shading_attribs = 0;
+
     RTCBuffer vbuf = 0;
     RTCBuffer ibuf = 0;
 
@@ -27,7 +46,8 @@ struct Geometry {
              const std::vector<glm::vec3> &verts,
              const std::vector<glm::uvec3> &indices,
              const std::vector<glm::vec3> &normals,
-             const std::vector<glm::vec2> &uvs);
+             const std::vector<glm::vec2> &uvs,
+             const bool compact_attributes = false);
 
     ~Geometry();
 
@@ -40,6 +60,8 @@ struct ISPCGeometry {
     const glm::uvec3 *index_buf = nullptr;
     const glm::vec3 *normal_buf = nullptr;
     const glm::vec2 *uv_buf = nullptr;
+    const ShadingVertex *shading_buf = nullptr;
+    uint32_t shading_attribs = 0;
 
     ISPCGeometry() = default;
     ISPCGeometry(const Geometry &geom);
@@ -68,6 +90,8 @@ struct Instance {
     RTCGeometry handle = 0;
     std::shared_ptr<TriangleMesh> mesh = nullptr;
     glm::mat4 object_to_world, world_to_object;
+    // Inverse-transpose of the object to world transform, for transforming normals
+    glm::mat3 normal_matrix;
     std::vector<uint32_t> material_ids;
 
     Instance() = default;
@@ -97,6 +121,11 @@ struct TopLevelBVH {
     RTCScene handle = 0;
     std::vector<std::shared_ptr<Instance>> instances;
     std::vector<ISPCInstance> ispc_instances;
+    /* The instance normal matrices stored SoA: element i of the column-major
+     * 3x3 matrix of each instance is stored contiguously, starting at
+     * normal_matrices[i * instances.size()]
+     */
+    std::vector<float> normal_matrices;
 
     TopLevelBVH() = default;
     TopLevelBVH(RTCDevice &device, const std::vector<std::shared_ptr<Instance>> &instances);
@@ -111,8 +140,12 @@ struct ISPCTexture2D {
     int height = -1;
     int channels = -1;
     const uint8_t *data = nullptr;
+    // Set if the texture is paged through the texture cache instead of data
+    void *cache = nullptr;
+    uint32_t cache_id = 0;
 
     ISPCTexture2D(const Image &img);
+    ISPCTexture2D(void *cache, uint32_t cache_id, const Image &img);
     ISPCTexture2D() = default;
 };
 
@@ -132,11 +165,22 @@ struct MaterialParams {
 
     float ior = 1.5;
     float specular_transmission = 0;
+    // MATERIAL_PARAM bits of the textured parameters and the offset of their handles
+    // in the texture handle table, see texture_channel_mask.h
+    uint32_t texture_mask = 0;
+    uint32_t texture_handles = 0;
+
+    // DISNEY_LOBE flags classifying the material, see material_flags.h
+    uint32_t flags = DISNEY_LOBE_MASK;
 };
 
 struct ViewParams {
     glm::vec3 pos, dir_du, dir_dv, dir_top_left;
     uint32_t frame_id;
+    uint32_t max_depth;
+    // Russian roulette policy and the bounce to start applying it at, see path_params.h
+    uint32_t roulette_mode;
+    uint32_t roulette_start_bounce;
 };
 
 struct SceneContext {
@@ -145,6 +189,9 @@ struct SceneContext {
     MaterialParams *materials;
     QuadLight *lights;
     ISPCTexture2D *textures;
+    const uint32_t *texture_handles;
+    const float *normal_matrices;
+    uint32_t num_instances;
     uint32_t num_lights;
 };
 
@@ -154,6 +201,22 @@ struct Tile {
     uint32_t fb_width, fb_height;
     float *data;
     uint16_t *ray_stats;
+    // First hit albedo and normal AOVs for the denoiser, null if not needed
+    float *albedo;
+    float *normal;
+    // Planar buffer of the AOV_ flags channels to write, in the order of the flags
+    float *aovs;
+    uint32_t aov_flags;
+    // Per pixel sample counts used instead of the frame id when accumulating, along with the
+    // latest first hit depth and instance, null if temporal reprojection is disabled
+    float *sample_count;
+    float *hit_depth;
+    int32_t *hit_instance;
+    // Only every stride'th pixel in x and y is traced, for rendering at reduced resolution
+    uint32_t stride;
+    // The rectangle of pixels within the tile to trace
+    uint32_t trace_x, trace_y;
+    uint32_t trace_width, trace_height;
 };
 
 }
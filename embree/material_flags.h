@@ -0,0 +1,25 @@
+// This header is shared between the Embree backend and its ISPC kernels
+
+#ifndef EMBREE_MATERIAL_FLAGS_H
+#define EMBREE_MATERIAL_FLAGS_H
+
+/* The material flags classify which lobes of the Disney BSDF can contribute
+ * for a material, so the kernel can skip evaluating and sampling the lobes which
+ * are known to be zero. The specular reflection lobe is always present, since its
+ * Fresnel term is non-zero at grazing angles even with specular = 0. Parameters
+ * which are textured are assumed to be non-zero.
+ */
+#define DISNEY_LOBE_DIFFUSE 0x1
+#define DISNEY_LOBE_SHEEN 0x2
+#define DISNEY_LOBE_CLEARCOAT 0x4
+#define DISNEY_LOBE_TRANSMISSION 0x8
+#define DISNEY_LOBE_MASK 0xf
+
+// Common lobe combinations the kernel has specialized shading paths for
+#define DISNEY_LOBES_LAMBERT DISNEY_LOBE_DIFFUSE
+#define DISNEY_LOBES_METAL 0
+#define DISNEY_LOBES_DIELECTRIC DISNEY_LOBE_TRANSMISSION
+#define DISNEY_LOBES_COATED (DISNEY_LOBE_DIFFUSE | DISNEY_LOBE_CLEARCOAT)
+#define DISNEY_LOBES_SHEEN (DISNEY_LOBE_DIFFUSE | DISNEY_LOBE_SHEEN)
+
+#endif
@@ -0,0 +1,20 @@
+// This header is shared between the Embree backend and its ISPC kernels
+
+#ifndef EMBREE_PATH_PARAMS_H
+#define EMBREE_PATH_PARAMS_H
+
+#define DEFAULT_MAX_PATH_DEPTH 5
+#define DEFAULT_ROULETTE_START_BOUNCE 4
+
+/* The Russian roulette policies for terminating paths:
+ * ROULETTE_THROUGHPUT terminates paths with a probability based on their throughput.
+ * ROULETTE_EFFICIENCY weighs the path's expected contribution against the pixel's
+ * current estimate. Paths which won't contribute much to the pixel are terminated more
+ * often, while paths in dark pixels survive longer. It falls back to the throughput
+ * policy until the pixel has an estimate.
+ */
+#define ROULETTE_NONE 0
+#define ROULETTE_THROUGHPUT 1
+#define ROULETTE_EFFICIENCY 2
+
+#endif
@@ -1,7 +1,12 @@
 #include "render_embree.h"
 #include <algorithm>
 #include <chrono>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
 #include <iostream>
+#include <sstream>
+#include <stdexcept>
 #include <limits>
 #include <numeric>
 #include <tbb/global_control.h>
@@ -16,6 +21,37 @@
 
 static std::unique_ptr<tbb::global_control> tbb_thread_config;
 
+// Determine which lobes of the BSDF may contribute for the material
+static uint32_t classify_material(const embree::MaterialParams &p)
+{
+    auto may_be_nonzero = [&](const uint32_t param, const float x) {
+        return IS_TEXTURED_MATERIAL_PARAM(p.texture_mask, param) || x != 0.f;
+    };
+    auto is_one = [&](const uint32_t param, const float x) {
+        return !IS_TEXTURED_MATERIAL_PARAM(p.texture_mask, param) && x == 1.f;
+    };
+
+    uint32_t flags = 0;
+    // The diffuse and sheen lobes are weighted by (1 - metallic) * (1 - specular_transmission)
+    const bool diffuse = !is_one(MATERIAL_PARAM_METALLIC, p.metallic) &&
+                         !is_one(MATERIAL_PARAM_SPECULAR_TRANSMISSION, p.specular_transmission);
+    if (diffuse) {
+        flags |= DISNEY_LOBE_DIFFUSE;
+        if (may_be_nonzero(MATERIAL_PARAM_SHEEN, p.sheen)) {
+            flags |= DISNEY_LOBE_SHEEN;
+        }
+    }
+    if (may_be_nonzero(MATERIAL_PARAM_CLEARCOAT, p.clearcoat)) {
+        flags |= DISNEY_LOBE_CLEARCOAT;
+    }
+    // Transmission is weighted by (1 - metallic)
+    if (may_be_nonzero(MATERIAL_PARAM_SPECULAR_TRANSMISSION, p.specular_transmission) &&
+        !is_one(MATERIAL_PARAM_METALLIC, p.metallic)) {
+        flags |= DISNEY_LOBE_TRANSMISSION;
+    }
+    return flags;
+}
+
 RenderEmbree::RenderEmbree()
 {
 #ifndef __aarch64__
@@ -35,6 +71,42 @@ std::string RenderEmbree::name()
     return "Embree (w/ TBB & ISPC)";
 }
 
+uint32_t RenderEmbree::supported_aovs() const
+{
+    return AOV_DEPTH | AOV_NORMAL | AOV_ALBEDO | AOV_INSTANCE_ID | AOV_MATERIAL_ID;
+}
+
+bool RenderEmbree::supports_render_regions() const
+{
+    return true;
+}
+
+void RenderEmbree::set_render_regions(const std::vector<RenderRegion> &regions)
+{
+    frame_id = 0;
+    render_regions = regions;
+}
+
+void RenderEmbree::read_region(const RenderRegion &region,
+                               const uint32_t fb_width,
+                               float *rgb) const
+{
+    const glm::uvec2 ntiles(fb_dims.x / tile_size.x + (fb_dims.x % tile_size.x != 0 ? 1 : 0),
+                            fb_dims.y / tile_size.y + (fb_dims.y % tile_size.y != 0 ? 1 : 0));
+    for (uint32_t y = 0; y < region.size.y; ++y) {
+        for (uint32_t x = 0; x < region.size.x; ++x) {
+            const glm::uvec2 px = region.origin + glm::uvec2(x, y);
+            const glm::uvec2 tile = px / tile_size;
+            const glm::uvec2 tile_px = px - tile * tile_size;
+            const uint32_t tile_width = std::min(tile_size.x, fb_dims.x - tile.x * tile_size.x);
+            const float *src = tiles[tile.y * ntiles.x + tile.x].data() +
+                               (tile_px.y * tile_width + tile_px.x) * 3;
+            std::copy(src, src + 3, rgb);
+            rgb += 3;
+        }
+    }
+}
+
 void RenderEmbree::initialize(const int fb_width, const int fb_height)
 {
     frame_id = 0;
@@ -50,6 +122,55 @@ void RenderEmbree::initialize(const int fb_width, const int fb_height)
         ray_stats[i].resize(tile_size.x * tile_size.y, 0);
     }
 
+    if (denoise) {
+        tile_albedo.resize(tiles.size());
+        tile_normal.resize(tiles.size());
+        denoised_tiles.resize(tiles.size());
+        for (size_t i = 0; i < tiles.size(); ++i) {
+            tile_albedo[i].resize(tiles[i].size(), 0.f);
+            tile_normal[i].resize(tiles[i].size(), 0.f);
+            denoised_tiles[i].resize(tiles[i].size(), 0.f);
+        }
+        denoiser = std::make_unique<embree::Denoiser>(fb_dims, tile_size);
+    } else {
+        tile_albedo.clear();
+        tile_normal.clear();
+        denoised_tiles.clear();
+        denoiser = nullptr;
+    }
+
+    if (temporal_reprojection) {
+        const size_t tile_pixels = tile_size.x * tile_size.y;
+        tile_sample_counts.resize(tiles.size());
+        tile_hit_depths.resize(tiles.size());
+        tile_hit_instances.resize(tiles.size());
+        for (size_t i = 0; i < tiles.size(); ++i) {
+            tile_sample_counts[i].resize(tile_pixels, 0.f);
+            tile_hit_depths[i].resize(tile_pixels, 0.f);
+            tile_hit_instances[i].resize(tile_pixels, -1);
+        }
+        reprojection = std::make_unique<embree::TemporalReprojection>(fb_dims);
+    } else {
+        tile_sample_counts.clear();
+        tile_hit_depths.clear();
+        tile_hit_instances.clear();
+        reprojection = nullptr;
+    }
+
+    aov_layers = make_aov_layers(aovs, fb_width, fb_height);
+    tile_aovs.clear();
+    if (!aov_layers.empty()) {
+        const size_t num_channels = std::accumulate(
+            aov_layers.begin(),
+            aov_layers.end(),
+            size_t(0),
+            [](const size_t n, const AOVLayer &l) { return n + l.channels.size(); });
+        tile_aovs.resize(tiles.size());
+        for (auto &t : tile_aovs) {
+            t.resize(num_channels * tile_size.x * tile_size.y, 0.f);
+        }
+    }
+
 #ifdef REPORT_RAY_STATS
     num_rays.resize(tiles.size(), 0);
 #endif
@@ -58,13 +179,20 @@ void RenderEmbree::initialize(const int fb_width, const int fb_height)
 void RenderEmbree::set_scene(const Scene &scene)
 {
     frame_id = 0;
+    if (reprojection) {
+        reprojection->reset();
+    }
 
     std::vector<std::shared_ptr<embree::TriangleMesh>> meshes;
     for (const auto &mesh : scene.meshes) {
         std::vector<std::shared_ptr<embree::Geometry>> geometries;
         for (const auto &geom : mesh.geometries) {
-            geometries.push_back(std::make_shared<embree::Geometry>(
-                device, geom.vertices, geom.indices, geom.normals, geom.uvs));
+            geometries.push_back(std::make_shared<embree::Geometry>(device,
+                                                                    geom.vertices,
+                                                                    geom.indices,
+                                                                    geom.normals,
+                                                                    geom.uvs,
+                                                                    compact_vertex_attributes));
         }
 
         meshes.push_back(std::make_shared<embree::TriangleMesh>(device, geometries));
@@ -78,48 +206,63 @@ void RenderEmbree::set_scene(const Scene &scene)
 
     scene_bvh = std::make_shared<embree::TopLevelBVH>(device, instances);
 
-    textures = scene.textures;
-
-    // Linearize any sRGB textures beforehand, since we don't have fancy sRGB texture
-    // interpolation support in hardware
-    tbb::parallel_for(size_t(0), textures.size(), [&](size_t i) {
-        auto &img = textures[i];
-        if (img.color_space == LINEAR) {
-            return;
-        }
-        img.color_space = LINEAR;
-        const int convert_channels = std::min(3, img.channels);
-        tbb::parallel_for(size_t(0), size_t(img.width) * img.height, [&](size_t px) {
-            for (int c = 0; c < convert_channels; ++c) {
-                float x = img.img[px * img.channels + c] / 255.f;
-                x = srgb_to_linear(x);
-                img.img[px * img.channels + c] = glm::clamp(x * 255.f, 0.f, 255.f);
+    ispc_textures.clear();
+    textures.clear();
+    texture_cache = nullptr;
+    if (texture_cache_size > 0) {
+        set_paged_textures(scene);
+    } else {
+        textures = scene.textures;
+
+        // Linearize any sRGB textures beforehand, since we don't have fancy sRGB texture
+        // interpolation support in hardware
+        tbb::parallel_for(size_t(0), textures.size(), [&](size_t i) {
+            auto &img = textures[i];
+            if (img.color_space == LINEAR) {
+                return;
             }
+            img.color_space = LINEAR;
+            const int convert_channels = std::min(3, img.channels);
+            tbb::parallel_for(size_t(0), size_t(img.width) * img.height, [&](size_t px) {
+                for (int c = 0; c < convert_channels; ++c) {
+                    float x = img.img[px * img.channels + c] / 255.f;
+                    x = srgb_to_linear(x);
+                    img.img[px * img.channels + c] = glm::clamp(x * 255.f, 0.f, 255.f);
+                }
+            });
         });
-    });
 
-    ispc_textures.reserve(textures.size());
-    std::transform(textures.begin(),
-                   textures.end(),
-                   std::back_inserter(ispc_textures),
-                   [](const Image &img) { return embree::ISPCTexture2D(img); });
+        ispc_textures.reserve(textures.size());
+        std::transform(textures.begin(),
+                       textures.end(),
+                       std::back_inserter(ispc_textures),
+                       [](const Image &img) { return embree::ISPCTexture2D(img); });
+    }
+
+    texture_handles.clear();
+    const std::vector<MaterialRecord> records =
+        make_material_records(scene.materials, texture_handles);
 
-    material_params.reserve(scene.materials.size());
-    for (const auto &m : scene.materials) {
+    material_params.clear();
+    material_params.reserve(records.size());
+    for (const auto &r : records) {
         embree::MaterialParams p;
 
-        p.base_color = m.base_color;
-        p.metallic = m.metallic;
-        p.specular = m.specular;
-        p.roughness = m.roughness;
-        p.specular_tint = m.specular_tint;
-        p.anisotropy = m.anisotropy;
-        p.sheen = m.sheen;
-        p.sheen_tint = m.sheen_tint;
-        p.clearcoat = m.clearcoat;
-        p.clearcoat_gloss = m.clearcoat_gloss;
-        p.ior = m.ior;
-        p.specular_transmission = m.specular_transmission;
+        p.base_color = r.base_color;
+        p.metallic = r.metallic;
+        p.specular = r.specular;
+        p.roughness = r.roughness;
+        p.specular_tint = r.specular_tint;
+        p.anisotropy = r.anisotropy;
+        p.sheen = r.sheen;
+        p.sheen_tint = r.sheen_tint;
+        p.clearcoat = r.clearcoat;
+        p.clearcoat_gloss = r.clearcoat_gloss;
+        p.ior = r.ior;
+        p.specular_transmission = r.specular_transmission;
+        p.texture_mask = r.texture_mask;
+        p.texture_handles = r.texture_handles;
+        p.flags = classify_material(p);
 
         material_params.push_back(p);
     }
@@ -127,6 +270,204 @@ void RenderEmbree::set_scene(const Scene &scene)
     lights = scene.lights;
 }
 
+embree::Tile RenderEmbree::make_tile(const uint32_t tile_id, const glm::uvec2 &ntiles)
+{
+    const glm::uvec2 tile = glm::uvec2(tile_id % ntiles.x, tile_id / ntiles.x);
+    const glm::uvec2 tile_pos = tile * tile_size;
+    const glm::uvec2 tile_end = glm::min(tile_pos + tile_size, fb_dims);
+    const glm::uvec2 actual_tile_dims = tile_end - tile_pos;
+
+    embree::Tile ispc_tile;
+    ispc_tile.x = tile_pos.x;
+    ispc_tile.y = tile_pos.y;
+    ispc_tile.width = actual_tile_dims.x;
+    ispc_tile.height = actual_tile_dims.y;
+    ispc_tile.fb_width = fb_dims.x;
+    ispc_tile.fb_height = fb_dims.y;
+    ispc_tile.data = tiles[tile_id].data();
+    ispc_tile.ray_stats = ray_stats[tile_id].data();
+    ispc_tile.albedo = denoiser ? tile_albedo[tile_id].data() : nullptr;
+    ispc_tile.normal = denoiser ? tile_normal[tile_id].data() : nullptr;
+    ispc_tile.aovs = tile_aovs.empty() ? nullptr : tile_aovs[tile_id].data();
+    ispc_tile.aov_flags = tile_aovs.empty() ? 0 : aovs;
+    ispc_tile.sample_count = reprojection ? tile_sample_counts[tile_id].data() : nullptr;
+    ispc_tile.hit_depth = reprojection ? tile_hit_depths[tile_id].data() : nullptr;
+    ispc_tile.hit_instance = reprojection ? tile_hit_instances[tile_id].data() : nullptr;
+    ispc_tile.stride = 1;
+    ispc_tile.trace_x = 0;
+    ispc_tile.trace_y = 0;
+    ispc_tile.trace_width = ispc_tile.width;
+    ispc_tile.trace_height = ispc_tile.height;
+    return ispc_tile;
+}
+
+// Append the parts of rect a which are not covered by rect b to out
+static void subtract_region(const RenderRegion &a,
+                            const RenderRegion &b,
+                            std::vector<RenderRegion> &out)
+{
+    const glm::uvec2 a_end = a.origin + a.size;
+    const glm::uvec2 b_end = b.origin + b.size;
+    const glm::uvec2 lo = glm::max(a.origin, b.origin);
+    const glm::uvec2 hi = glm::min(a_end, b_end);
+    if (lo.x >= hi.x || lo.y >= hi.y) {
+        out.push_back(a);
+        return;
+    }
+
+    RenderRegion r;
+    // The full width bands above and below b, then the parts to the left and right of it
+    if (a.origin.y < lo.y) {
+        r.origin = a.origin;
+        r.size = glm::uvec2(a.size.x, lo.y - a.origin.y);
+        out.push_back(r);
+    }
+    if (hi.y < a_end.y) {
+        r.origin = glm::uvec2(a.origin.x, hi.y);
+        r.size = glm::uvec2(a.size.x, a_end.y - hi.y);
+        out.push_back(r);
+    }
+    if (a.origin.x < lo.x) {
+        r.origin = glm::uvec2(a.origin.x, lo.y);
+        r.size = glm::uvec2(lo.x - a.origin.x, hi.y - lo.y);
+        out.push_back(r);
+    }
+    if (hi.x < a_end.x) {
+        r.origin = glm::uvec2(hi.x, lo.y);
+        r.size = glm::uvec2(a_end.x - hi.x, hi.y - lo.y);
+        out.push_back(r);
+    }
+}
+
+void RenderEmbree::clip_tile_to_regions(const embree::Tile &tile,
+                                        std::vector<embree::Tile> &clipped) const
+{
+    clipped.clear();
+    if (render_regions.empty()) {
+        clipped.push_back(tile);
+        return;
+    }
+
+    const glm::uvec2 tile_pos(tile.x, tile.y);
+    const glm::uvec2 tile_end = tile_pos + glm::uvec2(tile.width, tile.height);
+    // Overlapping regions are split up so that no pixel is traced more than once
+    std::vector<RenderRegion> rects, pieces, remaining;
+    for (const auto &r : render_regions) {
+        const RenderRegion region = clip_render_region(r, fb_dims);
+        const glm::uvec2 lo = glm::max(region.origin, tile_pos);
+        const glm::uvec2 hi = glm::min(region.origin + region.size, tile_end);
+        if (lo.x >= hi.x || lo.y >= hi.y) {
+            continue;
+        }
+
+        pieces.clear();
+        pieces.push_back(RenderRegion{lo, hi - lo});
+        for (const auto &prev : rects) {
+            remaining.clear();
+            for (const auto &p : pieces) {
+                subtract_region(p, prev, remaining);
+            }
+            std::swap(pieces, remaining);
+        }
+        rects.insert(rects.end(), pieces.begin(), pieces.end());
+    }
+
+    for (const auto &r : rects) {
+        embree::Tile t = tile;
+        t.trace_x = r.origin.x - tile.x;
+        t.trace_y = r.origin.y - tile.y;
+        t.trace_width = r.size.x;
+        t.trace_height = r.size.y;
+        clipped.push_back(t);
+    }
+}
+
+void RenderEmbree::copy_tile_aovs(const uint32_t tile_id,
+                                  const std::vector<embree::Tile> &rects)
+{
+    const embree::Tile &tile = rects.front();
+    const size_t tile_plane = tile.width * tile.height;
+    const size_t fb_plane = fb_dims.x * fb_dims.y;
+    const float *src = tile_aovs[tile_id].data();
+    for (auto &layer : aov_layers) {
+        for (size_t c = 0; c < layer.channels.size(); ++c) {
+            float *dst = layer.data.data() + c * fb_plane;
+            for (const auto &r : rects) {
+                for (uint32_t j = r.trace_y; j < r.trace_y + r.trace_height; ++j) {
+                    float *dst_row = dst + (tile.y + j) * fb_dims.x + tile.x;
+                    if (r.stride == 1) {
+                        std::memcpy(dst_row + r.trace_x,
+                                    src + j * tile.width + r.trace_x,
+                                    r.trace_width * sizeof(float));
+                        continue;
+                    }
+                    // Upsample reduced resolution frames from the nearest traced pixel,
+                    // like the color in tile_to_uint8
+                    const uint32_t src_j = j - (j - r.trace_y) % r.stride;
+                    for (uint32_t i = r.trace_x; i < r.trace_x + r.trace_width; ++i) {
+                        const uint32_t src_i = i - (i - r.trace_x) % r.stride;
+                        dst_row[i] = src[src_j * tile.width + src_i];
+                    }
+                }
+            }
+            src += tile_plane;
+        }
+    }
+}
+
+void RenderEmbree::set_paged_textures(const Scene &scene)
+{
+    const uint32_t tile_dim = 64;
+    texture_cache = std::make_unique<embree::TextureCache>(texture_cache_size, tile_dim);
+
+    std::string cache_dir = texture_cache_dir;
+    if (cache_dir.empty()) {
+        cache_dir = user_cache_dir();
+        if (cache_dir.empty()) {
+            throw std::runtime_error("No user cache directory found for the texture cache");
+        }
+        cache_dir += "/textures";
+    }
+    make_directories(cache_dir);
+
+    // The containers are named by the hash of the image contents and format, so they can be
+    // reused across runs instead of re-tiling the textures each time
+    std::vector<embree::TiledTextureHeader> headers(scene.textures.size());
+    std::vector<std::string> container_names(scene.textures.size());
+    tbb::parallel_for(size_t(0), scene.textures.size(), [&](size_t i) {
+        headers[i] = embree::make_tiled_texture_header(scene.textures[i], tile_dim);
+        std::stringstream ss;
+        ss << cache_dir << "/" << std::hex << std::setw(16) << std::setfill('0')
+           << headers[i].content_hash << ".crtt";
+        container_names[i] = ss.str();
+    });
+
+    // Find the textures whose containers are missing or don't match the image, skipping
+    // duplicate images
+    std::vector<size_t> to_write;
+    {
+        std::vector<std::string> seen;
+        for (size_t i = 0; i < container_names.size(); ++i) {
+            if (std::find(seen.begin(), seen.end(), container_names[i]) != seen.end()) {
+                continue;
+            }
+            seen.push_back(container_names[i]);
+            if (!embree::tiled_texture_matches(container_names[i], headers[i])) {
+                to_write.push_back(i);
+            }
+        }
+    }
+    tbb::parallel_for(size_t(0), to_write.size(), [&](size_t i) {
+        const size_t tex = to_write[i];
+        embree::write_tiled_texture(container_names[tex], scene.textures[tex], headers[tex]);
+    });
+
+    for (size_t i = 0; i < scene.textures.size(); ++i) {
+        const uint32_t cache_id = texture_cache->add_texture(container_names[i]);
+        ispc_textures.emplace_back(texture_cache.get(), cache_id, scene.textures[i]);
+    }
+}
+
 RenderStats RenderEmbree::render(const glm::vec3 &pos,
                                  const glm::vec3 &dir,
                                  const glm::vec3 &up,
@@ -137,9 +478,14 @@ RenderStats RenderEmbree::render(const glm::vec3 &pos,
     using namespace std::chrono;
     RenderStats stats;
 
-    if (camera_changed) {
+    // Reduced resolution frames only fill in some pixels, so restart accumulation at full
+    // resolution after them
+    const bool subsample =
+        camera_changed && interaction_stride > 1 && !reprojection && render_regions.empty();
+    if (camera_changed || last_frame_subsampled) {
         frame_id = 0;
     }
+    last_frame_subsampled = subsample;
 
     glm::vec2 img_plane_size;
     img_plane_size.y = 2.f * std::tan(glm::radians(0.5f * fovy));
@@ -152,12 +498,18 @@ RenderStats RenderEmbree::render(const glm::vec3 &pos,
         -glm::normalize(glm::cross(view_params.dir_du, dir)) * img_plane_size.y;
     view_params.dir_top_left = dir - 0.5f * view_params.dir_du - 0.5f * view_params.dir_dv;
     view_params.frame_id = frame_id;
+    view_params.max_depth = max_path_depth;
+    view_params.roulette_mode = roulette_mode;
+    view_params.roulette_start_bounce = roulette_start_bounce;
 
     embree::SceneContext ispc_scene;
     ispc_scene.scene = scene_bvh->handle;
     ispc_scene.instances = scene_bvh->ispc_instances.data();
     ispc_scene.materials = material_params.data();
     ispc_scene.textures = ispc_textures.data();
+    ispc_scene.texture_handles = texture_handles.data();
+    ispc_scene.normal_matrices = scene_bvh->normal_matrices.data();
+    ispc_scene.num_instances = scene_bvh->instances.size();
     ispc_scene.lights = lights.data();
     ispc_scene.num_lights = lights.size();
 
@@ -168,26 +520,66 @@ RenderStats RenderEmbree::render(const glm::vec3 &pos,
 
     uint8_t *color = reinterpret_cast<uint8_t *>(img.data());
 
+    if (texture_cache) {
+        texture_cache->reset_stats();
+    }
+
     auto start = high_resolution_clock::now();
+
+    // Save the accumulation from the previous view before the tiles are overwritten
+    const bool reproject =
+        camera_changed && reprojection && reprojection->valid() && render_regions.empty();
+    if (reproject) {
+        tbb::parallel_for(uint32_t(0), ntiles.x * ntiles.y, [&](uint32_t tile_id) {
+            reprojection->save_tile(make_tile(tile_id, ntiles));
+        });
+    }
+
+    // The rectangles traced in each tile, only these pixels are written to the framebuffer
+    std::vector<std::vector<embree::Tile>> traced_rects(ntiles.x * ntiles.y);
     tbb::parallel_for(uint32_t(0), ntiles.x * ntiles.y, [&](uint32_t tile_id) {
-        const glm::uvec2 tile = glm::uvec2(tile_id % ntiles.x, tile_id / ntiles.x);
-        const glm::uvec2 tile_pos = tile * tile_size;
-        const glm::uvec2 tile_end = glm::min(tile_pos + tile_size, fb_dims);
-        const glm::uvec2 actual_tile_dims = tile_end - tile_pos;
-
-        embree::Tile ispc_tile;
-        ispc_tile.x = tile_pos.x;
-        ispc_tile.y = tile_pos.y;
-        ispc_tile.width = actual_tile_dims.x;
-        ispc_tile.height = actual_tile_dims.y;
-        ispc_tile.fb_width = fb_dims.x;
-        ispc_tile.fb_height = fb_dims.y;
-        ispc_tile.data = tiles[tile_id].data();
-        ispc_tile.ray_stats = ray_stats[tile_id].data();
-
-        ispc::trace_rays(&ispc_scene, &ispc_tile, &view_params);
-
-        ispc::tile_to_uint8(&ispc_tile, color);
+        embree::Tile ispc_tile = make_tile(tile_id, ntiles);
+        if (subsample) {
+            ispc_tile.stride = interaction_stride;
+        }
+        auto &rects = traced_rects[tile_id];
+        clip_tile_to_regions(ispc_tile, rects);
+        if (rects.empty()) {
+#ifdef REPORT_RAY_STATS
+            num_rays[tile_id] = 0;
+#endif
+            return;
+        }
+#ifdef REPORT_RAY_STATS
+        if (subsample || !render_regions.empty()) {
+            std::fill(ray_stats[tile_id].begin(), ray_stats[tile_id].end(), 0);
+        }
+#endif
+
+        if (reprojection && frame_id == 0) {
+            auto &counts = tile_sample_counts[tile_id];
+            std::fill(counts.begin(), counts.end(), 0.f);
+        }
+
+        for (auto &r : rects) {
+            ispc::trace_rays(&ispc_scene, &r, &view_params);
+        }
+
+        if (reproject) {
+            reprojection->reproject_tile(ispc_tile, view_params);
+        }
+
+        if (ispc_tile.aovs) {
+            copy_tile_aovs(tile_id, rects);
+        }
+
+        if (denoiser && !subsample) {
+            denoiser->gather_tile(ispc_tile);
+        } else {
+            for (auto &r : rects) {
+                ispc::tile_to_uint8(&r, color);
+            }
+        }
 #ifdef REPORT_RAY_STATS
         num_rays[tile_id] = std::accumulate(
             ray_stats[tile_id].begin(),
@@ -196,6 +588,25 @@ RenderStats RenderEmbree::render(const glm::vec3 &pos,
             [](const uint64_t &total, const uint16_t &c) { return total + c; });
 #endif
     });
+
+    if (denoiser && !subsample) {
+        denoiser->denoise();
+        // Tiles outside the render regions keep their previous denoised result
+        tbb::parallel_for(uint32_t(0), ntiles.x * ntiles.y, [&](uint32_t tile_id) {
+            auto &rects = traced_rects[tile_id];
+            if (rects.empty()) {
+                return;
+            }
+            embree::Tile ispc_tile = make_tile(tile_id, ntiles);
+            denoiser->scatter_tile(ispc_tile, denoised_tiles[tile_id].data());
+
+            for (auto &r : rects) {
+                r.data = denoised_tiles[tile_id].data();
+                ispc::tile_to_uint8(&r, color);
+            }
+        });
+    }
+
     auto end = high_resolution_clock::now();
     stats.render_time = duration_cast<nanoseconds>(end - start).count() * 1.0e-6;
 
@@ -204,6 +615,18 @@ RenderStats RenderEmbree::render(const glm::vec3 &pos,
     stats.rays_per_second = total_rays / (stats.render_time * 1.0e-3);
 #endif
 
+    if (texture_cache) {
+        stats.texture_cache_hit_rate = texture_cache->stats().hit_rate();
+    }
+
+    // Only some pixels have first hits from the current view when rendering regions, so
+    // they can't be reprojected
+    if (reprojection && render_regions.empty()) {
+        reprojection->set_view(view_params);
+    } else if (reprojection) {
+        reprojection->reset();
+    }
+
     ++frame_id;
 
     return stats;
@@ -4,9 +4,12 @@
 #include <utility>
 #include <vector>
 #include <embree3/rtcore.h>
+#include "denoiser.h"
 #include "embree_utils.h"
 #include "material.h"
 #include "render_backend.h"
+#include "reprojection.h"
+#include "texture_cache.h"
 
 struct RenderEmbree : RenderBackend {
     RTCDevice device;
@@ -15,14 +18,55 @@ struct RenderEmbree : RenderBackend {
     std::shared_ptr<embree::TopLevelBVH> scene_bvh;
 
     std::vector<embree::MaterialParams> material_params;
+    std::vector<uint32_t> texture_handles;
     std::vector<QuadLight> lights;
     std::vector<Image> textures;
     std::vector<embree::ISPCTexture2D> ispc_textures;
 
+    // If non-zero, textures are paged in from tiled containers written to texture_cache_dir
+    // through a cache holding at most texture_cache_size bytes, instead of kept in memory.
+    // An empty directory uses the textures directory in the user's cache directory
+    size_t texture_cache_size = 0;
+    std::string texture_cache_dir;
+    std::unique_ptr<embree::TextureCache> texture_cache;
+
+    // Store vertex normals and uvs in a compact interleaved quantized format
+    bool compact_vertex_attributes = false;
+
+    uint32_t max_path_depth = DEFAULT_MAX_PATH_DEPTH;
+    // The ROULETTE policy to use and the bounce to start applying it at
+    uint32_t roulette_mode = ROULETTE_THROUGHPUT;
+    uint32_t roulette_start_bounce = DEFAULT_ROULETTE_START_BOUNCE;
+
+    // Denoise the accumulated frame before displaying it
+    bool denoise = false;
+    std::unique_ptr<embree::Denoiser> denoiser;
+
+    // Reproject the accumulated frame into the new view when the camera moves, instead of
+    // restarting accumulation
+    bool temporal_reprojection = false;
+    std::unique_ptr<embree::TemporalReprojection> reprojection;
+
+    // While the camera is moving only every interaction_stride'th pixel is traced and the
+    // frame is upsampled for display, accumulation restarts at full resolution once the
+    // camera stops. Not used when reprojecting, which keeps the accumulation instead
+    uint32_t interaction_stride = 1;
+    bool last_frame_subsampled = false;
+
+    // The regions of the framebuffer to render, or empty to render the full frame
+    std::vector<RenderRegion> render_regions;
+
     uint32_t frame_id = 0;
     glm::uvec2 tile_size = glm::uvec2(64);
     std::vector<std::vector<float>> tiles;
     std::vector<std::vector<uint16_t>> ray_stats;
+    // The per-tile AOVs and denoised color, only allocated if denoising
+    std::vector<std::vector<float>> tile_albedo, tile_normal, denoised_tiles;
+    // The planar AOV channels for each tile, only allocated if AOVs are requested
+    std::vector<std::vector<float>> tile_aovs;
+    // The per-pixel sample counts and first hits, only allocated if reprojecting
+    std::vector<std::vector<float>> tile_sample_counts, tile_hit_depths;
+    std::vector<std::vector<int32_t>> tile_hit_instances;
 #ifdef REPORT_RAY_STATS
     std::vector<uint64_t> num_rays;
 #endif
@@ -31,6 +75,12 @@ struct RenderEmbree : RenderBackend {
     ~RenderEmbree();
 
     std::string name() override;
+    uint32_t supported_aovs() const override;
+    bool supports_render_regions() const override;
+    void set_render_regions(const std::vector<RenderRegion> &regions) override;
+    void read_region(const RenderRegion &region,
+                     const uint32_t fb_width,
+                     float *rgb) const override;
     void initialize(const int fb_width, const int fb_height) override;
     void set_scene(const Scene &scene) override;
     RenderStats render(const glm::vec3 &pos,
@@ -39,4 +89,21 @@ struct RenderEmbree : RenderBackend {
                        const float fovy,
                        const bool camera_changed,
                        const bool readback_framebuffer) override;
+
+private:
+    void set_paged_textures(const Scene &scene);
+
+    embree::Tile make_tile(const uint32_t tile_id, const glm::uvec2 &ntiles);
+
+    /* Split the tile into copies whose traced rectangles cover its overlap with the render
+     * regions without overlapping each other. Leaves clipped empty if the tile doesn't
+     * overlap any region, or returns just the tile if no regions are set
+     */
+    void clip_tile_to_regions(const embree::Tile &tile,
+                              std::vector<embree::Tile> &clipped) const;
+
+    /* Copy the traced rectangles of the tile's AOVs into the full frame AOV layers,
+     * upsampling them if only every stride'th pixel was traced
+     */
+    void copy_tile_aovs(const uint32_t tile_id, const std::vector<embree::Tile> &rects);
 };
@@ -0,0 +1,81 @@
+#include "reprojection.h"
+#include <cstring>
+#include "reproject_ispc.h"
+
+namespace embree {
+
+TemporalReprojection::TemporalReprojection(const glm::uvec2 &fb_dims)
+    : fb_dims(fb_dims),
+      color(fb_dims.x * fb_dims.y * 3, 0.f),
+      count(fb_dims.x * fb_dims.y, 0.f),
+      depth(count.size(), 0.f),
+      instance(count.size(), -1)
+{
+}
+
+bool TemporalReprojection::valid() const
+{
+    return has_history;
+}
+
+void TemporalReprojection::reset()
+{
+    has_history = false;
+}
+
+void TemporalReprojection::set_view(const ViewParams &view)
+{
+    prev_view = view;
+    has_history = true;
+}
+
+void TemporalReprojection::save_tile(const Tile &tile)
+{
+    for (uint32_t j = 0; j < tile.height; ++j) {
+        const size_t fb_px = (tile.y + j) * fb_dims.x + tile.x;
+        const size_t tile_px = j * tile.width;
+        std::memcpy(color.data() + fb_px * 3,
+                    tile.data + tile_px * 3,
+                    tile.width * 3 * sizeof(float));
+        std::memcpy(
+            count.data() + fb_px, tile.sample_count + tile_px, tile.width * sizeof(float));
+        std::memcpy(
+            depth.data() + fb_px, tile.hit_depth + tile_px, tile.width * sizeof(float));
+        std::memcpy(instance.data() + fb_px,
+                    tile.hit_instance + tile_px,
+                    tile.width * sizeof(int32_t));
+    }
+}
+
+void TemporalReprojection::reproject_tile(const Tile &tile, const ViewParams &view) const
+{
+    ReprojectionParams params;
+    params.pos = view.pos;
+    params.dir_du = view.dir_du;
+    params.dir_dv = view.dir_dv;
+    params.dir_top_left = view.dir_top_left;
+    params.prev_pos = prev_view.pos;
+    params.prev_dir_du = prev_view.dir_du;
+    params.prev_dir_dv = prev_view.dir_dv;
+    params.prev_dir_top_left = prev_view.dir_top_left;
+    params.history_color = color.data();
+    params.history_count = count.data();
+    params.history_depth = depth.data();
+    params.history_instance = instance.data();
+    params.fb_width = fb_dims.x;
+    params.fb_height = fb_dims.y;
+    params.confidence = confidence;
+    params.max_samples = max_samples;
+    params.depth_tolerance = depth_tolerance;
+
+    ispc::reproject_tile(tile.data,
+                         tile.sample_count,
+                         tile.hit_depth,
+                         tile.hit_instance,
+                         tile.x,
+                         tile.y,
+                         tile.width,
+                         tile.height,
+                         &params);
+}
+}
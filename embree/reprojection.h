@@ -0,0 +1,65 @@
+#pragma once
+
+#include <vector>
+#include "embree_utils.h"
+#include <glm/glm.hpp>
+
+namespace embree {
+
+// Mirrors the ReprojectionParams struct in reproject.ispc
+struct ReprojectionParams {
+    glm::vec3 pos, dir_du, dir_dv, dir_top_left;
+    glm::vec3 prev_pos, prev_dir_du, prev_dir_dv, prev_dir_top_left;
+    const float *history_color = nullptr;
+    const float *history_count = nullptr;
+    const float *history_depth = nullptr;
+    const int32_t *history_instance = nullptr;
+    uint32_t fb_width = 0;
+    uint32_t fb_height = 0;
+    float confidence = 0.f;
+    float max_samples = 0.f;
+    float depth_tolerance = 0.f;
+};
+
+/* Keeps the accumulated frame and its per pixel sample counts, first hit depths and
+ * instances from before the camera moved, so it can be reprojected into the new view to
+ * continue accumulating instead of restarting from a single sample.
+ */
+class TemporalReprojection {
+    glm::uvec2 fb_dims;
+    std::vector<float> color, count, depth;
+    std::vector<int32_t> instance;
+    ViewParams prev_view;
+    bool has_history = false;
+
+public:
+    // Weight of the history relative to the samples accumulated in it
+    float confidence = 0.9f;
+    // Cap on the samples the history can count as, limits how long stale shading persists
+    float max_samples = 64.f;
+    // Relative difference in depth at which a history pixel is treated as disoccluded
+    float depth_tolerance = 0.05f;
+
+    TemporalReprojection(const glm::uvec2 &fb_dims);
+
+    TemporalReprojection(const TemporalReprojection &) = delete;
+    TemporalReprojection &operator=(const TemporalReprojection &) = delete;
+
+    // Whether a frame has been rendered since the history was reset
+    bool valid() const;
+
+    // Discard the history, e.g. when the scene changes
+    void reset();
+
+    // Record the view the current accumulation was rendered with, called after each frame
+    void set_view(const ViewParams &view);
+
+    // Copy the tile's accumulation into the history. Must be called for all tiles before
+    // reprojecting any of them
+    void save_tile(const Tile &tile);
+
+    // Blend the history into the tile, which must have just been traced from the new view
+    // with its sample counts reset
+    void reproject_tile(const Tile &tile, const ViewParams &view) const;
+};
+}
@@ -0,0 +1,465 @@
+#include "texture_cache.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include "util.h"
+#include <glm/ext.hpp>
+
+namespace embree {
+
+namespace {
+
+int wrap(const int x, const int n)
+{
+    const int r = x % n;
+    return r < 0 ? r + n : r;
+}
+
+uint64_t make_key(const uint32_t tex_id, const uint32_t level, const uint32_t tile)
+{
+    return (uint64_t(tex_id) << 40) | (uint64_t(level) << 32) | tile;
+}
+
+uint32_t key_texture(const uint64_t key)
+{
+    return key >> 40;
+}
+
+uint32_t key_level(const uint64_t key)
+{
+    return (key >> 32) & 0xff;
+}
+
+uint32_t key_tile(const uint64_t key)
+{
+    return key & 0xffffffff;
+}
+
+}
+
+TiledTextureHeader make_tiled_texture_header(const Image &img, const uint32_t tile_dim)
+{
+    TiledTextureHeader header;
+    header.width = img.width;
+    header.height = img.height;
+    header.color_space = img.color_space;
+    header.tile_dim = tile_dim;
+    header.channels = img.channels;
+
+    const uint32_t fields[] = {header.version,
+                               header.width,
+                               header.height,
+                               header.color_space,
+                               tile_dim,
+                               header.channels};
+    header.content_hash =
+        hash_bytes(img.img.data(), img.img.size(), hash_bytes(fields, sizeof(fields)));
+    return header;
+}
+
+bool tiled_texture_matches(const std::string &fname, const TiledTextureHeader &expected)
+{
+    std::ifstream fin(fname.c_str(), std::ios::binary);
+    TiledTextureHeader header;
+    if (!fin.read(reinterpret_cast<char *>(&header), sizeof(header))) {
+        return false;
+    }
+    const bool header_matches =
+        std::strncmp(header.magic, expected.magic, 4) == 0 &&
+        header.version == expected.version && header.width == expected.width &&
+        header.height == expected.height && header.color_space == expected.color_space &&
+        header.tile_dim == expected.tile_dim && header.channels == expected.channels &&
+        header.content_hash == expected.content_hash;
+    if (!header_matches) {
+        return false;
+    }
+    fin.close();
+
+    // Make sure the rest of the file is intact, e.g. it wasn't truncated
+    try {
+        TiledTexture tex(fname);
+    } catch (const std::runtime_error &) {
+        return false;
+    }
+    return true;
+}
+
+void write_tiled_texture(const std::string &fname,
+                         const Image &img,
+                         const TiledTextureHeader &img_header)
+{
+    const uint32_t tile_dim = img_header.tile_dim;
+    // Build the mip chain in linear floating point, expanding to RGBA
+    std::vector<std::vector<glm::vec4>> mips;
+    std::vector<glm::uvec2> mip_dims;
+    {
+        std::vector<glm::vec4> level(size_t(img.width) * img.height, glm::vec4(0.f));
+        for (size_t i = 0; i < level.size(); ++i) {
+            for (int c = 0; c < img.channels; ++c) {
+                float x = img.img[i * img.channels + c] / 255.f;
+                if (img.color_space == SRGB && c < 3) {
+                    x = srgb_to_linear(x);
+                }
+                level[i][c] = x;
+            }
+        }
+        mips.push_back(std::move(level));
+        mip_dims.push_back(glm::uvec2(img.width, img.height));
+    }
+    while (mip_dims.back().x > 1 || mip_dims.back().y > 1) {
+        const glm::uvec2 prev_dims = mip_dims.back();
+        const glm::uvec2 dims = glm::max(prev_dims / 2u, glm::uvec2(1));
+        const auto &prev = mips.back();
+        std::vector<glm::vec4> level(size_t(dims.x) * dims.y);
+        for (uint32_t y = 0; y < dims.y; ++y) {
+            for (uint32_t x = 0; x < dims.x; ++x) {
+                const uint32_t x0 = std::min(2 * x, prev_dims.x - 1);
+                const uint32_t x1 = std::min(2 * x + 1, prev_dims.x - 1);
+                const uint32_t y0 = std::min(2 * y, prev_dims.y - 1);
+                const uint32_t y1 = std::min(2 * y + 1, prev_dims.y - 1);
+                level[y * dims.x + x] =
+                    0.25f * (prev[y0 * prev_dims.x + x0] + prev[y0 * prev_dims.x + x1] +
+                             prev[y1 * prev_dims.x + x0] + prev[y1 * prev_dims.x + x1]);
+            }
+        }
+        mips.push_back(std::move(level));
+        mip_dims.push_back(dims);
+    }
+
+    TiledTextureHeader header = img_header;
+    header.num_levels = mips.size();
+
+    const size_t tile_bytes = size_t(tile_dim) * tile_dim * 4;
+    std::vector<TiledTextureLevel> levels(mips.size());
+    uint64_t offset = sizeof(TiledTextureHeader) + levels.size() * sizeof(TiledTextureLevel);
+    for (size_t i = 0; i < levels.size(); ++i) {
+        levels[i].width = mip_dims[i].x;
+        levels[i].height = mip_dims[i].y;
+        levels[i].tiles_x = (mip_dims[i].x + tile_dim - 1) / tile_dim;
+        levels[i].tiles_y = (mip_dims[i].y + tile_dim - 1) / tile_dim;
+        levels[i].offset = offset;
+        offset += levels[i].tiles_x * levels[i].tiles_y * tile_bytes;
+    }
+
+    // Write to a temporary file and move it into place once it's complete, so an interrupted
+    // write never leaves a container which looks valid but is missing tiles
+    const std::string tmp_fname = fname + ".tmp";
+    std::ofstream fout(tmp_fname.c_str(), std::ios::binary);
+    if (!fout) {
+        throw std::runtime_error("Failed to open " + tmp_fname + " for writing");
+    }
+    fout.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    fout.write(reinterpret_cast<const char *>(levels.data()),
+               levels.size() * sizeof(TiledTextureLevel));
+
+    std::vector<uint8_t> tile(tile_bytes, 0);
+    for (size_t i = 0; i < levels.size(); ++i) {
+        const auto &lvl = levels[i];
+        for (uint32_t ty = 0; ty < lvl.tiles_y; ++ty) {
+            for (uint32_t tx = 0; tx < lvl.tiles_x; ++tx) {
+                for (uint32_t y = 0; y < tile_dim; ++y) {
+                    const uint32_t py = std::min(ty * tile_dim + y, lvl.height - 1);
+                    for (uint32_t x = 0; x < tile_dim; ++x) {
+                        const uint32_t px = std::min(tx * tile_dim + x, lvl.width - 1);
+                        const glm::vec4 &t = mips[i][py * lvl.width + px];
+                        for (int c = 0; c < 4; ++c) {
+                            float v = t[c];
+                            if (img.color_space == SRGB && c < 3) {
+                                v = linear_to_srgb(v);
+                            }
+                            tile[(y * tile_dim + x) * 4 + c] =
+                                glm::clamp(v * 255.f + 0.5f, 0.f, 255.f);
+                        }
+                    }
+                }
+                fout.write(reinterpret_cast<const char *>(tile.data()), tile.size());
+            }
+        }
+    }
+    fout.close();
+    if (!fout) {
+        std::remove(tmp_fname.c_str());
+        throw std::runtime_error("Failed to write " + tmp_fname);
+    }
+
+    // Replace any stale container of the same name
+    std::remove(fname.c_str());
+    if (std::rename(tmp_fname.c_str(), fname.c_str()) != 0) {
+        std::remove(tmp_fname.c_str());
+        throw std::runtime_error("Failed to move " + tmp_fname + " to " + fname);
+    }
+}
+
+TiledTexture::TiledTexture(const std::string &fname) : mapping(fname)
+{
+    if (mapping.nbytes() < sizeof(TiledTextureHeader)) {
+        throw std::runtime_error("Invalid tiled texture file " + fname);
+    }
+    std::memcpy(&header, mapping.data(), sizeof(TiledTextureHeader));
+    if (std::strncmp(header.magic, "CRTT", 4) != 0 ||
+        header.version != TiledTextureHeader().version) {
+        throw std::runtime_error("Invalid tiled texture file " + fname);
+    }
+
+    // The level table and every level's tiles must be within the file
+    const size_t file_bytes = mapping.nbytes();
+    if (header.tile_dim == 0 || header.tile_dim > 4096 ||
+        (file_bytes - sizeof(TiledTextureHeader)) / sizeof(TiledTextureLevel) <
+            header.num_levels) {
+        throw std::runtime_error("Corrupt tiled texture file " + fname);
+    }
+    levels.resize(header.num_levels);
+    std::memcpy(levels.data(),
+                mapping.data() + sizeof(TiledTextureHeader),
+                levels.size() * sizeof(TiledTextureLevel));
+
+    const uint64_t tile_bytes = uint64_t(header.tile_dim) * header.tile_dim * 4;
+    for (const auto &lvl : levels) {
+        const uint64_t num_tiles = uint64_t(lvl.tiles_x) * lvl.tiles_y;
+        if (lvl.offset > file_bytes || num_tiles > (file_bytes - lvl.offset) / tile_bytes) {
+            throw std::runtime_error("Corrupt tiled texture file " + fname);
+        }
+    }
+
+    for (const auto &lvl : levels) {
+        const size_t num_tiles = size_t(lvl.tiles_x) * lvl.tiles_y;
+        std::unique_ptr<std::atomic<int32_t>[]> r(new std::atomic<int32_t>[num_tiles]);
+        for (size_t i = 0; i < num_tiles; ++i) {
+            r[i].store(-1);
+        }
+        resident.push_back(std::move(r));
+    }
+}
+
+float TextureCacheStats::hit_rate() const
+{
+    if (hits + misses == 0) {
+        return -1.f;
+    }
+    return static_cast<float>(hits) / (hits + misses);
+}
+
+TextureCache::TextureCache(const size_t max_bytes, const uint32_t tile_dim)
+    : tile_dim(tile_dim),
+      tile_bytes(size_t(tile_dim) * tile_dim * 4),
+      num_slots(std::max(max_bytes / tile_bytes, size_t(1))),
+      slots(new Slot[num_slots]),
+      tile_data(num_slots * tile_bytes, 0)
+{
+    for (size_t i = 0; i < num_slots; ++i) {
+        slots[i].version.store(0);
+        slots[i].key.store(EMPTY_KEY);
+        slots[i].referenced.store(false);
+    }
+    for (size_t i = 0; i < srgb_to_linear_lut.size(); ++i) {
+        const float x = srgb_to_linear(i / 255.f);
+        srgb_to_linear_lut[i] = glm::clamp(x * 255.f, 0.f, 255.f);
+    }
+}
+
+uint32_t TextureCache::add_texture(const std::string &fname)
+{
+    textures.push_back(std::make_unique<TiledTexture>(fname));
+    if (textures.back()->header.tile_dim != tile_dim) {
+        throw std::runtime_error("Tiled texture " + fname +
+                                 " does not match the texture cache tile size");
+    }
+    return textures.size() - 1;
+}
+
+const TiledTexture &TextureCache::texture(const uint32_t tex_id) const
+{
+    return *textures[tex_id];
+}
+
+void TextureCache::fetch_texel(
+    const uint32_t tex_id, const uint32_t level, int x, int y, float *rgba)
+{
+    const TiledTexture &tex = *textures[tex_id];
+    const TiledTextureLevel &lvl = tex.levels[level];
+    x = wrap(x, lvl.width);
+    y = wrap(y, lvl.height);
+
+    const uint32_t tile = (y / tile_dim) * lvl.tiles_x + x / tile_dim;
+    const uint64_t key = make_key(tex_id, level, tile);
+    const size_t texel_offset = ((y % tile_dim) * tile_dim + x % tile_dim) * 4;
+
+    ThreadCache &local = thread_caches.local();
+    MicroEntry &entry = local.entries[(key ^ (key >> 32)) % local.entries.size()];
+
+    uint8_t texel[4];
+    if (entry.key == key && read_texel(entry.slot, key, texel_offset, texel)) {
+        ++local.hits;
+    } else {
+        int32_t slot = tex.resident[level][tile].load(std::memory_order_acquire);
+        if (slot >= 0 && read_texel(slot, key, texel_offset, texel)) {
+            ++local.hits;
+        } else {
+            slot = fault_tile(tex_id, level, tile, key, texel_offset, texel);
+            ++local.misses;
+        }
+        entry.key = key;
+        entry.slot = slot;
+    }
+
+    for (int c = 0; c < 4; ++c) {
+        rgba[c] = texel[c] / 255.f;
+    }
+}
+
+void TextureCache::sample(
+    const uint32_t tex_id, const float u, const float v, const float lod, float *rgba)
+{
+    const TiledTexture &tex = *textures[tex_id];
+    const uint32_t level =
+        glm::clamp(int(lod + 0.5f), 0, static_cast<int>(tex.levels.size()) - 1);
+    const TiledTextureLevel &lvl = tex.levels[level];
+
+    const float ux = u * lvl.width - 0.5f;
+    const float uy = v * lvl.height - 0.5f;
+    const int x = std::floor(ux);
+    const int y = std::floor(uy);
+    const float tx = ux - x;
+    const float ty = uy - y;
+
+    float s00[4], s10[4], s01[4], s11[4];
+    fetch_texel(tex_id, level, x, y, s00);
+    fetch_texel(tex_id, level, x + 1, y, s10);
+    fetch_texel(tex_id, level, x, y + 1, s01);
+    fetch_texel(tex_id, level, x + 1, y + 1, s11);
+    for (int c = 0; c < 4; ++c) {
+        rgba[c] = s00[c] * (1.f - tx) * (1.f - ty) + s10[c] * tx * (1.f - ty) +
+                  s01[c] * (1.f - tx) * ty + s11[c] * tx * ty;
+    }
+}
+
+bool TextureCache::read_texel(const int32_t slot,
+                              const uint64_t key,
+                              const size_t texel_offset,
+                              uint8_t *texel)
+{
+    Slot &s = slots[slot];
+    const uint32_t version = s.version.load(std::memory_order_acquire);
+    // An odd version means the slot is being written to
+    if ((version & 1) || s.key.load(std::memory_order_relaxed) != key) {
+        return false;
+    }
+    std::memcpy(texel, &tile_data[slot * tile_bytes + texel_offset], 4);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (s.version.load(std::memory_order_relaxed) != version) {
+        return false;
+    }
+    s.referenced.store(true, std::memory_order_relaxed);
+    return true;
+}
+
+int32_t TextureCache::fault_tile(const uint32_t tex_id,
+                                 const uint32_t level,
+                                 const uint32_t tile,
+                                 const uint64_t key,
+                                 const size_t texel_offset,
+                                 uint8_t *texel)
+{
+    std::lock_guard<std::mutex> lock(fault_mutex);
+    TiledTexture &tex = *textures[tex_id];
+
+    // Another thread may have faulted the tile in while we were waiting on the lock,
+    // since we hold the lock no one can be writing the tile data now
+    int32_t slot = tex.resident[level][tile].load(std::memory_order_relaxed);
+    if (slot >= 0 && slots[slot].key.load(std::memory_order_relaxed) == key) {
+        std::memcpy(texel, &tile_data[slot * tile_bytes + texel_offset], 4);
+        slots[slot].referenced.store(true, std::memory_order_relaxed);
+        return slot;
+    }
+
+    slot = choose_victim();
+    Slot &s = slots[slot];
+    const uint32_t version = s.version.load(std::memory_order_relaxed);
+    s.version.store(version + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    const uint64_t prev_key = s.key.load(std::memory_order_relaxed);
+    if (prev_key != EMPTY_KEY) {
+        TiledTexture &prev_tex = *textures[key_texture(prev_key)];
+        prev_tex.resident[key_level(prev_key)][key_tile(prev_key)].store(
+            -1, std::memory_order_relaxed);
+        ++evictions;
+    }
+
+    s.key.store(key, std::memory_order_relaxed);
+    uint8_t *dst = &tile_data[slot * tile_bytes];
+    load_tile(tex, level, tile, dst);
+    std::memcpy(texel, dst + texel_offset, 4);
+
+    s.version.store(version + 2, std::memory_order_release);
+    s.referenced.store(true, std::memory_order_relaxed);
+    tex.resident[level][tile].store(slot, std::memory_order_release);
+    return slot;
+}
+
+size_t TextureCache::choose_victim()
+{
+    if (slots_used < num_slots) {
+        return slots_used++;
+    }
+    // Sweep the clock hand around, giving recently referenced tiles a second chance
+    while (true) {
+        const size_t slot = clock_hand;
+        clock_hand = (clock_hand + 1) % num_slots;
+        if (!slots[slot].referenced.exchange(false, std::memory_order_relaxed)) {
+            return slot;
+        }
+    }
+}
+
+void TextureCache::load_tile(const TiledTexture &tex,
+                             const uint32_t level,
+                             const uint32_t tile,
+                             uint8_t *dst) const
+{
+    const uint8_t *src = tex.mapping.data() + tex.levels[level].offset + tile * tile_bytes;
+    std::memcpy(dst, src, tile_bytes);
+
+    // Linearize sRGB textures as the tiles are paged in, since we don't have fancy
+    // sRGB texture interpolation support in hardware
+    if (tex.header.color_space == SRGB) {
+        for (size_t i = 0; i < tile_bytes; i += 4) {
+            dst[i] = srgb_to_linear_lut[dst[i]];
+            dst[i + 1] = srgb_to_linear_lut[dst[i + 1]];
+            dst[i + 2] = srgb_to_linear_lut[dst[i + 2]];
+        }
+    }
+}
+
+TextureCacheStats TextureCache::stats()
+{
+    TextureCacheStats s;
+    for (const auto &local : thread_caches) {
+        s.hits += local.hits;
+        s.misses += local.misses;
+    }
+    s.evictions = evictions;
+    s.resident_tiles = slots_used;
+    s.capacity_tiles = num_slots;
+    return s;
+}
+
+void TextureCache::reset_stats()
+{
+    for (auto &local : thread_caches) {
+        local.hits = 0;
+        local.misses = 0;
+    }
+    evictions = 0;
+}
+}
+
+extern "C" void texture_cache_sample(
+    void *cache, uint32_t tex_id, float u, float v, float lod, float *rgba)
+{
+    reinterpret_cast<embree::TextureCache *>(cache)->sample(tex_id, u, v, lod, rgba);
+}
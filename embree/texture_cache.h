@@ -0,0 +1,170 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <tbb/enumerable_thread_specific.h>
+#include "file_mapping.h"
+#include "material.h"
+
+namespace embree {
+
+/* The tiled texture container stores each level of the mip chain split into
+ * fixed size RGBA8 tiles, so that a single tile can be paged in from disk
+ * without decoding the rest of the image. Tiles along the right and bottom edges
+ * are padded out to the full tile size by replicating the edge texels.
+ */
+struct TiledTextureHeader {
+    char magic[4] = {'C', 'R', 'T', 'T'};
+    uint32_t version = 2;
+    uint32_t width = 0;
+    uint32_t height = 0;
+    uint32_t color_space = LINEAR;
+    uint32_t tile_dim = 0;
+    uint32_t num_levels = 0;
+    // Channels of the source image, the tiles are always RGBA
+    uint32_t channels = 0;
+    // Hash of the source image's pixels and the fields above, which names the container
+    uint64_t content_hash = 0;
+};
+
+// Make the header for the image's container, with all but the number of levels filled in
+TiledTextureHeader make_tiled_texture_header(const Image &img, const uint32_t tile_dim);
+
+// Returns true if the file is a complete container written for the header's image
+bool tiled_texture_matches(const std::string &fname, const TiledTextureHeader &expected);
+
+struct TiledTextureLevel {
+    uint32_t width = 0;
+    uint32_t height = 0;
+    uint32_t tiles_x = 0;
+    uint32_t tiles_y = 0;
+    // Offset of the level's first tile from the start of the file
+    uint64_t offset = 0;
+};
+
+// Write the image out as a tiled, mip-mapped texture container with the header made for it
+void write_tiled_texture(const std::string &fname,
+                         const Image &img,
+                         const TiledTextureHeader &img_header);
+
+struct TiledTexture {
+    FileMapping mapping;
+    TiledTextureHeader header;
+    std::vector<TiledTextureLevel> levels;
+    // The cache slot each tile is resident in for each level, or -1 if it's not resident
+    std::vector<std::unique_ptr<std::atomic<int32_t>[]>> resident;
+
+    TiledTexture(const std::string &fname);
+
+    TiledTexture(const TiledTexture &) = delete;
+    TiledTexture &operator=(const TiledTexture &) = delete;
+};
+
+struct TextureCacheStats {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t evictions = 0;
+    size_t resident_tiles = 0;
+    size_t capacity_tiles = 0;
+
+    // Returns the fraction of tile lookups which hit in the cache, or -1 if no lookups were made
+    float hit_rate() const;
+};
+
+/* A bounded cache of texture tiles shared by all the render threads. Lookups of
+ * resident tiles are lock-free: each slot is guarded by a sequence counter that
+ * readers validate after copying the texel out, so a tile being evicted concurrently
+ * just causes the reader to fall back to the slow path. Tiles are faulted in from
+ * the mapped container under a lock, evicting with the CLOCK approximation of LRU.
+ */
+class TextureCache {
+    static const uint64_t EMPTY_KEY = ~uint64_t(0);
+
+    struct Slot {
+        std::atomic<uint32_t> version;
+        std::atomic<uint64_t> key;
+        std::atomic<bool> referenced;
+    };
+
+    struct MicroEntry {
+        uint64_t key = EMPTY_KEY;
+        int32_t slot = -1;
+    };
+
+    // Each thread keeps a small direct-mapped cache of the tiles it's recently
+    // accessed, along with its hit/miss counters to avoid contention on shared counters
+    struct ThreadCache {
+        std::array<MicroEntry, 16> entries;
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+    };
+
+    uint32_t tile_dim;
+    size_t tile_bytes;
+    size_t num_slots;
+
+    std::unique_ptr<Slot[]> slots;
+    std::vector<uint8_t> tile_data;
+
+    std::vector<std::unique_ptr<TiledTexture>> textures;
+    tbb::enumerable_thread_specific<ThreadCache> thread_caches;
+
+    std::mutex fault_mutex;
+    size_t slots_used = 0;
+    size_t clock_hand = 0;
+    uint64_t evictions = 0;
+
+    std::array<uint8_t, 256> srgb_to_linear_lut;
+
+    bool read_texel(const int32_t slot,
+                    const uint64_t key,
+                    const size_t texel_offset,
+                    uint8_t *texel);
+
+    int32_t fault_tile(const uint32_t tex_id,
+                       const uint32_t level,
+                       const uint32_t tile,
+                       const uint64_t key,
+                       const size_t texel_offset,
+                       uint8_t *texel);
+
+    size_t choose_victim();
+
+    void load_tile(const TiledTexture &tex,
+                   const uint32_t level,
+                   const uint32_t tile,
+                   uint8_t *dst) const;
+
+public:
+    // Create a cache holding at most max_bytes of tile data
+    TextureCache(const size_t max_bytes, const uint32_t tile_dim);
+
+    TextureCache(const TextureCache &) = delete;
+    TextureCache &operator=(const TextureCache &) = delete;
+
+    // Add a tiled texture container to the cache, returns the ID to look it up by
+    uint32_t add_texture(const std::string &fname);
+
+    // Fetch the RGBA texel, faulting its tile in if it's not resident
+    void fetch_texel(const uint32_t tex_id, const uint32_t level, int x, int y, float *rgba);
+
+    // Bilinearly filter the texture at the mip level nearest the lod
+    void sample(const uint32_t tex_id, const float u, const float v, const float lod, float *rgba);
+
+    const TiledTexture &texture(const uint32_t tex_id) const;
+
+    // Must not be called while the render threads are accessing the cache
+    TextureCacheStats stats();
+
+    // Must not be called while the render threads are accessing the cache
+    void reset_stats();
+};
+}
+
+// Called from the ISPC texture lookups for textures paged through the cache
+extern "C" void texture_cache_sample(
+    void *cache, uint32_t tex_id, float u, float v, float lod, float *rgba);
@@ -1,5 +1,7 @@
 #include <algorithm>
 #include <array>
+#include <chrono>
+#include <cmath>
 #include <iostream>
 #include <memory>
 #include <numeric>
@@ -7,6 +9,7 @@
 #include <vector>
 #include <SDL.h>
 #include "arcball_camera.h"
+#include "exr.h"
 #include "imgui.h"
 #include "scene.h"
 #include "stb_image_write.h"
@@ -15,6 +18,9 @@
 #include "util/display/display.h"
 #include "util/display/gldisplay.h"
 #include "util/display/imgui_impl_sdl.h"
+#if ENABLE_DISTRIBUTED
+#include "distributed.h"
+#endif
 
 #if ENABLE_OSPRAY
 #include "ospray/render_ospray.h"
@@ -67,6 +73,48 @@ const std::string USAGE =
     "\t-camera <n>            If the scene contains multiple cameras, specify which\n"
     "\t                       should be used. Defaults to the first camera\n"
     "\t-img <x> <y>           Specify the window dimensions. Defaults to 1280x720\n"
+    "\t-headless <frames>     Render the number of frames without opening a window, then\n"
+    "\t                       save the image and exit\n"
+    "\t-aov <list>            Comma separated list of AOVs to save along with the image\n"
+    "\t                       to chameleonrt.exr, from: depth, normal, albedo, instance\n"
+    "\t                       and material\n"
+    "\t-region <x y w h>      Only render the region of the image, can be repeated to\n"
+    "\t                       render multiple regions. Not supported by all backends\n"
+    "\t-spin-instance <n>     Rotate instance n about its y axis while rendering\n"
+    "\t                       interactively. Not supported by all backends\n"
+#if ENABLE_DISTRIBUTED
+    "\t-coordinator <addr>    Render the image on worker processes connecting to the\n"
+    "\t                       address, either <host>:<port> or unix:<path>. The number\n"
+    "\t                       of samples per pixel is set by -headless\n"
+    "\t-spawn-workers <n>     Launch n local workers for the coordinator\n"
+    "\t-worker <addr>         Render tiles for the coordinator at the address. Workers\n"
+    "\t                       must be run with the same scene, camera and image size\n"
+#endif
+#if ENABLE_EMBREE
+    "\t-texture-cache <MB>    Embree only: page textures in from tiled files on disk\n"
+    "\t                       through a cache of the given size\n"
+    "\t-texture-cache-dir <dir>\n"
+    "\t                       Embree only: directory to write the tiled textures paged by\n"
+    "\t                       -texture-cache to. Defaults to the user's cache directory\n"
+    "\t-compact-attributes    Embree only: store quantized vertex normals and uvs\n"
+    "\t-max-depth <n>         Embree only: set the maximum path depth. Defaults to 5\n"
+    "\t-rr-start <n>          Embree only: set the bounce to start Russian roulette at.\n"
+    "\t                       Defaults to 4\n"
+    "\t-rr-mode <mode>        Embree only: set the Russian roulette policy, one of\n"
+    "\t                       throughput (default), efficiency or none\n"
+    "\t-denoise               Embree only: denoise the frame before displaying it\n"
+    "\t-reproject             Embree only: reproject the accumulated frame when the camera\n"
+    "\t                       moves instead of restarting accumulation\n"
+    "\t-preview-stride <n>    Embree only: trace every n'th pixel while the camera is\n"
+    "\t                       moving and upsample the frame for display\n"
+#endif
+#if ENABLE_VULKAN
+    "\t-spp-per-launch <n>    Vulkan only: trace n samples per pixel in each frame. With\n"
+    "\t                       -headless the frame count is taken as the samples per\n"
+    "\t                       pixel to render, which are traced n at a time\n"
+    "\t-pipeline-cache <dir>  Vulkan only: keep the compiled pipeline cache in the directory\n"
+    "\t                       to speed up later runs. The pipeline isn't cached by default\n"
+#endif
     "\n";
 
 int win_width = 1280;
@@ -74,6 +122,10 @@ int win_height = 720;
 
 void run_app(const std::vector<std::string> &args, SDL_Window *window, Display *display);
 
+uint32_t parse_aov_list(const std::string &list);
+
+void save_exr(const std::string &fname, const RenderBackend &renderer);
+
 glm::vec2 transform_mouse(glm::vec2 in)
 {
     return glm::vec2(in.x * 2.f / win_width - 1.f, 1.f - 2.f * in.y / win_height);
@@ -91,6 +143,26 @@ int main(int argc, const char **argv)
         return 1;
     }
 
+    // The image size is shared by all the modes, so parse it before picking one
+    for (size_t i = 0; i < args.size(); ++i) {
+        if (args[i] == "-img") {
+            win_width = std::stoi(args[++i]);
+            win_height = std::stoi(args[++i]);
+        }
+    }
+
+    // In headless mode we don't create a window or display, and the renderers
+    // fall back to reading back the framebuffer
+    auto is_headless_arg = [](const std::string &a) {
+        return a == "-headless" || a == "-coordinator" || a == "-worker";
+    };
+    if (std::find_if(args.begin(), args.end(), is_headless_arg) != args.end()) {
+        ImGui::CreateContext();
+        run_app(args, nullptr, nullptr);
+        ImGui::DestroyContext();
+        return 0;
+    }
+
     if (SDL_Init(SDL_INIT_EVERYTHING) != 0) {
         std::cerr << "Failed to init SDL: " << SDL_GetError() << "\n";
         return -1;
@@ -100,11 +172,6 @@ int main(int argc, const char **argv)
     std::string display_frontend = "gl";
     uint32_t window_flags = SDL_WINDOW_RESIZABLE;
     for (size_t i = 0; i < args.size(); ++i) {
-        if (args[i] == "-img") {
-            win_width = std::stoi(args[++i]);
-            win_height = std::stoi(args[++i]);
-            continue;
-        }
 #if ENABLE_DXR
         if (args[i] == "-dxr") {
             display_frontend = "dx";
@@ -207,6 +274,24 @@ void run_app(const std::vector<std::string> &args, SDL_Window *window, Display *
     size_t camera_id = 0;
     std::string backend_arg;
     std::string validation_img_prefix;
+    size_t texture_cache_mb = 0;
+    std::string texture_cache_dir;
+    bool compact_attributes = false;
+    int max_path_depth = -1;
+    int roulette_start_bounce = -1;
+    std::string roulette_mode;
+    bool denoise = false;
+    bool reproject = false;
+    int interaction_stride = 1;
+    int headless_frames = 0;
+    int samples_per_launch = 1;
+    std::string pipeline_cache_dir;
+    std::string aov_list;
+    std::vector<RenderRegion> render_regions;
+    int spin_instance = -1;
+    std::string coordinator_address;
+    std::string worker_address;
+    size_t spawn_worker_count = 0;
     for (size_t i = 1; i < args.size(); ++i) {
         if (args[i] == "-eye") {
             eye.x = std::stof(args[++i]);
@@ -230,6 +315,47 @@ void run_app(const std::vector<std::string> &args, SDL_Window *window, Display *
             camera_id = std::stol(args[++i]);
         } else if (args[i] == "-validation") {
             validation_img_prefix = args[++i];
+        } else if (args[i] == "-texture-cache") {
+            texture_cache_mb = std::stoul(args[++i]);
+        } else if (args[i] == "-texture-cache-dir") {
+            texture_cache_dir = args[++i];
+        } else if (args[i] == "-compact-attributes") {
+            compact_attributes = true;
+        } else if (args[i] == "-max-depth") {
+            max_path_depth = std::stoi(args[++i]);
+        } else if (args[i] == "-rr-start") {
+            roulette_start_bounce = std::stoi(args[++i]);
+        } else if (args[i] == "-rr-mode") {
+            roulette_mode = args[++i];
+        } else if (args[i] == "-denoise") {
+            denoise = true;
+        } else if (args[i] == "-reproject") {
+            reproject = true;
+        } else if (args[i] == "-preview-stride") {
+            interaction_stride = std::max(std::stoi(args[++i]), 1);
+        } else if (args[i] == "-headless") {
+            headless_frames = std::stoi(args[++i]);
+        } else if (args[i] == "-spp-per-launch") {
+            samples_per_launch = std::max(std::stoi(args[++i]), 1);
+        } else if (args[i] == "-pipeline-cache") {
+            pipeline_cache_dir = args[++i];
+        } else if (args[i] == "-aov") {
+            aov_list = args[++i];
+        } else if (args[i] == "-region") {
+            RenderRegion region;
+            region.origin.x = std::stoul(args[++i]);
+            region.origin.y = std::stoul(args[++i]);
+            region.size.x = std::stoul(args[++i]);
+            region.size.y = std::stoul(args[++i]);
+            render_regions.push_back(region);
+        } else if (args[i] == "-spin-instance") {
+            spin_instance = std::stoi(args[++i]);
+        } else if (args[i] == "-coordinator") {
+            coordinator_address = args[++i];
+        } else if (args[i] == "-spawn-workers") {
+            spawn_worker_count = std::stoul(args[++i]);
+        } else if (args[i] == "-worker") {
+            worker_address = args[++i];
         }
 #if ENABLE_OSPRAY
         else if (args[i] == "-ospray") {
@@ -324,10 +450,121 @@ void run_app(const std::vector<std::string> &args, SDL_Window *window, Display *
         std::exit(1);
     }
 
-    display->resize(win_width, win_height);
+#if ENABLE_EMBREE
+    if (backend_arg == "-embree") {
+        RenderEmbree *render_embree = reinterpret_cast<RenderEmbree *>(renderer.get());
+        render_embree->texture_cache_size = texture_cache_mb * 1024 * 1024;
+        render_embree->texture_cache_dir = texture_cache_dir;
+        render_embree->compact_vertex_attributes = compact_attributes;
+        render_embree->denoise = denoise;
+        render_embree->temporal_reprojection = reproject;
+        render_embree->interaction_stride = interaction_stride;
+        if (max_path_depth > 0) {
+            render_embree->max_path_depth = max_path_depth;
+        }
+        if (roulette_start_bounce >= 0) {
+            render_embree->roulette_start_bounce = roulette_start_bounce;
+        }
+        if (roulette_mode == "throughput") {
+            render_embree->roulette_mode = ROULETTE_THROUGHPUT;
+        } else if (roulette_mode == "efficiency") {
+            render_embree->roulette_mode = ROULETTE_EFFICIENCY;
+        } else if (roulette_mode == "none") {
+            render_embree->roulette_mode = ROULETTE_NONE;
+        } else if (!roulette_mode.empty()) {
+            std::cout << "Error: Unrecognized Russian roulette mode " << roulette_mode << "\n";
+            std::exit(1);
+        }
+    }
+#endif
+#if ENABLE_VULKAN
+    RenderVulkan *render_vulkan = nullptr;
+    if (backend_arg == "-vulkan") {
+        render_vulkan = reinterpret_cast<RenderVulkan *>(renderer.get());
+        render_vulkan->samples_per_launch = samples_per_launch;
+        render_vulkan->pipeline_cache_dir = pipeline_cache_dir;
+    }
+#endif
+
+    if (!aov_list.empty()) {
+        const uint32_t aovs = parse_aov_list(aov_list);
+        renderer->aovs = aovs & renderer->supported_aovs();
+        if (renderer->aovs != aovs) {
+            std::cout << "Warning: Some of the requested AOVs are not supported by "
+                      << renderer->name() << "\n";
+        }
+    }
+
+    if (display) {
+        display->resize(win_width, win_height);
+    }
     renderer->initialize(win_width, win_height);
 
+    if (!render_regions.empty()) {
+        if (renderer->supports_render_regions()) {
+            renderer->set_render_regions(render_regions);
+        } else {
+            std::cout << "Warning: Render regions are not supported by " << renderer->name()
+                      << ", rendering the full image\n";
+        }
+    }
+
+#if ENABLE_DISTRIBUTED
+    // The coordinator only hands out tiles and merges the results, so it doesn't need
+    // to load the scene
+    if (!coordinator_address.empty()) {
+        glm::uvec2 tile_size(64);
+#if ENABLE_EMBREE
+        if (backend_arg == "-embree") {
+            tile_size = reinterpret_cast<RenderEmbree *>(renderer.get())->tile_size;
+        }
+#endif
+        const uint32_t spp = std::max(headless_frames, 1);
+        RenderCoordinator coordinator(
+            coordinator_address, glm::uvec2(win_width, win_height), tile_size, spp);
+
+        // The local workers run with our arguments, connecting as workers to our address
+        std::vector<std::string> worker_args;
+        for (size_t i = 0; i < args.size(); ++i) {
+            if (args[i] == "-spawn-workers") {
+                ++i;
+                continue;
+            }
+            worker_args.push_back(args[i] == "-coordinator" ? "-worker" : args[i]);
+        }
+        const std::vector<int> workers = spawn_workers(worker_args, spawn_worker_count);
+
+        std::cout << "Waiting for workers on " << coordinator_address << "\n";
+        using namespace std::chrono;
+        auto start = high_resolution_clock::now();
+        coordinator.run(workers);
+        auto end = high_resolution_clock::now();
+        wait_for_workers(workers);
+        std::cout << "Rendered " << spp << " samples per pixel in "
+                  << duration_cast<milliseconds>(end - start).count() << "ms\n";
+
+        const std::vector<float> &rgb = coordinator.image();
+        std::vector<uint8_t> color(win_width * win_height * 4, 255);
+        for (size_t i = 0; i < size_t(win_width) * win_height; ++i) {
+            for (size_t c = 0; c < 3; ++c) {
+                const float x = glm::clamp(linear_to_srgb(rgb[i * 3 + c]), 0.f, 1.f);
+                color[i * 4 + c] = static_cast<uint8_t>(x * 255.f);
+            }
+        }
+        stbi_write_png("chameleonrt.png",
+                       win_width,
+                       win_height,
+                       4,
+                       color.data(),
+                       4 * win_width);
+        std::cout << "Image saved to chameleonrt.png\n";
+        return;
+    }
+#endif
+
     std::string scene_info;
+    // The scene's instance transforms, if an instance is being spun
+    std::vector<glm::mat4> instance_transforms;
     {
         Scene scene(scene_file);
 
@@ -348,6 +585,36 @@ void run_app(const std::vector<std::string> &args, SDL_Window *window, Display *
 
         renderer->set_scene(scene);
 
+        const SceneBuildStats &build_stats = renderer->scene_build_stats;
+        if (build_stats.upload_time >= 0) {
+            std::cout << "Scene upload: " << build_stats.upload_time
+                      << "ms, BLAS build: " << build_stats.blas_build_time
+                      << "ms, TLAS build: " << build_stats.tlas_build_time << "ms\n";
+        }
+        if (build_stats.memory_allocations >= 0) {
+            std::cout << "Scene memory: " << build_stats.memory_allocations
+                      << " allocations in " << build_stats.device_memory_blocks
+                      << " device memory blocks, " << build_stats.memory_reserved_mb
+                      << "MB reserved\n";
+        }
+
+        if (spin_instance >= 0) {
+            if (size_t(spin_instance) >= scene.instances.size()) {
+                std::cout << "Error: -spin-instance " << spin_instance
+                          << " is out of range, the scene has " << scene.instances.size()
+                          << " instances\n";
+                std::exit(1);
+            }
+            if (renderer->supports_instance_updates()) {
+                for (const auto &inst : scene.instances) {
+                    instance_transforms.push_back(inst.transform);
+                }
+            } else {
+                std::cout << "Warning: Moving instances is not supported by "
+                          << renderer->name() << "\n";
+            }
+        }
+
         if (!got_camera_args && !scene.cameras.empty()) {
             eye = scene.cameras[camera_id].position;
             center = scene.cameras[camera_id].center;
@@ -358,6 +625,71 @@ void run_app(const std::vector<std::string> &args, SDL_Window *window, Display *
 
     ArcballCamera camera(eye, center, up);
 
+#if ENABLE_DISTRIBUTED
+    if (!worker_address.empty()) {
+        run_render_worker(worker_address,
+                          *renderer,
+                          glm::uvec2(win_width, win_height),
+                          camera.eye(),
+                          camera.dir(),
+                          camera.up(),
+                          fov_y);
+        return;
+    }
+#endif
+
+    if (!display) {
+        // Backends which can trace multiple samples per launch render the samples in fewer
+        // frames, with the last frame taking the remainder
+        int launch_samples = 1;
+#if ENABLE_VULKAN
+        if (render_vulkan) {
+            launch_samples = samples_per_launch;
+        }
+#endif
+        float render_time = 0.f;
+        float trace_time = 0.f;
+        float readback_time = 0.f;
+        int frames = 0;
+        for (int samples = 0; samples < headless_frames; ++frames) {
+            const int frame_samples = std::min(launch_samples, headless_frames - samples);
+#if ENABLE_VULKAN
+            if (render_vulkan) {
+                render_vulkan->samples_per_launch = frame_samples;
+            }
+#endif
+            samples += frame_samples;
+            RenderStats stats = renderer->render(camera.eye(),
+                                                 camera.dir(),
+                                                 camera.up(),
+                                                 fov_y,
+                                                 frames == 0,
+                                                 samples == headless_frames);
+            render_time += stats.render_time;
+            // Not every frame reports device timings, e.g., if it's still in flight
+            trace_time += std::max(stats.trace_time, 0.f);
+            readback_time += std::max(stats.readback_time, 0.f);
+        }
+        std::cout << "Rendered " << frames << " frames in " << render_time << "ms\n";
+        if (trace_time > 0) {
+            std::cout << "Device time tracing rays: " << trace_time
+                      << "ms, reading back the frame: " << readback_time << "ms\n";
+        }
+
+        stbi_write_png("chameleonrt.png",
+                       win_width,
+                       win_height,
+                       4,
+                       renderer->img.data(),
+                       4 * win_width);
+        std::cout << "Image saved to chameleonrt.png\n";
+        if (!renderer->aov_layers.empty()) {
+            save_exr("chameleonrt.exr", *renderer);
+            std::cout << "AOVs saved to chameleonrt.exr\n";
+        }
+        return;
+    }
+
     const std::string rt_backend = renderer->name();
     const std::string cpu_brand = get_cpu_brand();
     const std::string gpu_brand = display->gpu_brand();
@@ -367,10 +699,22 @@ void run_app(const std::vector<std::string> &args, SDL_Window *window, Display *
     size_t frame_id = 0;
     float render_time = 0.f;
     float rays_per_second = 0.f;
+    float trace_time = 0.f;
+    float readback_time = 0.f;
     glm::vec2 prev_mouse(-2.f);
     bool done = false;
     bool camera_changed = true;
     bool save_image = false;
+    float spin_angle = 0.f;
+    // The crop region edited in the UI, as x, y, width, height
+    bool crop_enabled = !render_regions.empty() && renderer->supports_render_regions();
+    int crop[4] = {0, 0, win_width / 2, win_height / 2};
+    if (crop_enabled) {
+        crop[0] = render_regions[0].origin.x;
+        crop[1] = render_regions[0].origin.y;
+        crop[2] = render_regions[0].size.x;
+        crop[3] = render_regions[0].size.y;
+    }
     while (!done) {
         SDL_Event event;
         while (SDL_PollEvent(&event)) {
@@ -433,6 +777,15 @@ void run_app(const std::vector<std::string> &args, SDL_Window *window, Display *
             frame_id = 0;
         }
 
+        if (!instance_transforms.empty()) {
+            // Turn the instance a degree each frame, which refits the scene BVH
+            std::vector<glm::mat4> transforms = instance_transforms;
+            spin_angle = std::fmod(spin_angle + 1.f, 360.f);
+            transforms[spin_instance] *=
+                glm::rotate(glm::radians(spin_angle), glm::vec3(0.f, 1.f, 0.f));
+            renderer->update_instance_transforms(transforms);
+        }
+
         const bool need_readback = save_image || !validation_img_prefix.empty();
         RenderStats stats = renderer->render(
             camera.eye(), camera.dir(), camera.up(), fov_y, camera_changed, need_readback);
@@ -464,9 +817,13 @@ void run_app(const std::vector<std::string> &args, SDL_Window *window, Display *
         if (frame_id == 1) {
             render_time = stats.render_time;
             rays_per_second = stats.rays_per_second;
+            trace_time = std::max(stats.trace_time, 0.f);
+            readback_time = std::max(stats.readback_time, 0.f);
         } else {
             render_time += stats.render_time;
             rays_per_second += stats.rays_per_second;
+            trace_time += std::max(stats.trace_time, 0.f);
+            readback_time += std::max(stats.readback_time, 0.f);
         }
 
         display->new_frame();
@@ -479,11 +836,22 @@ void run_app(const std::vector<std::string> &args, SDL_Window *window, Display *
                     render_time / frame_id,
                     1000.f / (render_time / frame_id));
 
+        if (trace_time > 0) {
+            ImGui::Text("Trace Time: %.3f ms/frame", trace_time / frame_id);
+        }
+        if (readback_time > 0) {
+            ImGui::Text("Readback Time: %.3f ms/frame", readback_time / frame_id);
+        }
+
         if (stats.rays_per_second > 0) {
             const std::string rays_per_sec = pretty_print_count(rays_per_second / frame_id);
             ImGui::Text("Rays per-second: %sRay/s", rays_per_sec.c_str());
         }
 
+        if (stats.texture_cache_hit_rate >= 0) {
+            ImGui::Text("Texture Cache Hit Rate: %.2f%%", stats.texture_cache_hit_rate * 100.f);
+        }
+
         ImGui::Text("Total Application Time: %.3f ms/frame (%.1f FPS)",
                     1000.0f / ImGui::GetIO().Framerate,
                     ImGui::GetIO().Framerate);
@@ -498,6 +866,24 @@ void run_app(const std::vector<std::string> &args, SDL_Window *window, Display *
             save_image = true;
         }
 
+        if (renderer->supports_render_regions()) {
+            bool crop_changed = ImGui::Checkbox("Crop Region", &crop_enabled);
+            if (crop_enabled) {
+                crop_changed |= ImGui::InputInt4("x, y, w, h", crop);
+            }
+            if (crop_changed) {
+                std::vector<RenderRegion> regions;
+                if (crop_enabled) {
+                    RenderRegion region;
+                    region.origin = glm::uvec2(std::max(crop[0], 0), std::max(crop[1], 0));
+                    region.size = glm::uvec2(std::max(crop[2], 0), std::max(crop[3], 0));
+                    regions.push_back(region);
+                }
+                renderer->set_render_regions(regions);
+                frame_id = 0;
+            }
+        }
+
         ImGui::End();
         ImGui::Render();
 
@@ -532,3 +918,57 @@ void run_app(const std::vector<std::string> &args, SDL_Window *window, Display *
         }
     }
 }
+
+uint32_t parse_aov_list(const std::string &list)
+{
+    uint32_t aovs = 0;
+    std::stringstream ss(list);
+    std::string aov;
+    while (std::getline(ss, aov, ',')) {
+        if (aov == "depth") {
+            aovs |= AOV_DEPTH;
+        } else if (aov == "normal") {
+            aovs |= AOV_NORMAL;
+        } else if (aov == "albedo") {
+            aovs |= AOV_ALBEDO;
+        } else if (aov == "instance") {
+            aovs |= AOV_INSTANCE_ID;
+        } else if (aov == "material") {
+            aovs |= AOV_MATERIAL_ID;
+        } else {
+            std::cout << "Error: Unrecognized AOV " << aov << "\n";
+            std::exit(1);
+        }
+    }
+    return aovs;
+}
+
+void save_exr(const std::string &fname, const RenderBackend &renderer)
+{
+    // Read back the linear color, which keeps the HDR range for backends accumulating
+    // in float, and store it planar like the AOVs
+    const size_t npixels = win_width * win_height;
+    RenderRegion full_frame;
+    full_frame.size = glm::uvec2(win_width, win_height);
+    std::vector<float> rgb(npixels * 3, 0.f);
+    renderer.read_region(full_frame, win_width, rgb.data());
+
+    std::vector<float> color(npixels * 4, 1.f);
+    for (size_t i = 0; i < npixels; ++i) {
+        for (size_t c = 0; c < 3; ++c) {
+            color[c * npixels + i] = rgb[i * 3 + c];
+        }
+    }
+
+    std::vector<EXRChannel> channels = {EXRChannel{"R", color.data()},
+                                        EXRChannel{"G", color.data() + npixels},
+                                        EXRChannel{"B", color.data() + 2 * npixels},
+                                        EXRChannel{"A", color.data() + 3 * npixels}};
+    for (const auto &layer : renderer.aov_layers) {
+        for (size_t c = 0; c < layer.channels.size(); ++c) {
+            channels.push_back(
+                EXRChannel{layer.name + "." + layer.channels[c], layer.data.data() + c * npixels});
+        }
+    }
+    write_exr(fname, win_width, win_height, channels);
+}
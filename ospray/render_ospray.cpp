@@ -117,29 +117,44 @@ void RenderOSPRay::set_scene(const Scene &in_scene)
         ospRelease(m);
     }
     materials.clear();
-    for (const auto &mat : scene.materials) {
+    std::vector<uint32_t> texture_handles;
+    const std::vector<MaterialRecord> records =
+        make_material_records(scene.materials, texture_handles);
+    for (const auto &mat : records) {
         OSPMaterial m = ospNewMaterial("pathtracer", "principled");
-        const int tex_handle = *reinterpret_cast<const int *>(&mat.base_color.x);
-        if (IS_TEXTURED_PARAM(tex_handle)) {
+        if (IS_TEXTURED_MATERIAL_PARAM(mat.texture_mask, MATERIAL_PARAM_BASE_COLOR)) {
+            const uint32_t tex_handle =
+                material_texture_handle(mat, MATERIAL_PARAM_BASE_COLOR, texture_handles);
             ospSetParam(
                 m, "map_baseColor", OSP_TEXTURE, &textures[GET_TEXTURE_ID(tex_handle)]);
         } else {
             ospSetParam(m, "baseColor", OSP_VEC3F, &mat.base_color.x);
         }
 
-        set_material_param(m, "metallic", mat.metallic);
+        set_material_param(
+            m, "metallic", mat, MATERIAL_PARAM_METALLIC, mat.metallic, texture_handles);
         // TODO: Seems like "specular" here means something really different and weird or is
         // buggy
-        // set_material_param(m, "specular", mat.specular);
-        set_material_param(m, "roughness", mat.roughness);
+        // set_material_param(m, "specular", mat, MATERIAL_PARAM_SPECULAR, mat.specular,
+        //                    texture_handles);
+        set_material_param(
+            m, "roughness", mat, MATERIAL_PARAM_ROUGHNESS, mat.roughness, texture_handles);
         // TODO: name for "specularTint" in OSPRay's model?
-        set_material_param(m, "anisotropy", mat.anisotropy);
-        set_material_param(m, "sheen", mat.sheen);
-        set_material_param(m, "sheenTint", mat.sheen_tint);
-        set_material_param(m, "coat", mat.clearcoat);
+        set_material_param(
+            m, "anisotropy", mat, MATERIAL_PARAM_ANISOTROPY, mat.anisotropy, texture_handles);
+        set_material_param(m, "sheen", mat, MATERIAL_PARAM_SHEEN, mat.sheen, texture_handles);
+        set_material_param(
+            m, "sheenTint", mat, MATERIAL_PARAM_SHEEN_TINT, mat.sheen_tint, texture_handles);
+        set_material_param(
+            m, "coat", mat, MATERIAL_PARAM_CLEARCOAT, mat.clearcoat, texture_handles);
         // TODO: need to map clearcoat gloss to ospray
-        set_material_param(m, "ior", mat.ior);
-        set_material_param(m, "transmission", mat.specular_transmission);
+        set_material_param(m, "ior", mat, MATERIAL_PARAM_IOR, mat.ior, texture_handles);
+        set_material_param(m,
+                           "transmission",
+                           mat,
+                           MATERIAL_PARAM_SPECULAR_TRANSMISSION,
+                           mat.specular_transmission,
+                           texture_handles);
 
         ospCommit(m);
         materials.push_back(m);
@@ -295,14 +310,16 @@ RenderStats RenderOSPRay::render(const glm::vec3 &pos,
 
 void RenderOSPRay::set_material_param(OSPMaterial &mat,
                                       const std::string &name,
-                                      const float val) const
+                                      const MaterialRecord &record,
+                                      const uint32_t param,
+                                      const float val,
+                                      const std::vector<uint32_t> &texture_handles) const
 {
-    const uint32_t handle = *reinterpret_cast<const uint32_t *>(&val);
-    if (IS_TEXTURED_PARAM(handle)) {
+    if (IS_TEXTURED_MATERIAL_PARAM(record.texture_mask, param)) {
+        const uint32_t handle = material_texture_handle(record, param, texture_handles);
         const std::string map_name = "map_" + name;
         ospSetParam(mat, map_name.c_str(), OSP_TEXTURE, &textures[GET_TEXTURE_ID(handle)]);
     } else {
         ospSetParam(mat, name.c_str(), OSP_FLOAT, &val);
     }
 }
-
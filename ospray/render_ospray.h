@@ -30,5 +30,10 @@ struct RenderOSPRay : RenderBackend {
                        const bool need_readback) override;
 
 private:
-    void set_material_param(OSPMaterial &mat, const std::string &name, const float val) const;
+    void set_material_param(OSPMaterial &mat,
+                            const std::string &name,
+                            const MaterialRecord &record,
+                            const uint32_t param,
+                            const float val,
+                            const std::vector<uint32_t> &texture_handles) const;
 };
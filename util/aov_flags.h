@@ -0,0 +1,21 @@
+// This header is shared across all backends
+
+#ifndef UTIL_AOV_FLAGS_H
+#define UTIL_AOV_FLAGS_H
+
+/* The arbitrary output variables a renderer can write from the primary hit, in
+ * addition to the color. Each is written as a set of planar float channels:
+ *
+ * AOV_DEPTH: 1 channel, distance from the camera to the hit, infinity on a miss
+ * AOV_NORMAL: 3 channels, the world space shading normal, zero on a miss
+ * AOV_ALBEDO: 3 channels, the base color, zero on a miss
+ * AOV_INSTANCE_ID: 1 channel, the instance hit or -1 on a miss
+ * AOV_MATERIAL_ID: 1 channel, the material hit or -1 on a miss
+ */
+#define AOV_DEPTH 0x1
+#define AOV_NORMAL 0x2
+#define AOV_ALBEDO 0x4
+#define AOV_INSTANCE_ID 0x8
+#define AOV_MATERIAL_ID 0x10
+
+#endif
@@ -0,0 +1,590 @@
+#include "distributed.h"
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <thread>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace {
+
+enum MessageType : uint32_t {
+    // Worker -> coordinator: uint32 fb_width, fb_height
+    MSG_HELLO = 1,
+    // Coordinator -> worker: uint32 samples per pixel, region count, then x, y, w, h for
+    // each region
+    MSG_WORK = 2,
+    // Worker -> coordinator: uint32 x, y, w, h, then w * h RGB floats
+    MSG_RESULT = 3,
+    // Coordinator -> worker: no more work, the worker should exit
+    MSG_DONE = 4
+};
+
+struct MessageHeader {
+    uint32_t type = 0;
+    // Size of the payload following the header in bytes
+    uint32_t nbytes = 0;
+};
+
+const std::string UNIX_PREFIX = "unix:";
+
+bool is_unix_address(const std::string &address)
+{
+    return address.compare(0, UNIX_PREFIX.size(), UNIX_PREFIX) == 0;
+}
+
+sockaddr_un make_unix_address(const std::string &address)
+{
+    const std::string path = address.substr(UNIX_PREFIX.size());
+    sockaddr_un addr = {};
+    if (path.size() >= sizeof(addr.sun_path)) {
+        throw std::runtime_error("Unix socket path is too long: " + path);
+    }
+    addr.sun_family = AF_UNIX;
+    std::strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+    return addr;
+}
+
+addrinfo *resolve_tcp_address(const std::string &address, const bool passive)
+{
+    const size_t sep = address.rfind(':');
+    if (sep == std::string::npos) {
+        throw std::runtime_error("Invalid address " + address + ", expected <host>:<port>");
+    }
+    const std::string host = address.substr(0, sep);
+    const std::string port = address.substr(sep + 1);
+
+    addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = passive ? AI_PASSIVE : 0;
+
+    addrinfo *result = nullptr;
+    const int err =
+        getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &result);
+    if (err != 0) {
+        throw std::runtime_error("Failed to resolve " + address + ": " + gai_strerror(err));
+    }
+    return result;
+}
+
+void set_socket_options(const int fd, const bool tcp)
+{
+    int one = 1;
+#ifdef SO_NOSIGPIPE
+    setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#endif
+    if (tcp) {
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+}
+
+bool send_message(Socket &conn, const uint32_t type, const std::vector<uint8_t> &payload)
+{
+    MessageHeader header;
+    header.type = type;
+    header.nbytes = payload.size();
+    return conn.send_all(&header, sizeof(header)) &&
+           (payload.empty() || conn.send_all(payload.data(), payload.size()));
+}
+
+bool recv_message(Socket &conn, MessageHeader &header, std::vector<uint8_t> &payload)
+{
+    if (!conn.recv_all(&header, sizeof(header))) {
+        return false;
+    }
+    payload.resize(header.nbytes);
+    return payload.empty() || conn.recv_all(payload.data(), payload.size());
+}
+
+template <typename T>
+void append(std::vector<uint8_t> &buf, const T &v)
+{
+    const uint8_t *b = reinterpret_cast<const uint8_t *>(&v);
+    buf.insert(buf.end(), b, b + sizeof(T));
+}
+
+void append_region(std::vector<uint8_t> &buf, const RenderRegion &r)
+{
+    append(buf, r.origin.x);
+    append(buf, r.origin.y);
+    append(buf, r.size.x);
+    append(buf, r.size.y);
+}
+
+RenderRegion read_region(const uint8_t *buf)
+{
+    uint32_t v[4];
+    std::memcpy(v, buf, sizeof(v));
+    RenderRegion r;
+    r.origin = glm::uvec2(v[0], v[1]);
+    r.size = glm::uvec2(v[2], v[3]);
+    return r;
+}
+
+}
+
+Socket::Socket(int fd) : fd(fd) {}
+
+Socket::Socket(Socket &&s) : fd(s.fd)
+{
+    s.fd = -1;
+}
+
+Socket::~Socket()
+{
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+Socket &Socket::operator=(Socket &&s)
+{
+    if (fd >= 0) {
+        close(fd);
+    }
+    fd = s.fd;
+    s.fd = -1;
+    return *this;
+}
+
+Socket Socket::listen(const std::string &address)
+{
+    if (is_unix_address(address)) {
+        const sockaddr_un addr = make_unix_address(address);
+        // Remove any stale socket file left from a previous run
+        unlink(addr.sun_path);
+
+        Socket s(socket(AF_UNIX, SOCK_STREAM, 0));
+        const sockaddr *sa = reinterpret_cast<const sockaddr *>(&addr);
+        if (!s.valid() || bind(s.fd, sa, sizeof(addr)) || ::listen(s.fd, SOMAXCONN)) {
+            throw std::runtime_error("Failed to listen on " + address + ": " +
+                                     std::strerror(errno));
+        }
+        return s;
+    }
+
+    addrinfo *info = resolve_tcp_address(address, true);
+    for (addrinfo *a = info; a; a = a->ai_next) {
+        Socket s(socket(a->ai_family, a->ai_socktype, a->ai_protocol));
+        if (!s.valid()) {
+            continue;
+        }
+        int one = 1;
+        setsockopt(s.fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (bind(s.fd, a->ai_addr, a->ai_addrlen) == 0 && ::listen(s.fd, SOMAXCONN) == 0) {
+            freeaddrinfo(info);
+            return s;
+        }
+    }
+    freeaddrinfo(info);
+    throw std::runtime_error("Failed to listen on " + address + ": " + std::strerror(errno));
+}
+
+Socket Socket::connect(const std::string &address, const int timeout_ms)
+{
+    using namespace std::chrono;
+    const auto start = steady_clock::now();
+    const bool unix_socket = is_unix_address(address);
+    while (true) {
+        if (unix_socket) {
+            const sockaddr_un addr = make_unix_address(address);
+            Socket s(socket(AF_UNIX, SOCK_STREAM, 0));
+            const sockaddr *sa = reinterpret_cast<const sockaddr *>(&addr);
+            if (s.valid() && ::connect(s.fd, sa, sizeof(addr)) == 0) {
+                set_socket_options(s.fd, false);
+                return s;
+            }
+        } else {
+            addrinfo *info = resolve_tcp_address(address, false);
+            for (addrinfo *a = info; a; a = a->ai_next) {
+                Socket s(socket(a->ai_family, a->ai_socktype, a->ai_protocol));
+                if (s.valid() && ::connect(s.fd, a->ai_addr, a->ai_addrlen) == 0) {
+                    freeaddrinfo(info);
+                    set_socket_options(s.fd, true);
+                    return s;
+                }
+            }
+            freeaddrinfo(info);
+        }
+
+        if (duration_cast<milliseconds>(steady_clock::now() - start).count() > timeout_ms) {
+            throw std::runtime_error("Failed to connect to " + address + ": " +
+                                     std::strerror(errno));
+        }
+        std::this_thread::sleep_for(milliseconds(100));
+    }
+}
+
+Socket Socket::accept(const int timeout_ms)
+{
+    pollfd pfd = {};
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    if (poll(&pfd, 1, timeout_ms) <= 0 || !(pfd.revents & POLLIN)) {
+        return Socket();
+    }
+    Socket s(::accept(fd, nullptr, nullptr));
+    if (s.valid()) {
+        sockaddr_storage addr = {};
+        socklen_t len = sizeof(addr);
+        getsockname(s.fd, reinterpret_cast<sockaddr *>(&addr), &len);
+        set_socket_options(s.fd, addr.ss_family != AF_UNIX);
+    }
+    return s;
+}
+
+bool Socket::wait_readable(const int timeout_ms)
+{
+    pollfd pfd = {};
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    // A closed connection is reported as readable, the following read will then fail
+    return poll(&pfd, 1, timeout_ms) > 0 && (pfd.revents & (POLLIN | POLLHUP | POLLERR));
+}
+
+bool Socket::valid() const
+{
+    return fd >= 0;
+}
+
+bool Socket::send_all(const void *data, const size_t nbytes)
+{
+#ifdef MSG_NOSIGNAL
+    const int flags = MSG_NOSIGNAL;
+#else
+    const int flags = 0;
+#endif
+    const uint8_t *buf = reinterpret_cast<const uint8_t *>(data);
+    size_t sent = 0;
+    while (sent < nbytes) {
+        const ssize_t n = send(fd, buf + sent, nbytes - sent, flags);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        sent += n;
+    }
+    return true;
+}
+
+bool Socket::recv_all(void *data, const size_t nbytes)
+{
+    uint8_t *buf = reinterpret_cast<uint8_t *>(data);
+    size_t received = 0;
+    while (received < nbytes) {
+        const ssize_t n = recv(fd, buf + received, nbytes - received, 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        received += n;
+    }
+    return true;
+}
+
+RenderCoordinator::RenderCoordinator(const std::string &address,
+                                     const glm::uvec2 &fb_dims,
+                                     const glm::uvec2 &tile_size,
+                                     const uint32_t samples_per_pixel)
+    : listener(Socket::listen(address)),
+      fb_dims(fb_dims),
+      samples_per_pixel(samples_per_pixel),
+      framebuffer(fb_dims.x * fb_dims.y * 3, 0.f)
+{
+    for (uint32_t y = 0; y < fb_dims.y; y += tile_size.y) {
+        for (uint32_t x = 0; x < fb_dims.x; x += tile_size.x) {
+            RenderRegion tile;
+            tile.origin = glm::uvec2(x, y);
+            tile.size = glm::min(tile_size, fb_dims - tile.origin);
+            pending.push_back(tile);
+        }
+    }
+    total_tiles = pending.size();
+    tiles_remaining = total_tiles;
+}
+
+void RenderCoordinator::run(const std::vector<int> &worker_pids)
+{
+    using namespace std::chrono;
+    std::vector<int> running_pids = worker_pids;
+    std::vector<std::thread> handlers;
+    auto last_connected = steady_clock::now();
+    std::string error;
+    while (true) {
+        // Reap the local workers which have exited
+        for (auto it = running_pids.begin(); it != running_pids.end();) {
+            int status = 0;
+            if (waitpid(*it, &status, WNOHANG) == *it) {
+                if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+                    std::cerr << "Worker process " << *it << " failed\n";
+                }
+                it = running_pids.erase(it);
+            } else {
+                ++it;
+            }
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (tiles_remaining == 0) {
+                break;
+            }
+            // With no workers connected the frame can only finish if one still might
+            if (connected_workers == 0) {
+                if (!worker_pids.empty() && running_pids.empty()) {
+                    error = "All worker processes exited before the frame was finished";
+                    break;
+                }
+                const int idle_ms =
+                    duration_cast<milliseconds>(steady_clock::now() - last_connected).count();
+                if (worker_pids.empty() && idle_ms > worker_timeout_ms) {
+                    error = "No workers connected for " + std::to_string(idle_ms) + "ms";
+                    break;
+                }
+            } else {
+                last_connected = steady_clock::now();
+            }
+        }
+
+        Socket conn = listener.accept(100);
+        if (conn.valid()) {
+            std::lock_guard<std::mutex> lock(mutex);
+            ++connected_workers;
+            handlers.emplace_back(&RenderCoordinator::serve_worker, this, std::move(conn));
+        }
+    }
+    work_available.notify_all();
+    for (auto &t : handlers) {
+        t.join();
+    }
+    if (!error.empty()) {
+        throw std::runtime_error(error + ", " + std::to_string(tiles_remaining) + " of " +
+                                 std::to_string(total_tiles) + " tiles were not rendered");
+    }
+}
+
+const std::vector<float> &RenderCoordinator::image() const
+{
+    return framebuffer;
+}
+
+void RenderCoordinator::serve_worker(Socket conn)
+{
+    // Whichever way the worker finishes it no longer counts as connected
+    struct Disconnect {
+        RenderCoordinator *coordinator;
+        ~Disconnect()
+        {
+            std::lock_guard<std::mutex> lock(coordinator->mutex);
+            --coordinator->connected_workers;
+        }
+    } disconnect{this};
+
+    MessageHeader header;
+    std::vector<uint8_t> payload;
+    if (!recv_message(conn, header, payload) || header.type != MSG_HELLO ||
+        payload.size() != 2 * sizeof(uint32_t)) {
+        return;
+    }
+    uint32_t worker_dims[2];
+    std::memcpy(worker_dims, payload.data(), sizeof(worker_dims));
+    if (glm::uvec2(worker_dims[0], worker_dims[1]) != fb_dims) {
+        std::cerr << "Worker framebuffer size " << worker_dims[0] << "x" << worker_dims[1]
+                  << " does not match " << fb_dims.x << "x" << fb_dims.y << "\n";
+        send_message(conn, MSG_DONE, {});
+        return;
+    }
+
+    std::vector<RenderRegion> assigned;
+    std::unique_lock<std::mutex> lock(mutex);
+    ++active_workers;
+    while (true) {
+        work_available.wait(lock, [&]() { return !pending.empty() || tiles_remaining == 0; });
+        if (tiles_remaining == 0) {
+            break;
+        }
+
+        // Guided self-scheduling: hand out a share of the remaining tiles, so batches
+        // shrink as the frame nears completion to keep the workers evenly loaded at the end
+        const size_t batch_size = std::max(
+            std::min(pending.size() / (2 * active_workers), max_batch_size), size_t(1));
+        assigned.assign(pending.begin(), pending.begin() + batch_size);
+        pending.erase(pending.begin(), pending.begin() + batch_size);
+        lock.unlock();
+
+        std::vector<uint8_t> work;
+        append(work, samples_per_pixel);
+        append(work, uint32_t(assigned.size()));
+        for (const auto &r : assigned) {
+            append_region(work, r);
+        }
+        bool connected = send_message(conn, MSG_WORK, work);
+
+        // Merge the tiles as they come back. A worker which stops responding is treated
+        // as disconnected, so a hung worker doesn't hold on to its tiles forever
+        while (connected && !assigned.empty()) {
+            if (!conn.wait_readable(result_timeout_ms)) {
+                std::cerr << "Worker sent no results for " << result_timeout_ms << "ms\n";
+                connected = false;
+                break;
+            }
+            connected = recv_message(conn, header, payload) && header.type == MSG_RESULT &&
+                        payload.size() >= 4 * sizeof(uint32_t);
+            if (!connected) {
+                break;
+            }
+            const RenderRegion r = read_region(payload.data());
+            auto fnd =
+                std::find_if(assigned.begin(), assigned.end(), [&](const RenderRegion &a) {
+                    return a.origin == r.origin && a.size == r.size;
+                });
+            const size_t expected_bytes =
+                4 * sizeof(uint32_t) + r.size.x * r.size.y * 3 * sizeof(float);
+            if (fnd == assigned.end() || payload.size() != expected_bytes) {
+                connected = false;
+                break;
+            }
+            assigned.erase(fnd);
+
+            // Each tile is only merged once, so the copy doesn't need to hold the lock
+            const float *rgb =
+                reinterpret_cast<const float *>(payload.data() + 4 * sizeof(uint32_t));
+            for (uint32_t y = 0; y < r.size.y; ++y) {
+                const size_t fb_px = (r.origin.y + y) * fb_dims.x + r.origin.x;
+                std::memcpy(framebuffer.data() + fb_px * 3,
+                            rgb + y * r.size.x * 3,
+                            r.size.x * 3 * sizeof(float));
+            }
+
+            std::lock_guard<std::mutex> merge_lock(mutex);
+            --tiles_remaining;
+            const size_t done = total_tiles - tiles_remaining;
+            if (done * 10 / total_tiles != (done - 1) * 10 / total_tiles) {
+                std::cout << "Merged " << done << "/" << total_tiles << " tiles\n";
+            }
+        }
+
+        lock.lock();
+        if (!connected) {
+            // Put the worker's unfinished tiles back for the other workers
+            std::cerr << "Lost connection to worker, re-queueing " << assigned.size()
+                      << " tiles\n";
+            pending.insert(pending.end(), assigned.begin(), assigned.end());
+            --active_workers;
+            work_available.notify_all();
+            return;
+        }
+        if (tiles_remaining == 0) {
+            work_available.notify_all();
+        }
+    }
+    --active_workers;
+    lock.unlock();
+
+    send_message(conn, MSG_DONE, {});
+}
+
+void run_render_worker(const std::string &address,
+                       RenderBackend &renderer,
+                       const glm::uvec2 &fb_dims,
+                       const glm::vec3 &pos,
+                       const glm::vec3 &dir,
+                       const glm::vec3 &up,
+                       const float fovy)
+{
+    if (!renderer.supports_render_regions()) {
+        throw std::runtime_error(renderer.name() + " does not support rendering regions");
+    }
+
+    Socket conn = Socket::connect(address);
+    std::vector<uint8_t> hello;
+    append(hello, fb_dims.x);
+    append(hello, fb_dims.y);
+    if (!send_message(conn, MSG_HELLO, hello)) {
+        throw std::runtime_error("Failed to send hello to coordinator " + address);
+    }
+
+    MessageHeader header;
+    std::vector<uint8_t> payload;
+    std::vector<float> rgb;
+    size_t tiles_rendered = 0;
+    while (recv_message(conn, header, payload) && header.type == MSG_WORK) {
+        uint32_t spp = 0;
+        uint32_t count = 0;
+        std::memcpy(&spp, payload.data(), sizeof(uint32_t));
+        std::memcpy(&count, payload.data() + sizeof(uint32_t), sizeof(uint32_t));
+        std::vector<RenderRegion> regions;
+        for (uint32_t i = 0; i < count; ++i) {
+            regions.push_back(read_region(payload.data() + (2 + 4 * i) * sizeof(uint32_t)));
+        }
+
+        renderer.set_render_regions(regions);
+        for (uint32_t s = 0; s < spp; ++s) {
+            renderer.render(pos, dir, up, fovy, s == 0, s + 1 == spp);
+        }
+
+        for (const auto &r : regions) {
+            rgb.resize(r.size.x * r.size.y * 3);
+            renderer.read_region(r, fb_dims.x, rgb.data());
+
+            std::vector<uint8_t> result;
+            append_region(result, r);
+            const uint8_t *b = reinterpret_cast<const uint8_t *>(rgb.data());
+            result.insert(result.end(), b, b + rgb.size() * sizeof(float));
+            if (!send_message(conn, MSG_RESULT, result)) {
+                throw std::runtime_error("Lost connection to coordinator " + address);
+            }
+        }
+        tiles_rendered += regions.size();
+    }
+    renderer.set_render_regions({});
+    std::cout << "Worker rendered " << tiles_rendered << " tiles\n";
+}
+
+std::vector<int> spawn_workers(const std::vector<std::string> &args, const size_t count)
+{
+    std::vector<char *> argv;
+    for (const auto &a : args) {
+        argv.push_back(const_cast<char *>(a.c_str()));
+    }
+    argv.push_back(nullptr);
+
+    std::vector<int> pids;
+    for (size_t i = 0; i < count; ++i) {
+        const pid_t pid = fork();
+        if (pid == 0) {
+            execvp(argv[0], argv.data());
+            std::cerr << "Failed to launch worker " << args[0] << ": " << std::strerror(errno)
+                      << "\n";
+            _exit(1);
+        } else if (pid < 0) {
+            throw std::runtime_error(std::string("Failed to fork worker: ") +
+                                     std::strerror(errno));
+        }
+        pids.push_back(pid);
+    }
+    return pids;
+}
+
+void wait_for_workers(const std::vector<int> &pids)
+{
+    for (const auto &pid : pids) {
+        int status = 0;
+        waitpid(pid, &status, 0);
+    }
+}
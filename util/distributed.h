@@ -0,0 +1,118 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "render_backend.h"
+#include <glm/glm.hpp>
+
+/* A connected or listening socket. Addresses are either "unix:<path>" for a Unix
+ * domain socket or "<host>:<port>" for TCP.
+ */
+class Socket {
+    int fd = -1;
+
+public:
+    Socket() = default;
+
+    explicit Socket(int fd);
+
+    Socket(Socket &&s);
+
+    ~Socket();
+
+    Socket &operator=(Socket &&s);
+
+    Socket(const Socket &) = delete;
+
+    Socket &operator=(const Socket &) = delete;
+
+    static Socket listen(const std::string &address);
+
+    // Connect to the address, retrying for up to timeout_ms in case the listener isn't up yet
+    static Socket connect(const std::string &address, const int timeout_ms = 5000);
+
+    // Wait up to timeout_ms for a connection, returns an invalid socket if none arrived
+    Socket accept(const int timeout_ms);
+
+    // Wait up to timeout_ms for data to read, returns false if none arrived
+    bool wait_readable(const int timeout_ms);
+
+    bool valid() const;
+
+    // Returns false if the connection was closed
+    bool send_all(const void *data, const size_t nbytes);
+
+    // Returns false if the connection was closed
+    bool recv_all(void *data, const size_t nbytes);
+};
+
+/* Renders a frame by handing out its tiles to worker processes running
+ * run_render_worker. Workers pull batches of tiles as they finish their previous
+ * batch, with the batch size shrinking as the queue drains so faster workers pick up
+ * more of the frame. Each finished tile is merged into the frame as it arrives, and
+ * tiles held by a worker which disconnects are put back in the queue.
+ */
+class RenderCoordinator {
+    Socket listener;
+    glm::uvec2 fb_dims;
+    uint32_t samples_per_pixel;
+
+    std::mutex mutex;
+    std::condition_variable work_available;
+    std::deque<RenderRegion> pending;
+    size_t tiles_remaining = 0;
+    size_t total_tiles = 0;
+    size_t active_workers = 0;
+    // Workers with a connection being served, including ones still sending their hello
+    size_t connected_workers = 0;
+    std::vector<float> framebuffer;
+
+    void serve_worker(Socket conn);
+
+public:
+    // The most tiles sent to a worker at once
+    size_t max_batch_size = 16;
+    // How long to wait with no workers connected before giving up on the frame, in ms.
+    // Only used when no local worker processes are being watched by run
+    int worker_timeout_ms = 120000;
+    // How long to wait for a worker to send back its next tile before treating it as lost
+    // and re-queueing its tiles, in ms
+    int result_timeout_ms = 120000;
+
+    RenderCoordinator(const std::string &address,
+                      const glm::uvec2 &fb_dims,
+                      const glm::uvec2 &tile_size,
+                      const uint32_t samples_per_pixel);
+
+    RenderCoordinator(const RenderCoordinator &) = delete;
+    RenderCoordinator &operator=(const RenderCoordinator &) = delete;
+
+    /* Serve tiles to the workers as they connect, returns once every tile has been merged.
+     * worker_pids are local worker processes to watch, if all of them have exited and no
+     * workers are connected the frame can't be finished and an exception is thrown
+     */
+    void run(const std::vector<int> &worker_pids = std::vector<int>{});
+
+    // The merged linear RGB frame
+    const std::vector<float> &image() const;
+};
+
+/* Connect to the coordinator and render the batches of tiles it sends with the renderer,
+ * which must support render regions and have the scene set. Returns when the coordinator
+ * has no more work.
+ */
+void run_render_worker(const std::string &address,
+                       RenderBackend &renderer,
+                       const glm::uvec2 &fb_dims,
+                       const glm::vec3 &pos,
+                       const glm::vec3 &dir,
+                       const glm::vec3 &up,
+                       const float fovy);
+
+// Launch local worker processes running the program with the arguments
+std::vector<int> spawn_workers(const std::vector<std::string> &args, const size_t count);
+
+void wait_for_workers(const std::vector<int> &pids);
@@ -0,0 +1,120 @@
+#include "exr.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+
+namespace {
+
+template <typename T>
+void append(std::vector<uint8_t> &buf, const T &v)
+{
+    const uint8_t *b = reinterpret_cast<const uint8_t *>(&v);
+    buf.insert(buf.end(), b, b + sizeof(T));
+}
+
+void append_string(std::vector<uint8_t> &buf, const std::string &str)
+{
+    buf.insert(buf.end(), str.begin(), str.end());
+    buf.push_back(0);
+}
+
+void append_attribute_header(std::vector<uint8_t> &buf,
+                             const std::string &name,
+                             const std::string &type,
+                             const int32_t size)
+{
+    append_string(buf, name);
+    append_string(buf, type);
+    append(buf, size);
+}
+}
+
+void write_exr(const std::string &fname,
+               const int width,
+               const int height,
+               std::vector<EXRChannel> channels)
+{
+    // EXR requires the channels to be sorted by name
+    std::sort(channels.begin(), channels.end(), [](const EXRChannel &a, const EXRChannel &b) {
+        return a.name < b.name;
+    });
+
+    const int32_t pixel_type_float = 2;
+    std::vector<uint8_t> header;
+    // Magic number, followed by version 2 of a single part scanline file
+    append(header, int32_t(20000630));
+    append(header, int32_t(2));
+
+    {
+        std::vector<uint8_t> chlist;
+        for (const auto &c : channels) {
+            if (c.name.size() > 31) {
+                throw std::runtime_error("EXR channel name " + c.name + " is too long");
+            }
+            append_string(chlist, c.name);
+            append(chlist, pixel_type_float);
+            // pLinear and reserved bytes
+            append(chlist, uint32_t(0));
+            // x and y sampling
+            append(chlist, int32_t(1));
+            append(chlist, int32_t(1));
+        }
+        chlist.push_back(0);
+        append_attribute_header(header, "channels", "chlist", chlist.size());
+        header.insert(header.end(), chlist.begin(), chlist.end());
+    }
+
+    append_attribute_header(header, "compression", "compression", 1);
+    header.push_back(0);
+
+    const int32_t window[4] = {0, 0, width - 1, height - 1};
+    append_attribute_header(header, "dataWindow", "box2i", sizeof(window));
+    append(header, window);
+    append_attribute_header(header, "displayWindow", "box2i", sizeof(window));
+    append(header, window);
+
+    append_attribute_header(header, "lineOrder", "lineOrder", 1);
+    header.push_back(0);
+
+    append_attribute_header(header, "pixelAspectRatio", "float", sizeof(float));
+    append(header, 1.f);
+
+    const float screen_window_center[2] = {0.f, 0.f};
+    append_attribute_header(header, "screenWindowCenter", "v2f", sizeof(screen_window_center));
+    append(header, screen_window_center);
+
+    append_attribute_header(header, "screenWindowWidth", "float", sizeof(float));
+    append(header, 1.f);
+    header.push_back(0);
+
+    // Each scanline is stored as its y coordinate and data size, followed by
+    // the row of each channel in order
+    const uint64_t line_data_size = channels.size() * width * sizeof(float);
+    const uint64_t line_size = 2 * sizeof(int32_t) + line_data_size;
+    const uint64_t first_line = header.size() + height * sizeof(uint64_t);
+
+    std::ofstream fout(fname.c_str(), std::ios::binary);
+    if (!fout) {
+        throw std::runtime_error("Failed to open " + fname + " for writing");
+    }
+    fout.write(reinterpret_cast<const char *>(header.data()), header.size());
+    for (int y = 0; y < height; ++y) {
+        const uint64_t offset = first_line + y * line_size;
+        fout.write(reinterpret_cast<const char *>(&offset), sizeof(uint64_t));
+    }
+
+    std::vector<uint8_t> line;
+    line.reserve(line_size);
+    for (int32_t y = 0; y < height; ++y) {
+        line.clear();
+        append(line, y);
+        append(line, int32_t(line_data_size));
+        for (const auto &c : channels) {
+            const uint8_t *row = reinterpret_cast<const uint8_t *>(c.data + y * width);
+            line.insert(line.end(), row, row + width * sizeof(float));
+        }
+        fout.write(reinterpret_cast<const char *>(line.data()), line.size());
+    }
+}
@@ -0,0 +1,19 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+struct EXRChannel {
+    std::string name;
+    // The channel's width * height float values
+    const float *data = nullptr;
+};
+
+/* Write the channels out to an uncompressed scanline OpenEXR file with 32-bit float
+ * pixels. Layers are written following the EXR naming convention, where the channel
+ * "normal.X" is the X channel of the normal layer.
+ */
+void write_exr(const std::string &fname,
+               const int width,
+               const int height,
+               std::vector<EXRChannel> channels);
@@ -1,4 +1,5 @@
 #include "material.h"
+#include <cstring>
 #include <stdexcept>
 #include "stb_image.h"
 
@@ -31,3 +32,50 @@ Image::Image(const uint8_t *buf,
 {
 }
 
+
+std::vector<MaterialRecord> make_material_records(const std::vector<DisneyMaterial> &materials,
+                                                  std::vector<uint32_t> &texture_handles)
+{
+    std::vector<MaterialRecord> records;
+    records.reserve(materials.size());
+    for (const auto &m : materials) {
+        MaterialRecord r;
+        r.texture_handles = texture_handles.size();
+
+        // The parameters are in the same order in the material as their MATERIAL_PARAM bits
+        const float *params = &m.base_color.x;
+        float *record_params = &r.base_color.x;
+        for (uint32_t i = 0; i < NUM_MATERIAL_PARAMS; ++i) {
+            const int j = i == MATERIAL_PARAM_BASE_COLOR ? 0 : i + 2;
+            uint32_t handle = 0;
+            std::memcpy(&handle, &params[j], sizeof(uint32_t));
+            if (IS_TEXTURED_PARAM(handle)) {
+                r.texture_mask |= 1u << i;
+                texture_handles.push_back(handle);
+                record_params[j] = 0.f;
+                if (i == MATERIAL_PARAM_BASE_COLOR) {
+                    r.base_color = glm::vec3(0.f);
+                }
+            } else if (i == MATERIAL_PARAM_BASE_COLOR) {
+                r.base_color = m.base_color;
+            } else {
+                record_params[j] = params[j];
+            }
+        }
+        records.push_back(r);
+    }
+    return records;
+}
+
+uint32_t material_texture_handle(const MaterialRecord &record,
+                                 const uint32_t param,
+                                 const std::vector<uint32_t> &texture_handles)
+{
+    uint32_t offset = record.texture_handles;
+    for (uint32_t i = 0; i < param; ++i) {
+        if (IS_TEXTURED_MATERIAL_PARAM(record.texture_mask, i)) {
+            ++offset;
+        }
+    }
+    return texture_handles[offset];
+}
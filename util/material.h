@@ -1,5 +1,6 @@
 #pragma once
 
+#include <cstdint>
 #include <memory>
 #include <string>
 #include <vector>
@@ -44,3 +45,38 @@ struct DisneyMaterial {
     float specular_transmission = 0;
     glm::vec2 pad = glm::vec2(0);
 };
+
+/* The material record uploaded to the renderers, with the texture handles moved out
+ * of the parameters into a separate table. Textured parameters are left at zero in the
+ * record and have their bit set in the texture mask, see texture_channel_mask.h
+ */
+struct MaterialRecord {
+    glm::vec3 base_color = glm::vec3(0.9f);
+    float metallic = 0;
+
+    float specular = 0;
+    float roughness = 1;
+    float specular_tint = 0;
+    float anisotropy = 0;
+
+    float sheen = 0;
+    float sheen_tint = 0;
+    float clearcoat = 0;
+    float clearcoat_gloss = 0;
+
+    float ior = 1.5;
+    float specular_transmission = 0;
+    uint32_t texture_mask = 0;
+    // Offset of the material's first handle in the texture handle table
+    uint32_t texture_handles = 0;
+};
+
+// Build the material records for the materials, appending their texture handles
+// to the texture handle table
+std::vector<MaterialRecord> make_material_records(const std::vector<DisneyMaterial> &materials,
+                                                  std::vector<uint32_t> &texture_handles);
+
+// Look up the handle of a textured parameter of the material in the texture handle table
+uint32_t material_texture_handle(const MaterialRecord &record,
+                                 const uint32_t param,
+                                 const std::vector<uint32_t> &texture_handles);
@@ -0,0 +1,49 @@
+#include "render_backend.h"
+#include "util.h"
+
+std::vector<AOVLayer> make_aov_layers(const uint32_t aovs, const int width, const int height)
+{
+    std::vector<AOVLayer> layers;
+    if (aovs & AOV_DEPTH) {
+        layers.push_back(AOVLayer{"depth", {"Z"}, {}});
+    }
+    if (aovs & AOV_NORMAL) {
+        layers.push_back(AOVLayer{"normal", {"X", "Y", "Z"}, {}});
+    }
+    if (aovs & AOV_ALBEDO) {
+        layers.push_back(AOVLayer{"albedo", {"R", "G", "B"}, {}});
+    }
+    if (aovs & AOV_INSTANCE_ID) {
+        layers.push_back(AOVLayer{"instance", {"id"}, {}});
+    }
+    if (aovs & AOV_MATERIAL_ID) {
+        layers.push_back(AOVLayer{"material", {"id"}, {}});
+    }
+    for (auto &l : layers) {
+        l.data.resize(l.channels.size() * width * height, 0.f);
+    }
+    return layers;
+}
+
+RenderRegion clip_render_region(const RenderRegion &region, const glm::uvec2 &fb_dims)
+{
+    RenderRegion clipped;
+    clipped.origin = glm::min(region.origin, fb_dims);
+    clipped.size = glm::min(region.origin + region.size, fb_dims) - clipped.origin;
+    return clipped;
+}
+
+void RenderBackend::read_region(const RenderRegion &region,
+                                const uint32_t fb_width,
+                                float *rgb) const
+{
+    const uint8_t *color = reinterpret_cast<const uint8_t *>(img.data());
+    for (uint32_t y = 0; y < region.size.y; ++y) {
+        for (uint32_t x = 0; x < region.size.x; ++x) {
+            const size_t px = (region.origin.y + y) * fb_width + region.origin.x + x;
+            for (size_t c = 0; c < 3; ++c) {
+                *rgb++ = srgb_to_linear(color[px * 4 + c] / 255.f);
+            }
+        }
+    }
+}
@@ -1,21 +1,104 @@
 #pragma once
 
+#include <string>
 #include <vector>
+#include "aov_flags.h"
 #include "scene.h"
 #include <glm/glm.hpp>
 
 struct RenderStats {
     float render_time = 0;
     float rays_per_second = 0;
+    // Fraction of texture tile lookups which hit in the texture cache, or -1 if textures
+    // are not paged through a cache
+    float texture_cache_hit_rate = -1;
+    // Device time spent tracing rays and copying the frame back to the host, in ms, or -1
+    // if the backend doesn't measure them
+    float trace_time = -1;
+    float readback_time = -1;
 };
 
+// Host time spent in the phases of set_scene, in ms, or -1 if the backend doesn't track it
+struct SceneBuildStats {
+    float upload_time = -1;
+    float blas_build_time = -1;
+    float tlas_build_time = -1;
+    // The device memory in use once the scene is loaded, -1 if the backend doesn't track it
+    int64_t memory_allocations = -1;
+    int64_t device_memory_blocks = -1;
+    float memory_reserved_mb = -1;
+};
+
+struct AOVLayer {
+    std::string name;
+    std::vector<std::string> channels;
+    // The channels are stored planar, one after the other
+    std::vector<float> data;
+};
+
+// Allocate the layers for the AOV flags, in the order of the flags
+std::vector<AOVLayer> make_aov_layers(const uint32_t aovs, const int width, const int height);
+
+// A rectangle of the framebuffer in pixels, with the origin at the top left
+struct RenderRegion {
+    glm::uvec2 origin = glm::uvec2(0);
+    glm::uvec2 size = glm::uvec2(0);
+};
+
+// Clip the region to the framebuffer, the returned region may be empty
+RenderRegion clip_render_region(const RenderRegion &region, const glm::uvec2 &fb_dims);
+
 struct RenderBackend {
     std::vector<uint32_t> img;
 
+    // The AOV flags to write, must be set before calling initialize
+    uint32_t aovs = 0;
+    // The AOVs for the last frame rendered, if the backend supports them
+    std::vector<AOVLayer> aov_layers;
+    // Timings of the last set_scene call
+    SceneBuildStats scene_build_stats;
+
     virtual ~RenderBackend() {}
 
     virtual std::string name() = 0;
 
+    // Returns the AOV flags supported by the backend
+    virtual uint32_t supported_aovs() const
+    {
+        return 0;
+    }
+
+    // Returns true if the backend can render a subset of the framebuffer
+    virtual bool supports_render_regions() const
+    {
+        return false;
+    }
+
+    /* Restrict rendering to the regions of the framebuffer, pixels outside them are
+     * left unchanged. Setting the regions restarts accumulation, so the regions converge
+     * independently of the rest of the frame. An empty list renders the full frame.
+     */
+    virtual void set_render_regions(const std::vector<RenderRegion> &regions) {}
+
+    // Returns true if the backend can move the scene's instances without reloading it
+    virtual bool supports_instance_updates() const
+    {
+        return false;
+    }
+
+    /* Set new transforms for the instances of the scene, given in the order of the scene's
+     * instances. Restarts accumulation. Must be called after set_scene.
+     */
+    virtual void update_instance_transforms(const std::vector<glm::mat4> &transforms) {}
+
+    /* Read back the region's linear RGB color into rgb, row by row. The default converts
+     * the sRGB8 framebuffer of the given width, so the frame must have been read back.
+     * Backends accumulating in float should override this to return the exact values
+     */
+    virtual void read_region(const RenderRegion &region,
+                             const uint32_t fb_width,
+                             float *rgb) const;
+
     virtual void initialize(const int fb_width, const int fb_height) = 0;
 
     // TODO Probably should take the scene through a shared_ptr
@@ -33,6 +33,87 @@ bool operator==(const glm::uvec3 &a, const glm::uvec3 &b)
     return a.x == b.x && a.y == b.y && a.z == b.z;
 }
 
+namespace {
+
+template <typename T>
+uint64_t hash_vector(const std::vector<T> &v, const uint64_t seed)
+{
+    return hash_bytes(v.data(), v.size() * sizeof(T), seed);
+}
+
+uint64_t hash_image(const Image &img)
+{
+    uint64_t h = hash_vector(img.img, img.color_space);
+    const glm::ivec3 dims(img.width, img.height, img.channels);
+    return hash_bytes(&dims, sizeof(dims), h);
+}
+
+uint64_t hash_mesh(const Mesh &mesh)
+{
+    uint64_t h = mesh.geometries.size();
+    for (const auto &g : mesh.geometries) {
+        h = hash_vector(g.vertices, h);
+        h = hash_vector(g.normals, h);
+        h = hash_vector(g.uvs, h);
+        h = hash_vector(g.indices, h);
+    }
+    return h;
+}
+
+bool same_image(const Image &a, const Image &b)
+{
+    return a.width == b.width && a.height == b.height && a.channels == b.channels &&
+           a.color_space == b.color_space && a.img == b.img;
+}
+
+bool same_mesh(const Mesh &a, const Mesh &b)
+{
+    if (a.geometries.size() != b.geometries.size()) {
+        return false;
+    }
+    for (size_t i = 0; i < a.geometries.size(); ++i) {
+        const auto &ga = a.geometries[i];
+        const auto &gb = b.geometries[i];
+        if (ga.vertices != gb.vertices || ga.normals != gb.normals || ga.uvs != gb.uvs ||
+            ga.indices != gb.indices) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Hash the items in parallel and remove any duplicates, keeping the first copy. Returns
+ * the new index of each of the original items. Items with matching hashes are compared
+ * in full, so a hash collision won't merge two different items.
+ */
+template <typename T, typename Hash, typename Eq>
+std::vector<uint32_t> remove_duplicates(std::vector<T> &items, const Hash &hash, const Eq &eq)
+{
+    std::vector<uint64_t> hashes(items.size(), 0);
+    parallel_for_index(items.size(), [&](size_t i) { hashes[i] = hash(items[i]); });
+
+    std::vector<uint32_t> remapping(items.size(), 0);
+    std::vector<T> unique_items;
+    phmap::flat_hash_map<uint64_t, std::vector<uint32_t>> unique_ids;
+    for (size_t i = 0; i < items.size(); ++i) {
+        auto &candidates = unique_ids[hashes[i]];
+        auto fnd = std::find_if(candidates.begin(), candidates.end(), [&](const uint32_t id) {
+            return eq(unique_items[id], items[i]);
+        });
+        if (fnd != candidates.end()) {
+            remapping[i] = *fnd;
+        } else {
+            remapping[i] = unique_items.size();
+            candidates.push_back(unique_items.size());
+            unique_items.push_back(std::move(items[i]));
+        }
+    }
+    items = std::move(unique_items);
+    return remapping;
+}
+
+}
+
 Scene::Scene(const std::string &fname)
 {
     const std::string ext = get_file_extension(fname);
@@ -50,6 +131,9 @@ Scene::Scene(const std::string &fname)
         std::cout << "Unsupported file type '" << ext << "'\n";
         throw std::runtime_error("Unsupported file type " + ext);
     }
+
+    validate_normals();
+    deduplicate();
 }
 
 size_t Scene::unique_tris() const
@@ -264,7 +348,6 @@ void Scene::load_gltf(const std::string &fname)
                 }
             }
 
-#if 0
             fnd = p.attributes.find("NORMAL");
             if (fnd != p.attributes.end()) {
                 Accessor<glm::vec3> normal_accessor(model.accessors[fnd->second], model);
@@ -272,7 +355,6 @@ void Scene::load_gltf(const std::string &fname)
                     geom.normals.push_back(normal_accessor[i]);
                 }
             }
-#endif
 
             if (model.accessors[p.indices].componentType ==
                 TINYGLTF_COMPONENT_TYPE_UNSIGNED_SHORT) {
@@ -431,7 +513,6 @@ void Scene::load_crts(const std::string &file)
             Accessor<glm::vec2> accessor(view);
             geom.uvs = std::vector<glm::vec2>(accessor.begin(), accessor.end());
         }
-#if 0
         if (m.find("normals") != m.end()) {
             const uint64_t view_id = m["normals"].get<uint64_t>();
             auto &v = header["buffer_views"][view_id];
@@ -442,7 +523,6 @@ void Scene::load_crts(const std::string &file)
             Accessor<glm::vec3> accessor(view);
             geom.normals = std::vector<glm::vec3>(accessor.begin(), accessor.end());
         }
-#endif
 
         Mesh mesh;
         mesh.geometries.push_back(geom);
@@ -691,6 +771,13 @@ void Scene::load_pbrt(const std::string &file)
                                    std::back_inserter(geom.uvs),
                                    [](const pbrt::vec2f &v) { return glm::vec2(v.x, v.y); });
 
+                    geom.normals.reserve(mesh->normal.size());
+                    std::transform(
+                        mesh->normal.begin(),
+                        mesh->normal.end(),
+                        std::back_inserter(geom.normals),
+                        [](const pbrt::vec3f &v) { return glm::vec3(v.x, v.y, v.z); });
+
                     geometries.push_back(geom);
                 } else if (pbrt::QuadMesh::SP mesh =
                                std::dynamic_pointer_cast<pbrt::QuadMesh>(g)) {
@@ -916,3 +1003,66 @@ void Scene::validate_materials()
         }
     }
 }
+
+void Scene::validate_normals()
+{
+    size_t num_dropped = 0;
+    for (auto &m : meshes) {
+        for (auto &g : m.geometries) {
+            if (!g.normals.empty() && g.normals.size() != g.vertices.size()) {
+                g.normals.clear();
+                ++num_dropped;
+            }
+        }
+    }
+    if (num_dropped > 0) {
+        std::cout << "Dropped normals for " << num_dropped
+                  << " geometries with mismatched normal and vertex counts\n";
+    }
+}
+
+void Scene::deduplicate()
+{
+    const size_t num_textures = textures.size();
+    const std::vector<uint32_t> texture_remapping =
+        remove_duplicates(textures, hash_image, same_image);
+
+    if (textures.size() != num_textures) {
+        auto remap_param = [&](float &p) {
+            uint32_t mask = *reinterpret_cast<uint32_t *>(&p);
+            if (IS_TEXTURED_PARAM(mask)) {
+                const uint32_t id = texture_remapping[GET_TEXTURE_ID(mask)];
+                mask &= ~uint32_t(0x1fffffff);
+                SET_TEXTURE_ID(mask, id);
+                p = *reinterpret_cast<float *>(&mask);
+            }
+        };
+        for (auto &m : materials) {
+            remap_param(m.base_color.r);
+            remap_param(m.metallic);
+            remap_param(m.specular);
+            remap_param(m.roughness);
+            remap_param(m.specular_tint);
+            remap_param(m.anisotropy);
+            remap_param(m.sheen);
+            remap_param(m.sheen_tint);
+            remap_param(m.clearcoat);
+            remap_param(m.clearcoat_gloss);
+            remap_param(m.ior);
+            remap_param(m.specular_transmission);
+        }
+    }
+
+    const size_t num_meshes = meshes.size();
+    const std::vector<uint32_t> mesh_remapping = remove_duplicates(meshes, hash_mesh, same_mesh);
+    if (meshes.size() != num_meshes) {
+        for (auto &i : instances) {
+            i.mesh_id = mesh_remapping[i.mesh_id];
+        }
+    }
+
+    if (textures.size() != num_textures || meshes.size() != num_meshes) {
+        std::cout << "Removed " << num_textures - textures.size() << " duplicate textures and "
+                  << num_meshes - meshes.size() << " duplicate meshes\n";
+    }
+}
@@ -56,4 +56,11 @@ private:
 #endif
 
     void validate_materials();
+
+    // Drop the vertex normals of any geometry which doesn't have one per-vertex
+    void validate_normals();
+
+    // Merge textures and meshes with identical contents, remapping the material texture
+    // IDs and instance mesh IDs to refer to the remaining unique copy
+    void deduplicate();
 };
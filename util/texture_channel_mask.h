@@ -22,4 +22,26 @@
 #define GET_TEXTURE_ID(x) ((x) & 0x1fffffff)
 #define SET_TEXTURE_ID(x, i) (x |= i & 0x1fffffff)
 
+/* The renderers don't read the handles out of the parameters directly, instead
+ * the material records store the untextured parameter values along with a mask
+ * of which parameters are textured, using the bits below. The handles for the
+ * textured parameters are stored in a separate table, in parameter order, starting
+ * at the material's texture handle offset.
+ */
+#define MATERIAL_PARAM_BASE_COLOR 0
+#define MATERIAL_PARAM_METALLIC 1
+#define MATERIAL_PARAM_SPECULAR 2
+#define MATERIAL_PARAM_ROUGHNESS 3
+#define MATERIAL_PARAM_SPECULAR_TINT 4
+#define MATERIAL_PARAM_ANISOTROPY 5
+#define MATERIAL_PARAM_SHEEN 6
+#define MATERIAL_PARAM_SHEEN_TINT 7
+#define MATERIAL_PARAM_CLEARCOAT 8
+#define MATERIAL_PARAM_CLEARCOAT_GLOSS 9
+#define MATERIAL_PARAM_IOR 10
+#define MATERIAL_PARAM_SPECULAR_TRANSMISSION 11
+#define NUM_MATERIAL_PARAMS 12
+
+#define IS_TEXTURED_MATERIAL_PARAM(mask, p) ((mask) & (1u << (p)))
+
 #endif
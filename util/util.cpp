@@ -1,6 +1,12 @@
 #include <algorithm>
 #include <array>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <sys/stat.h>
 #ifdef _WIN32
+#include <direct.h>
 #include <intrin.h>
 #elif not defined(__aarch64__)
 #include <cpuid.h>
@@ -71,6 +77,50 @@ std::string get_file_extension(const std::string &fname)
     return fname.substr(fnd + 1);
 }
 
+std::string user_cache_dir()
+{
+#ifdef _WIN32
+    const char *local_app_data = std::getenv("LOCALAPPDATA");
+    if (local_app_data && *local_app_data) {
+        std::string dir = std::string(local_app_data) + "/chameleonrt";
+        canonicalize_path(dir);
+        return dir;
+    }
+#else
+    const char *xdg_cache = std::getenv("XDG_CACHE_HOME");
+    if (xdg_cache && *xdg_cache) {
+        return std::string(xdg_cache) + "/chameleonrt";
+    }
+    const char *home = std::getenv("HOME");
+    if (home && *home) {
+        return std::string(home) + "/.cache/chameleonrt";
+    }
+#endif
+    return "";
+}
+
+void make_directories(const std::string &path)
+{
+    std::string dir = path;
+    canonicalize_path(dir);
+    // Create each parent in turn, the ones that already exist will just fail with EEXIST
+    for (size_t sep = dir.find('/', 1); true; sep = dir.find('/', sep + 1)) {
+        const std::string parent = dir.substr(0, sep);
+#ifdef _WIN32
+        const int err = _mkdir(parent.c_str());
+#else
+        const int err = mkdir(parent.c_str(), 0755);
+#endif
+        if (err != 0 && errno != EEXIST) {
+            throw std::runtime_error("Failed to create directory " + parent + ": " +
+                                     std::strerror(errno));
+        }
+        if (sep == std::string::npos) {
+            break;
+        }
+    }
+}
+
 std::string get_cpu_brand()
 {
 #if defined(__APPLE__) and defined(__aarch64__)
@@ -119,3 +169,33 @@ float luminance(const glm::vec3 &c)
 {
     return 0.2126f * c.x + 0.7152f * c.y + 0.0722f * c.z;
 }
+
+uint64_t hash_bytes(const void *data, const size_t nbytes, uint64_t seed)
+{
+    // Mix in 8 bytes at a time using the murmur3 64-bit finalizer as the mixing
+    // function, then fold in any remaining tail bytes
+    auto mix = [](uint64_t k) {
+        k ^= k >> 33;
+        k *= 0xff51afd7ed558ccdULL;
+        k ^= k >> 33;
+        k *= 0xc4ceb9fe1a85ec53ULL;
+        k ^= k >> 33;
+        return k;
+    };
+
+    const uint8_t *bytes = static_cast<const uint8_t *>(data);
+    uint64_t hash = seed ^ (nbytes * 0x9e3779b97f4a7c15ULL);
+    size_t i = 0;
+    for (; i + 8 <= nbytes; i += 8) {
+        uint64_t k;
+        std::memcpy(&k, bytes + i, sizeof(k));
+        hash = (hash ^ mix(k)) * 0x9e3779b97f4a7c15ULL;
+    }
+
+    uint64_t tail = 0;
+    for (size_t j = 0; i + j < nbytes; ++j) {
+        tail |= uint64_t(bytes[i + j]) << (8 * j);
+    }
+    hash = (hash ^ mix(tail)) * 0x9e3779b97f4a7c15ULL;
+    return mix(hash);
+}
@@ -1,6 +1,11 @@
 #pragma once
 
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
 #include <string>
+#include <thread>
+#include <vector>
 #include <glm/glm.hpp>
 
 // Format the count as #G, #M, #K, depending on its magnitude
@@ -14,6 +19,13 @@ void canonicalize_path(std::string &path);
 
 std::string get_file_extension(const std::string &fname);
 
+// The per-user directory to keep caches in: $XDG_CACHE_HOME/chameleonrt, ~/.cache/chameleonrt
+// or %LOCALAPPDATA%/chameleonrt on Windows. Returns an empty string if none is known
+std::string user_cache_dir();
+
+// Create the directory and any missing parents, throws if it can't be created
+void make_directories(const std::string &path);
+
 std::string get_cpu_brand();
 
 float srgb_to_linear(const float x);
@@ -21,3 +33,27 @@ float srgb_to_linear(const float x);
 float linear_to_srgb(const float x);
 
 float luminance(const glm::vec3 &c);
+
+// Hash a block of bytes to a 64-bit value, used to identify identical texture
+// and buffer contents
+uint64_t hash_bytes(const void *data, const size_t nbytes, uint64_t seed = 0);
+
+// Run fn(i) for each i in [0, n), pulling indices dynamically across the hardware threads
+template <typename F>
+void parallel_for_index(const size_t n, const F &fn)
+{
+    const size_t num_threads =
+        std::min(size_t(std::max(std::thread::hardware_concurrency(), 1u)), n);
+    std::atomic<size_t> next(0);
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < num_threads; ++t) {
+        threads.emplace_back([&]() {
+            for (size_t i = next++; i < n; i = next++) {
+                fn(i);
+            }
+        });
+    }
+    for (auto &t : threads) {
+        t.join();
+    }
+}
@@ -0,0 +1,255 @@
+#include "memory_allocator.h"
+#include <algorithm>
+#include "vulkan_utils.h"
+
+namespace vkrt {
+
+MemoryAllocator::MemoryAllocator(VkDevice device,
+                                 const VkPhysicalDeviceMemoryProperties &mem_props,
+                                 VkDeviceSize non_coherent_atom_size,
+                                 VkDeviceSize max_block_size)
+    : device(device), mem_props(mem_props)
+{
+    // Allocations must cover whole atoms so flushing one doesn't touch its neighbors
+    min_alloc_size = std::max(min_alloc_size, non_coherent_atom_size);
+
+    for (uint32_t i = 0; i < mem_props.memoryTypeCount; ++i) {
+        // Don't let one block take up too much of a small heap
+        const VkDeviceSize heap_size =
+            mem_props.memoryHeaps[mem_props.memoryTypes[i].heapIndex].size;
+        Pool pool;
+        pool.memory_type = i;
+        pool.block_size = min_alloc_size;
+        while (pool.block_size * 2 <= std::min(max_block_size, heap_size / 8)) {
+            pool.block_size *= 2;
+            ++pool.max_order;
+        }
+        // One pool for linear resources and one for optimally tiled ones
+        pools.push_back(pool);
+        pools.push_back(pool);
+    }
+}
+
+MemoryAllocator::~MemoryAllocator()
+{
+    for (auto &pool : pools) {
+        for (auto &block : pool.blocks) {
+            if (block.mem != VK_NULL_HANDLE) {
+                free_memory(block.mem, pool.block_size, block.mapping != nullptr);
+            }
+        }
+    }
+}
+
+MemoryAllocation MemoryAllocator::allocate(const VkMemoryRequirements &reqs,
+                                           uint32_t memory_type,
+                                           bool optimal_tiling)
+{
+    const uint32_t pool_index = memory_type * 2 + (optimal_tiling ? 1 : 0);
+    Pool &pool = pools[pool_index];
+
+    MemoryAllocation alloc;
+    alloc.host_coherent = mem_props.memoryTypes[memory_type].propertyFlags &
+                          VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+
+    // Buddy blocks are aligned to their size, so rounding the size up to a power of two
+    // which is at least the alignment also satisfies the alignment
+    const VkDeviceSize alloc_size = std::max(reqs.size, reqs.alignment);
+    uint32_t order = 0;
+    while ((min_alloc_size << order) < alloc_size) {
+        ++order;
+    }
+
+    if (order > pool.max_order) {
+        alloc.mem = allocate_memory(reqs.size, memory_type, &alloc.mapping);
+        alloc.size = reqs.size;
+        ++mem_stats.allocations;
+        mem_stats.bytes_allocated += alloc.size;
+        return alloc;
+    }
+
+    // Take the smallest free block which fits from the existing blocks
+    uint32_t block_index = pool.blocks.size();
+    uint32_t free_order = pool.max_order + 1;
+    for (uint32_t i = 0; i < pool.blocks.size(); ++i) {
+        const Block &b = pool.blocks[i];
+        if (b.mem == VK_NULL_HANDLE) {
+            continue;
+        }
+        for (uint32_t j = order; j < free_order; ++j) {
+            if (!b.free_lists[j].empty()) {
+                block_index = i;
+                free_order = j;
+                break;
+            }
+        }
+    }
+
+    // None of the blocks have space, so make a new one, reusing a released block's slot
+    if (free_order > pool.max_order) {
+        auto empty_slot = std::find_if(pool.blocks.begin(),
+                                       pool.blocks.end(),
+                                       [](const Block &b) { return b.mem == VK_NULL_HANDLE; });
+        block_index = std::distance(pool.blocks.begin(), empty_slot);
+        if (empty_slot == pool.blocks.end()) {
+            pool.blocks.emplace_back();
+        }
+
+        Block &b = pool.blocks[block_index];
+        b.mem = allocate_memory(pool.block_size, memory_type, &b.mapping);
+        b.free_lists.resize(pool.max_order + 1);
+        b.free_lists[pool.max_order].insert(0);
+        free_order = pool.max_order;
+    }
+
+    Block &block = pool.blocks[block_index];
+    const VkDeviceSize offset = *block.free_lists[free_order].begin();
+    block.free_lists[free_order].erase(block.free_lists[free_order].begin());
+
+    // Split the free block down to the size we need, freeing the upper halves
+    while (free_order > order) {
+        --free_order;
+        block.free_lists[free_order].insert(offset + (min_alloc_size << free_order));
+    }
+
+    alloc.mem = block.mem;
+    alloc.offset = offset;
+    alloc.size = min_alloc_size << order;
+    alloc.mapping = block.mapping ? block.mapping + offset : nullptr;
+    alloc.pool = pool_index;
+    alloc.block = block_index;
+    alloc.order = order;
+
+    ++mem_stats.allocations;
+    mem_stats.bytes_allocated += alloc.size;
+    return alloc;
+}
+
+void MemoryAllocator::free(const MemoryAllocation &alloc)
+{
+    if (alloc.mem == VK_NULL_HANDLE) {
+        return;
+    }
+    --mem_stats.allocations;
+    mem_stats.bytes_allocated -= alloc.size;
+
+    if (alloc.pool == uint32_t(-1)) {
+        free_memory(alloc.mem, alloc.size, alloc.mapping != nullptr);
+        return;
+    }
+
+    Pool &pool = pools[alloc.pool];
+    Block &block = pool.blocks[alloc.block];
+
+    // Merge the freed block with its buddy for as long as the buddy is also free
+    VkDeviceSize offset = alloc.offset;
+    uint32_t order = alloc.order;
+    while (order < pool.max_order) {
+        const VkDeviceSize buddy = offset ^ (min_alloc_size << order);
+        auto fnd = block.free_lists[order].find(buddy);
+        if (fnd == block.free_lists[order].end()) {
+            break;
+        }
+        block.free_lists[order].erase(fnd);
+        offset = std::min(offset, buddy);
+        ++order;
+    }
+
+    // Release the block's memory once nothing is using it, unless it's the pool's only
+    // empty block, which is kept to serve the next allocations
+    if (order == pool.max_order) {
+        const bool have_empty_block =
+            std::any_of(pool.blocks.begin(), pool.blocks.end(), [&](const Block &b) {
+                return &b != &block && b.mem != VK_NULL_HANDLE &&
+                       !b.free_lists[pool.max_order].empty();
+            });
+        if (have_empty_block) {
+            free_memory(block.mem, pool.block_size, block.mapping != nullptr);
+            block = Block();
+            return;
+        }
+    }
+    block.free_lists[order].insert(offset);
+}
+
+void MemoryAllocator::flush(const MemoryAllocation &alloc)
+{
+    if (alloc.host_coherent || !alloc.mapping) {
+        return;
+    }
+    VkMappedMemoryRange range = {};
+    range.sType = VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE;
+    range.memory = alloc.mem;
+    range.offset = alloc.offset;
+    range.size = alloc.pool == uint32_t(-1) ? VK_WHOLE_SIZE : alloc.size;
+    CHECK_VULKAN(vkFlushMappedMemoryRanges(device, 1, &range));
+}
+
+void MemoryAllocator::invalidate(const MemoryAllocation &alloc)
+{
+    if (alloc.host_coherent || !alloc.mapping) {
+        return;
+    }
+    VkMappedMemoryRange range = {};
+    range.sType = VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE;
+    range.memory = alloc.mem;
+    range.offset = alloc.offset;
+    range.size = alloc.pool == uint32_t(-1) ? VK_WHOLE_SIZE : alloc.size;
+    CHECK_VULKAN(vkInvalidateMappedMemoryRanges(device, 1, &range));
+}
+
+const MemoryStats &MemoryAllocator::stats() const
+{
+    return mem_stats;
+}
+
+VkDeviceMemory MemoryAllocator::allocate_memory(VkDeviceSize size,
+                                                uint32_t memory_type,
+                                                uint8_t **mapping)
+{
+    VkMemoryAllocateInfo info = {};
+    info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+    info.allocationSize = size;
+    info.memoryTypeIndex = memory_type;
+
+    // Any buffer in the block may need its device address, so allow it for all of them
+    VkMemoryAllocateFlagsInfo flags = {};
+    flags.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_FLAGS_INFO;
+    flags.flags = VK_MEMORY_ALLOCATE_DEVICE_ADDRESS_BIT;
+    info.pNext = &flags;
+
+    VkDeviceMemory mem = VK_NULL_HANDLE;
+    CHECK_VULKAN(vkAllocateMemory(device, &info, nullptr, &mem));
+
+    *mapping = nullptr;
+    if (host_visible(memory_type)) {
+        void *map = nullptr;
+        CHECK_VULKAN(vkMapMemory(device, mem, 0, VK_WHOLE_SIZE, 0, &map));
+        *mapping = reinterpret_cast<uint8_t *>(map);
+    }
+
+    ++mem_stats.device_allocations;
+    mem_stats.bytes_reserved += size;
+    mem_stats.peak_bytes_reserved =
+        std::max(mem_stats.peak_bytes_reserved, mem_stats.bytes_reserved);
+    return mem;
+}
+
+void MemoryAllocator::free_memory(VkDeviceMemory mem, VkDeviceSize size, bool mapped)
+{
+    if (mapped) {
+        vkUnmapMemory(device, mem);
+    }
+    vkFreeMemory(device, mem, nullptr);
+
+    --mem_stats.device_allocations;
+    mem_stats.bytes_reserved -= size;
+}
+
+bool MemoryAllocator::host_visible(uint32_t memory_type) const
+{
+    return mem_props.memoryTypes[memory_type].propertyFlags &
+           VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT;
+}
+
+}
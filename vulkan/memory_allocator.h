@@ -0,0 +1,97 @@
+#pragma once
+
+#include <cstdint>
+#include <set>
+#include <vector>
+#include <vulkan/vulkan.h>
+
+namespace vkrt {
+
+struct MemoryAllocation {
+    VkDeviceMemory mem = VK_NULL_HANDLE;
+    VkDeviceSize offset = 0;
+    VkDeviceSize size = 0;
+    // Pointer to the start of the allocation if the memory is host visible
+    uint8_t *mapping = nullptr;
+    bool host_coherent = true;
+
+    // Where the allocation came from, a pool of -1 is a dedicated allocation
+    uint32_t pool = -1;
+    uint32_t block = 0;
+    uint32_t order = 0;
+};
+
+struct MemoryStats {
+    // The VkDeviceMemory allocations currently held and their total size
+    size_t device_allocations = 0;
+    size_t bytes_reserved = 0;
+    // The buffers and images currently allocated and their total size, after rounding up
+    // to the allocator's block sizes
+    size_t allocations = 0;
+    size_t bytes_allocated = 0;
+    size_t peak_bytes_reserved = 0;
+};
+
+/* Sub-allocates buffer and image memory out of large VkDeviceMemory blocks using a buddy
+ * allocator, so the number of device memory allocations stays small regardless of how many
+ * resources the scene has. Each memory type has separate pools for linear and optimally
+ * tiled resources, so bufferImageGranularity never needs to be considered. Host visible
+ * blocks are mapped once when created, and requests larger than a block get a dedicated
+ * allocation. Each pool keeps one empty block around when its resources are freed, so
+ * freeing and recreating a resource doesn't allocate and free device memory each time.
+ * The allocator is not thread safe, allocations and frees must be made from one thread
+ * at a time.
+ */
+class MemoryAllocator {
+    struct Block {
+        VkDeviceMemory mem = VK_NULL_HANDLE;
+        uint8_t *mapping = nullptr;
+        // The offsets of the free blocks of each order, order 0 is min_alloc_size
+        std::vector<std::set<VkDeviceSize>> free_lists;
+    };
+
+    struct Pool {
+        uint32_t memory_type = 0;
+        VkDeviceSize block_size = 0;
+        uint32_t max_order = 0;
+        std::vector<Block> blocks;
+    };
+
+    VkDevice device = VK_NULL_HANDLE;
+    VkPhysicalDeviceMemoryProperties mem_props = {};
+    VkDeviceSize min_alloc_size = 256;
+    std::vector<Pool> pools;
+    MemoryStats mem_stats;
+
+    VkDeviceMemory allocate_memory(VkDeviceSize size, uint32_t memory_type, uint8_t **mapping);
+
+    void free_memory(VkDeviceMemory mem, VkDeviceSize size, bool mapped);
+
+    bool host_visible(uint32_t memory_type) const;
+
+public:
+    MemoryAllocator(VkDevice device,
+                    const VkPhysicalDeviceMemoryProperties &mem_props,
+                    VkDeviceSize non_coherent_atom_size,
+                    VkDeviceSize max_block_size = 256 * 1024 * 1024);
+    ~MemoryAllocator();
+
+    MemoryAllocator(const MemoryAllocator &) = delete;
+    MemoryAllocator &operator=(const MemoryAllocator &) = delete;
+
+    MemoryAllocation allocate(const VkMemoryRequirements &reqs,
+                              uint32_t memory_type,
+                              bool optimal_tiling);
+
+    void free(const MemoryAllocation &alloc);
+
+    // Make host writes to a non-coherent allocation visible to the device
+    void flush(const MemoryAllocation &alloc);
+
+    // Make device writes to a non-coherent allocation visible to the host
+    void invalidate(const MemoryAllocation &alloc);
+
+    const MemoryStats &stats() const;
+};
+
+}
@@ -11,6 +11,18 @@
 #include "shaders.hxx"
 #include <glm/ext.hpp>
 
+// Set the instance's 4x3 row major transform
+static void set_instance_transform(VkAccelerationStructureInstanceKHR &instance,
+                                   const glm::mat4 &transform)
+{
+    const glm::mat4 m = glm::transpose(transform);
+    for (int r = 0; r < 3; ++r) {
+        for (int c = 0; c < 4; ++c) {
+            instance.transform.matrix[r][c] = m[r][c];
+        }
+    }
+}
+
 RenderVulkan::RenderVulkan(std::shared_ptr<vkrt::Device> dev)
     : device(dev), native_display(true)
 {
@@ -26,28 +38,63 @@ RenderVulkan::RenderVulkan(std::shared_ptr<vkrt::Device> dev)
     }
 
     render_cmd_pool = device->make_command_pool();
-    {
+    update_cmd_pool =
+        device->make_command_pool(VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT);
+
+    frames.resize(frames_in_flight);
+    // Queues which write no valid timestamp bits don't support timestamps
+    const uint32_t timestamp_bits = device->timestamp_valid_bits();
+    if (device->properties().limits.timestampComputeAndGraphics && timestamp_bits > 0) {
+        timestamp_mask =
+            timestamp_bits >= 64 ? ~uint64_t(0) : (uint64_t(1) << timestamp_bits) - 1;
+        VkQueryPoolCreateInfo info = {};
+        info.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+        info.queryType = VK_QUERY_TYPE_TIMESTAMP;
+        info.queryCount = 4 * frames.size();
+        CHECK_VULKAN(
+            vkCreateQueryPool(device->logical_device(), &info, nullptr, &timestamp_pool));
+    }
+
+    for (size_t i = 0; i < frames.size(); ++i) {
+        FrameResources &frame = frames[i];
+        frame.timestamp_query = 4 * i;
+
         VkCommandBufferAllocateInfo info = {};
         info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
         info.commandPool = render_cmd_pool;
         info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
         info.commandBufferCount = 1;
         CHECK_VULKAN(
-            vkAllocateCommandBuffers(device->logical_device(), &info, &render_cmd_buf));
+            vkAllocateCommandBuffers(device->logical_device(), &info, &frame.render_cmd_buf));
+        CHECK_VULKAN(vkAllocateCommandBuffers(
+            device->logical_device(), &info, &frame.readback_cmd_buf));
+
+        info.commandPool = update_cmd_pool;
         CHECK_VULKAN(
-            vkAllocateCommandBuffers(device->logical_device(), &info, &readback_cmd_buf));
-    }
+            vkAllocateCommandBuffers(device->logical_device(), &info, &frame.update_cmd_buf));
 
-    {
-        VkFenceCreateInfo info = {};
-        info.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
-        CHECK_VULKAN(vkCreateFence(device->logical_device(), &info, nullptr, &fence));
-    }
+        VkFenceCreateInfo fence_info = {};
+        fence_info.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+        CHECK_VULKAN(
+            vkCreateFence(device->logical_device(), &fence_info, nullptr, &frame.fence));
+
+#ifdef REPORT_RAY_STATS
+        // The counters are the total rays, the shadow rays, then the rays at each bounce
+        const size_t ray_stats_size = (2 + MAX_PATH_DEPTH) * sizeof(uint64_t);
+        frame.ray_stats_buf = vkrt::Buffer::device(*device,
+                                                   ray_stats_size,
+                                                   VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+                                                       VK_BUFFER_USAGE_TRANSFER_SRC_BIT |
+                                                       VK_BUFFER_USAGE_TRANSFER_DST_BIT);
+        frame.ray_stats_readback_buf =
+            vkrt::Buffer::host(*device, ray_stats_size, VK_BUFFER_USAGE_TRANSFER_DST_BIT);
+#endif
 
-    view_param_buf = vkrt::Buffer::host(*device,
-                                        4 * sizeof(glm::vec4) + sizeof(uint32_t),
-                                        VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
-                                        VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+        frame.view_param_buf = vkrt::Buffer::host(*device,
+                                                  4 * sizeof(glm::vec4) + 3 * sizeof(uint32_t),
+                                                  VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
+                                                  VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+    }
 }
 
 RenderVulkan::RenderVulkan() : RenderVulkan(std::make_shared<vkrt::Device>())
@@ -57,14 +104,19 @@ RenderVulkan::RenderVulkan() : RenderVulkan(std::make_shared<vkrt::Device>())
 
 RenderVulkan::~RenderVulkan()
 {
+    wait_for_frames();
+    for (auto &frame : frames) {
+        vkDestroyFence(device->logical_device(), frame.fence, nullptr);
+    }
+    vkDestroyQueryPool(device->logical_device(), timestamp_pool, nullptr);
     vkDestroySampler(device->logical_device(), sampler, nullptr);
     vkDestroyCommandPool(device->logical_device(), command_pool, nullptr);
     vkDestroyCommandPool(device->logical_device(), render_cmd_pool, nullptr);
+    vkDestroyCommandPool(device->logical_device(), update_cmd_pool, nullptr);
     vkDestroyPipelineLayout(device->logical_device(), pipeline_layout, nullptr);
     vkDestroyDescriptorSetLayout(device->logical_device(), desc_layout, nullptr);
     vkDestroyDescriptorSetLayout(device->logical_device(), textures_desc_layout, nullptr);
     vkDestroyDescriptorPool(device->logical_device(), desc_pool, nullptr);
-    vkDestroyFence(device->logical_device(), fence, nullptr);
     vkDestroyPipeline(device->logical_device(), rt_pipeline.handle(), nullptr);
 }
 
@@ -75,7 +127,11 @@ std::string RenderVulkan::name()
 
 void RenderVulkan::initialize(const int fb_width, const int fb_height)
 {
+    // The frames still in flight are using the old framebuffers
+    wait_for_frames();
+
     frame_id = 0;
+    accumulated_samples = 0;
     img.resize(fb_width * fb_height);
 
     render_target =
@@ -89,19 +145,11 @@ void RenderVulkan::initialize(const int fb_width, const int fb_height)
                                            VK_FORMAT_R32G32B32A32_SFLOAT,
                                            VK_IMAGE_USAGE_STORAGE_BIT);
 
-    img_readback_buf = vkrt::Buffer::host(
-        *device, img.size() * render_target->pixel_size(), VK_BUFFER_USAGE_TRANSFER_DST_BIT);
-
-#ifdef REPORT_RAY_STATS
-    ray_stats =
-        vkrt::Texture2D::device(*device,
-                                glm::uvec2(fb_width, fb_height),
-                                VK_FORMAT_R16_UINT,
-                                VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_STORAGE_BIT);
-    ray_stats_readback_buf = vkrt::Buffer::host(
-        *device, img.size() * ray_stats->pixel_size(), VK_BUFFER_USAGE_TRANSFER_DST_BIT);
-    ray_counts.resize(img.size(), 0);
-#endif
+    for (auto &frame : frames) {
+        frame.img_readback_buf = vkrt::Buffer::host(*device,
+                                                    img.size() * render_target->pixel_size(),
+                                                    VK_BUFFER_USAGE_TRANSFER_DST_BIT);
+    }
 
     // Change image and accum buffer to the general layout
     {
@@ -110,11 +158,7 @@ void RenderVulkan::initialize(const int fb_width, const int fb_height)
         begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
         CHECK_VULKAN(vkBeginCommandBuffer(command_buffer, &begin_info));
 
-#ifndef REPORT_RAY_STATS
         std::array<VkImageMemoryBarrier, 2> barriers = {};
-#else
-        std::array<VkImageMemoryBarrier, 3> barriers = {};
-#endif
         for (auto &b : barriers) {
             b = VkImageMemoryBarrier{};
             b.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
@@ -128,9 +172,6 @@ void RenderVulkan::initialize(const int fb_width, const int fb_height)
         }
         barriers[0].image = render_target->image_handle();
         barriers[1].image = accum_buffer->image_handle();
-#ifdef REPORT_RAY_STATS
-        barriers[2].image = ray_stats->image_handle();
-#endif
 
         vkCmdPipelineBarrier(command_buffer,
                              VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
@@ -162,14 +203,13 @@ void RenderVulkan::initialize(const int fb_width, const int fb_height)
 
     // If we've loaded the scene and are rendering (i.e., the window was just resized while
     // running) update the descriptor sets and re-record the rendering commands
-    if (desc_set != VK_NULL_HANDLE) {
-        vkrt::DescriptorSetUpdater()
-            .write_storage_image(desc_set, 1, render_target)
-            .write_storage_image(desc_set, 2, accum_buffer)
-#ifdef REPORT_RAY_STATS
-            .write_storage_image(desc_set, 6, ray_stats)
-#endif
-            .update(*device);
+    if (frames[0].desc_set != VK_NULL_HANDLE) {
+        vkrt::DescriptorSetUpdater updater;
+        for (auto &frame : frames) {
+            updater.write_storage_image(frame.desc_set, 1, render_target)
+                .write_storage_image(frame.desc_set, 2, accum_buffer);
+        }
+        updater.update(*device);
 
         record_command_buffers();
     }
@@ -177,476 +217,293 @@ void RenderVulkan::initialize(const int fb_width, const int fb_height)
 
 void RenderVulkan::set_scene(const Scene &scene)
 {
+    using namespace std::chrono;
+    wait_for_frames();
     frame_id = 0;
+    accumulated_samples = 0;
+
+    // Any instance updates were for the previous scene
+    tlas_refits = 0;
+    instances_changed = false;
+    for (auto &frame : frames) {
+        frame.instance_upload_buf = nullptr;
+    }
+
+    auto start = high_resolution_clock::now();
+
+    // All the uploads and builds are recorded through the staging ring, which only
+    // submits when it fills up or we need the results of the work so far
+    vkrt::StagingRing staging(*device);
 
-    // TODO: We can actually run all these uploads and BVH builds in parallel
-    // using multiple command lists, as long as the BVH builds don't need so
-    // much build + scratch that we run out of GPU memory.
-    // Some helpers for managing the temp upload heap buf allocation and queuing of
-    // the commands would help to make it easier to write the parallel load version
+    // Pack all the geometry into scene wide buffers, so it takes a few allocations and
+    // large copies to upload instead of a few per geometry
+    std::vector<glm::vec3> vertices, normals;
+    std::vector<glm::uvec3> indices;
+    std::vector<glm::vec2> uvs;
     for (const auto &mesh : scene.meshes) {
-        std::vector<vkrt::Geometry> geometries;
         for (const auto &geom : mesh.geometries) {
-            // Upload triangle vertices to the device
-            auto upload_verts = vkrt::Buffer::host(*device,
-                                                   geom.vertices.size() * sizeof(glm::vec3),
-                                                   VK_BUFFER_USAGE_TRANSFER_SRC_BIT);
-            {
-                void *map = upload_verts->map();
-                std::memcpy(map, geom.vertices.data(), upload_verts->size());
-                upload_verts->unmap();
-            }
+            vertices.insert(vertices.end(), geom.vertices.begin(), geom.vertices.end());
+            indices.insert(indices.end(), geom.indices.begin(), geom.indices.end());
+            normals.insert(normals.end(), geom.normals.begin(), geom.normals.end());
+            uvs.insert(uvs.end(), geom.uvs.begin(), geom.uvs.end());
+        }
+    }
 
-            auto upload_indices = vkrt::Buffer::host(*device,
-                                                     geom.indices.size() * sizeof(glm::uvec3),
-                                                     VK_BUFFER_USAGE_TRANSFER_SRC_BIT);
-            {
-                void *map = upload_indices->map();
-                std::memcpy(map, geom.indices.data(), upload_indices->size());
-                upload_indices->unmap();
-            }
+    const VkBufferUsageFlags geometry_usage = VK_BUFFER_USAGE_TRANSFER_DST_BIT |
+                                              VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+                                              VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT;
+    vertex_buf = vkrt::Buffer::device(
+        *device, vertices.size() * sizeof(glm::vec3), geometry_usage);
+    staging.upload(vertices.data(), vertex_buf->size(), vertex_buf);
+
+    index_buf = vkrt::Buffer::device(
+        *device, indices.size() * sizeof(glm::uvec3), geometry_usage);
+    staging.upload(indices.data(), index_buf->size(), index_buf);
+
+    if (!normals.empty()) {
+        normal_buf = vkrt::Buffer::device(
+            *device, normals.size() * sizeof(glm::vec3), geometry_usage);
+        staging.upload(normals.data(), normal_buf->size(), normal_buf);
+    }
+
+    if (!uvs.empty()) {
+        uv_buf = vkrt::Buffer::device(*device, uvs.size() * sizeof(glm::vec2), geometry_usage);
+        staging.upload(uvs.data(), uv_buf->size(), uv_buf);
+    }
+
+    SceneGeometryParams geometry_params;
+    geometry_params.vert_buf = vertex_buf->device_address();
+    geometry_params.idx_buf = index_buf->device_address();
+    geometry_params.normal_buf = normal_buf ? normal_buf->device_address() : 0;
+    geometry_params.uv_buf = uv_buf ? uv_buf->device_address() : 0;
+    scene_geometry_params = vkrt::Buffer::device(
+        *device,
+        sizeof(SceneGeometryParams),
+        VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT);
+    staging.upload(&geometry_params, sizeof(SceneGeometryParams), scene_geometry_params);
+
+    uint32_t vertex_offset = 0;
+    uint32_t index_offset = 0;
+    uint32_t normal_offset = 0;
+    uint32_t uv_offset = 0;
+    for (const auto &mesh : scene.meshes) {
+        std::vector<vkrt::Geometry> geometries;
+        for (const auto &geom : mesh.geometries) {
+            vkrt::Geometry g(vertex_buf,
+                             vertex_offset,
+                             geom.vertices.size(),
+                             index_buf,
+                             index_offset,
+                             geom.indices.size());
+            vertex_offset += geom.vertices.size();
+            index_offset += geom.indices.size();
 
-            std::shared_ptr<vkrt::Buffer> upload_normals = nullptr;
-            std::shared_ptr<vkrt::Buffer> normal_buf = nullptr;
             if (!geom.normals.empty()) {
-                upload_normals = vkrt::Buffer::host(*device,
-                                                    geom.normals.size() * sizeof(glm::vec3),
-                                                    VK_BUFFER_USAGE_TRANSFER_SRC_BIT);
-                normal_buf = vkrt::Buffer::device(
-                    *device,
-                    upload_normals->size(),
-                    VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
-                        VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT);
-
-                void *map = upload_normals->map();
-                std::memcpy(map, geom.normals.data(), upload_normals->size());
-                upload_normals->unmap();
+                g.normal_buf = normal_buf;
+                g.normal_offset = normal_offset;
+                normal_offset += geom.normals.size();
             }
-
-            std::shared_ptr<vkrt::Buffer> upload_uvs = nullptr;
-            std::shared_ptr<vkrt::Buffer> uv_buf = nullptr;
             if (!geom.uvs.empty()) {
-                upload_uvs = vkrt::Buffer::host(*device,
-                                                geom.uvs.size() * sizeof(glm::vec2),
-                                                VK_BUFFER_USAGE_TRANSFER_SRC_BIT);
-                uv_buf = vkrt::Buffer::device(*device,
-                                              upload_uvs->size(),
-                                              VK_BUFFER_USAGE_TRANSFER_DST_BIT |
-                                                  VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
-                                                  VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT);
-
-                void *map = upload_uvs->map();
-                std::memcpy(map, geom.uvs.data(), upload_uvs->size());
-                upload_uvs->unmap();
+                g.uv_buf = uv_buf;
+                g.uv_offset = uv_offset;
+                uv_offset += geom.uvs.size();
             }
 
-            auto vertex_buf = vkrt::Buffer::device(
-                *device,
-                upload_verts->size(),
-                VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
-                    VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT);
-
-            auto index_buf = vkrt::Buffer::device(
-                *device,
-                upload_indices->size(),
-                VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
-                    VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT);
-
-            // Execute the upload to the device
-            {
-                VkCommandBufferBeginInfo begin_info = {};
-                begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-                begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
-                CHECK_VULKAN(vkBeginCommandBuffer(command_buffer, &begin_info));
-
-                VkBufferCopy copy_cmd = {};
-                copy_cmd.size = upload_verts->size();
-                vkCmdCopyBuffer(command_buffer,
-                                upload_verts->handle(),
-                                vertex_buf->handle(),
-                                1,
-                                &copy_cmd);
-
-                copy_cmd.size = upload_indices->size();
-                vkCmdCopyBuffer(command_buffer,
-                                upload_indices->handle(),
-                                index_buf->handle(),
-                                1,
-                                &copy_cmd);
-
-                if (upload_normals) {
-                    copy_cmd.size = upload_normals->size();
-                    vkCmdCopyBuffer(command_buffer,
-                                    upload_normals->handle(),
-                                    normal_buf->handle(),
-                                    1,
-                                    &copy_cmd);
-                }
-
-                if (upload_uvs) {
-                    copy_cmd.size = upload_uvs->size();
-                    vkCmdCopyBuffer(
-                        command_buffer, upload_uvs->handle(), uv_buf->handle(), 1, &copy_cmd);
-                }
-
-                CHECK_VULKAN(vkEndCommandBuffer(command_buffer));
-
-                VkSubmitInfo submit_info = {};
-                submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-                submit_info.commandBufferCount = 1;
-                submit_info.pCommandBuffers = &command_buffer;
-                CHECK_VULKAN(
-                    vkQueueSubmit(device->graphics_queue(), 1, &submit_info, VK_NULL_HANDLE));
-                CHECK_VULKAN(vkQueueWaitIdle(device->graphics_queue()));
-
-                vkResetCommandPool(device->logical_device(),
-                                   command_pool,
-                                   VK_COMMAND_POOL_RESET_RELEASE_RESOURCES_BIT);
-            }
-
-            geometries.emplace_back(vertex_buf, index_buf, normal_buf, uv_buf);
+            geometries.push_back(g);
             ++total_geom;
         }
-
-        // Build the bottom level acceleration structure
-        auto bvh = std::make_unique<vkrt::TriangleMesh>(*device, geometries);
-        {
-            // TODO: some convenience utils for this
-            VkCommandBufferBeginInfo begin_info = {};
-            begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-            begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
-            CHECK_VULKAN(vkBeginCommandBuffer(command_buffer, &begin_info));
-
-            bvh->enqueue_build(command_buffer);
-
-            CHECK_VULKAN(vkEndCommandBuffer(command_buffer));
-
-            VkSubmitInfo submit_info = {};
-            submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-            submit_info.commandBufferCount = 1;
-            submit_info.pCommandBuffers = &command_buffer;
-            CHECK_VULKAN(
-                vkQueueSubmit(device->graphics_queue(), 1, &submit_info, VK_NULL_HANDLE));
-            CHECK_VULKAN(vkQueueWaitIdle(device->graphics_queue()));
-
-            vkResetCommandPool(device->logical_device(),
-                               command_pool,
-                               VK_COMMAND_POOL_RESET_RELEASE_RESOURCES_BIT);
-        }
-
-        // Compact the BVH
-        {
-            VkCommandBufferBeginInfo begin_info = {};
-            begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-            begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
-            CHECK_VULKAN(vkBeginCommandBuffer(command_buffer, &begin_info));
-
-            bvh->enqueue_compaction(command_buffer);
-
-            CHECK_VULKAN(vkEndCommandBuffer(command_buffer));
-
-            VkSubmitInfo submit_info = {};
-            submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-            submit_info.commandBufferCount = 1;
-            submit_info.pCommandBuffers = &command_buffer;
-            CHECK_VULKAN(
-                vkQueueSubmit(device->graphics_queue(), 1, &submit_info, VK_NULL_HANDLE));
-            CHECK_VULKAN(vkQueueWaitIdle(device->graphics_queue()));
-
-            vkResetCommandPool(device->logical_device(),
-                               command_pool,
-                               VK_COMMAND_POOL_RESET_RELEASE_RESOURCES_BIT);
-        }
-        bvh->finalize();
-        meshes.emplace_back(std::move(bvh));
+        meshes.emplace_back(std::make_unique<vkrt::TriangleMesh>(*device, geometries));
     }
+    // Finish the geometry upload before building so the phases can be timed separately
+    staging.flush();
 
-    std::shared_ptr<vkrt::Buffer> instance_buf;
-    {
-        // Setup the instance buffer
-        auto upload_instances = vkrt::Buffer::host(
-            *device,
-            scene.instances.size() * sizeof(VkAccelerationStructureInstanceKHR),
-            VK_BUFFER_USAGE_TRANSFER_SRC_BIT);
-        VkAccelerationStructureInstanceKHR *map =
-            reinterpret_cast<VkAccelerationStructureInstanceKHR *>(upload_instances->map());
-
-        size_t instance_hitgroup_offset = 0;
-        for (size_t i = 0; i < scene.instances.size(); ++i) {
-            const auto &inst = scene.instances[i];
-            std::memset(&map[i], 0, sizeof(VkAccelerationStructureInstanceKHR));
-            map[i].instanceCustomIndex = i;
-            map[i].instanceShaderBindingTableRecordOffset = instance_hitgroup_offset;
-            map[i].flags = VK_GEOMETRY_INSTANCE_FORCE_OPAQUE_BIT_KHR;
-            map[i].accelerationStructureReference = meshes[inst.mesh_id]->handle;
-            map[i].mask = 0xff;
-
-            // Note: 4x3 row major
-            const glm::mat4 m = glm::transpose(inst.transform);
-            for (int r = 0; r < 3; ++r) {
-                for (int c = 0; c < 4; ++c) {
-                    map[i].transform.matrix[r][c] = m[r][c];
-                }
+    auto end = high_resolution_clock::now();
+    scene_build_stats.upload_time = duration_cast<nanoseconds>(end - start).count() * 1.0e-6;
+    start = end;
+
+    // Build the bottom level BVHs in batches, limiting how much scratch space we need at once
+    const size_t scratch_budget = 256 * 1024 * 1024;
+    for (size_t batch_start = 0; batch_start < meshes.size();) {
+        std::vector<vkrt::TriangleMesh *> batch;
+        size_t batch_scratch = 0;
+        for (size_t i = batch_start; i < meshes.size(); ++i) {
+            const size_t scratch_size = meshes[i]->build_sizes().buildScratchSize;
+            if (!batch.empty() && batch_scratch + scratch_size > scratch_budget) {
+                break;
             }
-
-            instance_hitgroup_offset += meshes[inst.mesh_id]->geometries.size();
-        }
-        upload_instances->unmap();
-
-        instance_buf = vkrt::Buffer::device(
-            *device,
-            upload_instances->size(),
-            VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT);
-        // Upload the instance data to the device
-        {
-            VkCommandBufferBeginInfo begin_info = {};
-            begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-            begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
-            CHECK_VULKAN(vkBeginCommandBuffer(command_buffer, &begin_info));
-
-            VkBufferCopy copy_cmd = {};
-            copy_cmd.size = upload_instances->size();
-            vkCmdCopyBuffer(command_buffer,
-                            upload_instances->handle(),
-                            instance_buf->handle(),
-                            1,
-                            &copy_cmd);
-
-            CHECK_VULKAN(vkEndCommandBuffer(command_buffer));
-
-            VkSubmitInfo submit_info = {};
-            submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-            submit_info.commandBufferCount = 1;
-            submit_info.pCommandBuffers = &command_buffer;
-            CHECK_VULKAN(
-                vkQueueSubmit(device->graphics_queue(), 1, &submit_info, VK_NULL_HANDLE));
-            CHECK_VULKAN(vkQueueWaitIdle(device->graphics_queue()));
-
-            vkResetCommandPool(device->logical_device(),
-                               command_pool,
-                               VK_COMMAND_POOL_RESET_RELEASE_RESOURCES_BIT);
+            batch.push_back(meshes[i].get());
+            batch_scratch += scratch_size;
         }
-    }
+        batch_start += batch.size();
 
-    // Build the top level BVH
-    scene_bvh = std::make_unique<vkrt::TopLevelBVH>(*device, instance_buf, scene.instances);
-    {
-        // TODO: some convenience utils for this
-        VkCommandBufferBeginInfo begin_info = {};
-        begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-        begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
-        CHECK_VULKAN(vkBeginCommandBuffer(command_buffer, &begin_info));
+        vkrt::BatchedBVHBuild builder(*device, batch);
+        VkCommandBuffer cmd_buf = staging.command_buffer();
+        builder.enqueue_build(cmd_buf);
+        staging.flush();
 
-        scene_bvh->enqueue_build(command_buffer);
+        cmd_buf = staging.command_buffer();
+        builder.enqueue_compaction(cmd_buf);
+        staging.flush();
+        builder.finalize();
+    }
 
-        CHECK_VULKAN(vkEndCommandBuffer(command_buffer));
+    end = high_resolution_clock::now();
+    scene_build_stats.blas_build_time =
+        duration_cast<nanoseconds>(end - start).count() * 1.0e-6;
+    start = end;
+
+    // Setup the instance buffer
+    tlas_instances.resize(scene.instances.size());
+    size_t instance_hitgroup_offset = 0;
+    for (size_t i = 0; i < scene.instances.size(); ++i) {
+        const auto &inst = scene.instances[i];
+        std::memset(&tlas_instances[i], 0, sizeof(VkAccelerationStructureInstanceKHR));
+        tlas_instances[i].instanceCustomIndex = i;
+        tlas_instances[i].instanceShaderBindingTableRecordOffset = instance_hitgroup_offset;
+        tlas_instances[i].flags = VK_GEOMETRY_INSTANCE_FORCE_OPAQUE_BIT_KHR;
+        tlas_instances[i].accelerationStructureReference = meshes[inst.mesh_id]->handle;
+        tlas_instances[i].mask = 0xff;
+        set_instance_transform(tlas_instances[i], inst.transform);
+
+        instance_hitgroup_offset += meshes[inst.mesh_id]->geometries.size();
+    }
 
-        VkSubmitInfo submit_info = {};
-        submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-        submit_info.commandBufferCount = 1;
-        submit_info.pCommandBuffers = &command_buffer;
-        CHECK_VULKAN(vkQueueSubmit(device->graphics_queue(), 1, &submit_info, VK_NULL_HANDLE));
-        CHECK_VULKAN(vkQueueWaitIdle(device->graphics_queue()));
+    auto instance_buf = vkrt::Buffer::device(
+        *device,
+        tlas_instances.size() * sizeof(VkAccelerationStructureInstanceKHR),
+        VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT);
+    staging.upload(tlas_instances.data(), instance_buf->size(), instance_buf);
+    staging.barrier();
 
-        vkResetCommandPool(device->logical_device(),
-                           command_pool,
-                           VK_COMMAND_POOL_RESET_RELEASE_RESOURCES_BIT);
+    // Build the top level BVH, allowing updates so moving instances only needs a refit
+    scene_bvh = std::make_unique<vkrt::TopLevelBVH>(
+        *device,
+        instance_buf,
+        scene.instances,
+        VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR |
+            VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_UPDATE_BIT_KHR);
+    {
+        VkCommandBuffer cmd_buf = staging.command_buffer();
+        scene_bvh->enqueue_build(cmd_buf);
     }
+    staging.flush();
     scene_bvh->finalize();
 
+    end = high_resolution_clock::now();
+    scene_build_stats.tlas_build_time =
+        duration_cast<nanoseconds>(end - start).count() * 1.0e-6;
+    start = end;
+
+    std::vector<uint32_t> texture_handles;
+    const std::vector<MaterialRecord> material_records =
+        make_material_records(scene.materials, texture_handles);
+    // Keep the handle table non-empty so we have a valid buffer to bind
+    if (texture_handles.empty()) {
+        texture_handles.push_back(0);
+    }
+
     mat_params = vkrt::Buffer::device(
         *device,
-        scene.materials.size() * sizeof(DisneyMaterial),
+        material_records.size() * sizeof(MaterialRecord),
         VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
-    {
-        auto upload_mat_params =
-            vkrt::Buffer::host(*device, mat_params->size(), VK_BUFFER_USAGE_TRANSFER_SRC_BIT);
-        void *map = upload_mat_params->map();
-        std::memcpy(map, scene.materials.data(), upload_mat_params->size());
-        upload_mat_params->unmap();
-
-        VkCommandBufferBeginInfo begin_info = {};
-        begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-        begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
-        CHECK_VULKAN(vkBeginCommandBuffer(command_buffer, &begin_info));
-
-        VkBufferCopy copy_cmd = {};
-        copy_cmd.size = upload_mat_params->size();
-        vkCmdCopyBuffer(
-            command_buffer, upload_mat_params->handle(), mat_params->handle(), 1, &copy_cmd);
-
-        CHECK_VULKAN(vkEndCommandBuffer(command_buffer));
-
-        VkSubmitInfo submit_info = {};
-        submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-        submit_info.commandBufferCount = 1;
-        submit_info.pCommandBuffers = &command_buffer;
-        CHECK_VULKAN(vkQueueSubmit(device->graphics_queue(), 1, &submit_info, VK_NULL_HANDLE));
-        CHECK_VULKAN(vkQueueWaitIdle(device->graphics_queue()));
-
-        vkResetCommandPool(device->logical_device(),
-                           command_pool,
-                           VK_COMMAND_POOL_RESET_RELEASE_RESOURCES_BIT);
-    }
+    staging.upload(material_records.data(), mat_params->size(), mat_params);
 
-    // Upload the scene textures
+    texture_handle_buf = vkrt::Buffer::device(
+        *device,
+        texture_handles.size() * sizeof(uint32_t),
+        VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+    staging.upload(texture_handles.data(), texture_handle_buf->size(), texture_handle_buf);
+
+    // Upload the scene textures with full mip chains, which are blitted down from the
+    // top level on the GPU if the format supports linear blits
+    auto supports_mip_blits = [&](const VkFormat format) {
+        const VkFormatFeatureFlags required =
+            VK_FORMAT_FEATURE_BLIT_SRC_BIT | VK_FORMAT_FEATURE_BLIT_DST_BIT |
+            VK_FORMAT_FEATURE_SAMPLED_IMAGE_FILTER_LINEAR_BIT;
+        VkFormatProperties props = {};
+        vkGetPhysicalDeviceFormatProperties(device->physical_device(), format, &props);
+        return (props.optimalTilingFeatures & required) == required;
+    };
+    std::vector<std::shared_ptr<vkrt::Texture2D>> scene_textures;
+    std::vector<const void *> texture_data;
     for (const auto &t : scene.textures) {
         auto format =
             t.color_space == SRGB ? VK_FORMAT_R8G8B8A8_SRGB : VK_FORMAT_R8G8B8A8_UNORM;
+        VkImageUsageFlags usage = VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT;
+        uint32_t mip_levels = 1;
+        if (supports_mip_blits(format)) {
+            while ((std::max(t.width, t.height) >> mip_levels) > 0) {
+                ++mip_levels;
+            }
+            usage |= VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
+        }
         auto tex = vkrt::Texture2D::device(
-            *device,
-            glm::uvec2(t.width, t.height),
-            format,
-            VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT);
-
-        auto upload_buf = vkrt::Buffer::host(
-            *device, tex->pixel_size() * t.width * t.height, VK_BUFFER_USAGE_TRANSFER_SRC_BIT);
-        void *map = upload_buf->map();
-        std::memcpy(map, t.img.data(), upload_buf->size());
-        upload_buf->unmap();
-
-        VkCommandBufferBeginInfo begin_info = {};
-        begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-        begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
-        CHECK_VULKAN(vkBeginCommandBuffer(command_buffer, &begin_info));
-
-        // Transition image to the general layout
-        VkImageMemoryBarrier img_mem_barrier = {};
-        img_mem_barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
-        img_mem_barrier.image = tex->image_handle();
-        img_mem_barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-        img_mem_barrier.newLayout = VK_IMAGE_LAYOUT_GENERAL;
-        img_mem_barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-        img_mem_barrier.subresourceRange.baseMipLevel = 0;
-        img_mem_barrier.subresourceRange.levelCount = 1;
-        img_mem_barrier.subresourceRange.baseArrayLayer = 0;
-        img_mem_barrier.subresourceRange.layerCount = 1;
-
-        vkCmdPipelineBarrier(command_buffer,
-                             VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
-                             VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
-                             0,
-                             0,
-                             nullptr,
-                             0,
-                             nullptr,
-                             1,
-                             &img_mem_barrier);
-
-        VkImageSubresourceLayers copy_subresource = {};
-        copy_subresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-        copy_subresource.mipLevel = 0;
-        copy_subresource.baseArrayLayer = 0;
-        copy_subresource.layerCount = 1;
-
-        VkBufferImageCopy img_copy = {};
-        img_copy.bufferOffset = 0;
-        img_copy.bufferRowLength = 0;
-        img_copy.bufferImageHeight = 0;
-        img_copy.imageSubresource = copy_subresource;
-        img_copy.imageOffset.x = 0;
-        img_copy.imageOffset.y = 0;
-        img_copy.imageOffset.z = 0;
-        img_copy.imageExtent.width = t.width;
-        img_copy.imageExtent.height = t.height;
-        img_copy.imageExtent.depth = 1;
-
-        vkCmdCopyBufferToImage(command_buffer,
-                               upload_buf->handle(),
-                               tex->image_handle(),
-                               VK_IMAGE_LAYOUT_GENERAL,
-                               1,
-                               &img_copy);
-
-        // Transition image to shader read optimal layout
-        img_mem_barrier.oldLayout = VK_IMAGE_LAYOUT_GENERAL;
-        img_mem_barrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-        vkCmdPipelineBarrier(command_buffer,
-                             VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
-                             VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
-                             0,
-                             0,
-                             nullptr,
-                             0,
-                             nullptr,
-                             1,
-                             &img_mem_barrier);
+            *device, glm::uvec2(t.width, t.height), format, usage, mip_levels);
+        scene_textures.push_back(tex);
+        texture_data.push_back(t.img.data());
+    }
+    staging.upload(scene_textures, texture_data);
+    textures.insert(textures.end(), scene_textures.begin(), scene_textures.end());
 
-        CHECK_VULKAN(vkEndCommandBuffer(command_buffer));
+    light_params = vkrt::Buffer::device(
+        *device,
+        sizeof(QuadLight) * scene.lights.size(),
+        VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+    staging.upload(scene.lights.data(), light_params->size(), light_params);
 
-        VkSubmitInfo submit_info = {};
-        submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-        submit_info.commandBufferCount = 1;
-        submit_info.pCommandBuffers = &command_buffer;
-        CHECK_VULKAN(vkQueueSubmit(device->graphics_queue(), 1, &submit_info, VK_NULL_HANDLE));
-        CHECK_VULKAN(vkQueueWaitIdle(device->graphics_queue()));
+    staging.flush();
 
-        vkResetCommandPool(device->logical_device(),
-                           command_pool,
-                           VK_COMMAND_POOL_RESET_RELEASE_RESOURCES_BIT);
+    end = high_resolution_clock::now();
+    scene_build_stats.upload_time += duration_cast<nanoseconds>(end - start).count() * 1.0e-6;
 
-        textures.push_back(tex);
-    }
+    const vkrt::MemoryStats &mem_stats = device->memory_allocator().stats();
+    scene_build_stats.memory_allocations = mem_stats.allocations;
+    scene_build_stats.device_memory_blocks = mem_stats.device_allocations;
+    scene_build_stats.memory_reserved_mb = mem_stats.bytes_reserved / (1024.f * 1024.f);
 
     {
         VkSamplerCreateInfo sampler_info = {};
         sampler_info.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
         sampler_info.magFilter = VK_FILTER_LINEAR;
         sampler_info.minFilter = VK_FILTER_LINEAR;
-        sampler_info.mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST;
+        sampler_info.mipmapMode = VK_SAMPLER_MIPMAP_MODE_LINEAR;
         sampler_info.addressModeU = VK_SAMPLER_ADDRESS_MODE_REPEAT;
         sampler_info.addressModeV = VK_SAMPLER_ADDRESS_MODE_REPEAT;
         sampler_info.addressModeW = VK_SAMPLER_ADDRESS_MODE_REPEAT;
         sampler_info.minLod = 0;
-        sampler_info.maxLod = 0;
+        sampler_info.maxLod = VK_LOD_CLAMP_NONE;
         CHECK_VULKAN(
             vkCreateSampler(device->logical_device(), &sampler_info, nullptr, &sampler));
     }
 
-    light_params = vkrt::Buffer::device(
-        *device,
-        sizeof(QuadLight) * scene.lights.size(),
-        VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
-    {
-        auto upload_light_params = vkrt::Buffer::host(
-            *device, light_params->size(), VK_BUFFER_USAGE_TRANSFER_SRC_BIT);
-        void *map = upload_light_params->map();
-        std::memcpy(map, scene.lights.data(), upload_light_params->size());
-        upload_light_params->unmap();
-
-        VkCommandBufferBeginInfo begin_info = {};
-        begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-        begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
-        CHECK_VULKAN(vkBeginCommandBuffer(command_buffer, &begin_info));
-
-        VkBufferCopy copy_cmd = {};
-        copy_cmd.size = upload_light_params->size();
-        vkCmdCopyBuffer(command_buffer,
-                        upload_light_params->handle(),
-                        light_params->handle(),
-                        1,
-                        &copy_cmd);
-
-        CHECK_VULKAN(vkEndCommandBuffer(command_buffer));
-
-        VkSubmitInfo submit_info = {};
-        submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-        submit_info.commandBufferCount = 1;
-        submit_info.pCommandBuffers = &command_buffer;
-        CHECK_VULKAN(vkQueueSubmit(device->graphics_queue(), 1, &submit_info, VK_NULL_HANDLE));
-        CHECK_VULKAN(vkQueueWaitIdle(device->graphics_queue()));
-
-        vkResetCommandPool(device->logical_device(),
-                           command_pool,
-                           VK_COMMAND_POOL_RESET_RELEASE_RESOURCES_BIT);
-    }
-
     build_raytracing_pipeline();
     build_shader_descriptor_table();
     build_shader_binding_table();
     record_command_buffers();
 }
 
+bool RenderVulkan::supports_instance_updates() const
+{
+    return true;
+}
+
+void RenderVulkan::update_instance_transforms(const std::vector<glm::mat4> &transforms)
+{
+    if (transforms.size() != tlas_instances.size()) {
+        throw std::runtime_error(
+            "RenderVulkan::update_instance_transforms: expected a transform per instance");
+    }
+
+    // The upload and refit are recorded into the next frame's commands, so the frames
+    // still in flight keep tracing the old TLAS without the host waiting on them
+    frame_id = 0;
+    accumulated_samples = 0;
+    for (size_t i = 0; i < transforms.size(); ++i) {
+        set_instance_transform(tlas_instances[i], transforms[i]);
+    }
+    instances_changed = true;
+}
+
 RenderStats RenderVulkan::render(const glm::vec3 &pos,
                                  const glm::vec3 &dir,
                                  const glm::vec3 &up,
@@ -659,60 +516,137 @@ RenderStats RenderVulkan::render(const glm::vec3 &pos,
 
     if (camera_changed) {
         frame_id = 0;
+        accumulated_samples = 0;
+    }
+    if (samples_per_launch == 0) {
+        throw std::runtime_error("RenderVulkan: samples_per_launch must be at least 1");
     }
 
-    update_view_parameters(pos, dir, up, fovy);
+    const bool need_readback = !native_display || readback_framebuffer;
 
-    CHECK_VULKAN(vkResetFences(device->logical_device(), 1, &fence));
+    // If all the frames are in flight we have to wait for the oldest one to reuse it
+    FrameResources &frame = frames[current_frame];
+    if (frame.in_flight) {
+        complete_frame(frame, stats);
+    }
 
-    auto start = high_resolution_clock::now();
-    VkSubmitInfo submit_info = {};
-    submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-    submit_info.commandBufferCount = 1;
-    submit_info.pCommandBuffers = &render_cmd_buf;
-    CHECK_VULKAN(vkQueueSubmit(device->graphics_queue(), 1, &submit_info, fence));
+    update_view_parameters(frame, pos, dir, up, fovy);
 
-#ifdef REPORT_RAY_STATS
-    const bool need_readback = true;
-#else
-    const bool need_readback = !native_display || readback_framebuffer;
-#endif
+    const bool update_instances = instances_changed;
+    if (update_instances) {
+        record_instance_update(frame);
+        instances_changed = false;
+    }
+
+    CHECK_VULKAN(vkResetFences(device->logical_device(), 1, &frame.fence));
 
-    // Queue the readback copy to start once rendering is done
+    // The instance update and readback copy are submitted with the rendering so the fence
+    // covers all of them
+    std::array<VkCommandBuffer, 3> command_buffers;
+    uint32_t num_command_buffers = 0;
+    if (update_instances) {
+        command_buffers[num_command_buffers++] = frame.update_cmd_buf;
+    }
+    command_buffers[num_command_buffers++] = frame.render_cmd_buf;
     if (need_readback) {
-        submit_info.pCommandBuffers = &readback_cmd_buf;
-        CHECK_VULKAN(vkQueueSubmit(device->graphics_queue(), 1, &submit_info, VK_NULL_HANDLE));
+        command_buffers[num_command_buffers++] = frame.readback_cmd_buf;
+    }
+    VkSubmitInfo submit_info = {};
+    submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    submit_info.commandBufferCount = num_command_buffers;
+    submit_info.pCommandBuffers = command_buffers.data();
+    CHECK_VULKAN(vkQueueSubmit(device->graphics_queue(), 1, &submit_info, frame.fence));
+
+    frame.in_flight = true;
+    frame.readback = need_readback;
+    frame.submit_time = high_resolution_clock::now();
+    current_frame = (current_frame + 1) % frames.size();
+
+    // Collect any frames which have finished, oldest first so img ends up with the most
+    // recent one. If the caller wants this frame's image we wait for all of them
+    for (size_t i = 0; i < frames.size(); ++i) {
+        FrameResources &f = frames[(current_frame + i) % frames.size()];
+        if (!f.in_flight) {
+            continue;
+        }
+        if (!readback_framebuffer &&
+            vkGetFenceStatus(device->logical_device(), f.fence) != VK_SUCCESS) {
+            break;
+        }
+        complete_frame(f, stats);
     }
 
-    // Wait for just the rendering commands to complete to only time the ray tracing time
-    CHECK_VULKAN(vkWaitForFences(
-        device->logical_device(), 1, &fence, true, std::numeric_limits<uint64_t>::max()));
-    auto end = high_resolution_clock::now();
-    stats.render_time = duration_cast<nanoseconds>(end - start).count() * 1.0e-6;
+    ++frame_id;
+    accumulated_samples += samples_per_launch;
+    return stats;
+}
 
-    // Now wait for the device to finish the readback copy as well
-    if (need_readback) {
-        CHECK_VULKAN(vkQueueWaitIdle(device->graphics_queue()));
-        std::memcpy(img.data(), img_readback_buf->map(), img_readback_buf->size());
-        img_readback_buf->unmap();
+void RenderVulkan::complete_frame(FrameResources &frame, RenderStats &stats)
+{
+    using namespace std::chrono;
+    CHECK_VULKAN(vkWaitForFences(device->logical_device(),
+                                 1,
+                                 &frame.fence,
+                                 true,
+                                 std::numeric_limits<uint64_t>::max()));
+    frame.in_flight = false;
+
+    // The device works through the frames in order, so the frame started once it was
+    // submitted and the previous frame was done
+    const auto end = high_resolution_clock::now();
+    const auto start = std::max(frame.submit_time, last_frame_completion);
+    last_frame_completion = end;
+    const double frame_time = duration_cast<nanoseconds>(end - start).count() * 1.0e-6;
+    stats.render_time += frame_time;
+
+    if (timestamp_pool != VK_NULL_HANDLE) {
+        // The readback timestamps are only written if the readback was submitted
+        std::array<uint64_t, 4> timestamps = {};
+        CHECK_VULKAN(vkGetQueryPoolResults(device->logical_device(),
+                                           timestamp_pool,
+                                           frame.timestamp_query,
+                                           frame.readback ? 4 : 2,
+                                           sizeof(timestamps),
+                                           timestamps.data(),
+                                           sizeof(uint64_t),
+                                           VK_QUERY_RESULT_64_BIT));
+        // Masking the differences discards the undefined bits and handles the timestamps
+        // wrapping around between the queries
+        const double tick_ms = device->properties().limits.timestampPeriod * 1.0e-6;
+        stats.trace_time = std::max(stats.trace_time, 0.f) +
+                           ((timestamps[1] - timestamps[0]) & timestamp_mask) * tick_ms;
+        if (frame.readback) {
+            stats.readback_time = std::max(stats.readback_time, 0.f) +
+                                  ((timestamps[3] - timestamps[2]) & timestamp_mask) * tick_ms;
+        }
+    }
+
+    if (frame.readback) {
+        std::memcpy(img.data(), frame.img_readback_buf->map(), frame.img_readback_buf->size());
+        frame.img_readback_buf->unmap();
     }
 
 #ifdef REPORT_RAY_STATS
-    std::memcpy(ray_counts.data(),
-                ray_stats_readback_buf->map(),
-                ray_counts.size() * sizeof(uint16_t));
-    ray_stats_readback_buf->unmap();
-
-    const uint64_t total_rays =
-        std::accumulate(ray_counts.begin(),
-                        ray_counts.end(),
-                        uint64_t(0),
-                        [](const uint64_t &total, const uint16_t &c) { return total + c; });
-    stats.rays_per_second = total_rays / (stats.render_time * 1.0e-3);
+    const uint64_t *counters =
+        reinterpret_cast<const uint64_t *>(frame.ray_stats_readback_buf->map());
+    ray_stats.total_rays = counters[0];
+    ray_stats.shadow_rays = counters[1];
+    ray_stats.bounce_rays.assign(counters + 2, counters + 2 + MAX_PATH_DEPTH);
+    frame.ray_stats_readback_buf->unmap();
+
+    stats.rays_per_second = ray_stats.total_rays / (frame_time * 1.0e-3);
 #endif
+}
 
-    ++frame_id;
-    return stats;
+void RenderVulkan::wait_for_frames()
+{
+    RenderStats stats;
+    for (size_t i = 0; i < frames.size(); ++i) {
+        FrameResources &f = frames[(current_frame + i) % frames.size()];
+        if (f.in_flight) {
+            complete_frame(f, stats);
+        }
+    }
 }
 
 void RenderVulkan::build_raytracing_pipeline()
@@ -737,8 +671,14 @@ void RenderVulkan::build_raytracing_pipeline()
                 5, 1, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_RAYGEN_BIT_KHR)
 #ifdef REPORT_RAY_STATS
             .add_binding(
-                6, 1, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, VK_SHADER_STAGE_RAYGEN_BIT_KHR)
+                6, 1, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_RAYGEN_BIT_KHR)
 #endif
+            .add_binding(
+                7, 1, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_RAYGEN_BIT_KHR)
+            .add_binding(8,
+                         1,
+                         VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
+                         VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR)
             .build(*device);
 
     const size_t total_geom =
@@ -785,6 +725,14 @@ void RenderVulkan::build_raytracing_pipeline()
         std::make_shared<vkrt::ShaderModule>(*device, 
             (const uint32_t*)shaders.spirv_data, shaders.spirv_size);
 
+    // Compiling the pipeline can take a while, especially on CPU drivers, so reuse the
+    // compiled shaders from previous runs
+    std::unique_ptr<vkrt::PipelineCache> pipeline_cache;
+    if (!pipeline_cache_dir.empty()) {
+        make_directories(pipeline_cache_dir);
+        pipeline_cache = std::make_unique<vkrt::PipelineCache>(*device, pipeline_cache_dir);
+    }
+
     rt_pipeline = vkrt::RTPipelineBuilder()
                       .set_raygen("raygen", raygen_shader)
                       .add_miss("miss", circle_shaders, shaders.rmiss)
@@ -795,22 +743,28 @@ void RenderVulkan::build_raytracing_pipeline()
                       // .add_hitgroup("closest_hit", closest_hit_shader)
                       .set_recursion_depth(1)
                       .set_layout(pipeline_layout)
+                      .set_cache(pipeline_cache ? pipeline_cache->handle() : VK_NULL_HANDLE)
                       .build(*device);
+
+    if (pipeline_cache) {
+        pipeline_cache->save();
+    }
 }
 
 void RenderVulkan::build_shader_descriptor_table()
 {
+    const uint32_t num_frames = frames.size();
     const std::vector<VkDescriptorPoolSize> pool_sizes = {
-        VkDescriptorPoolSize{VK_DESCRIPTOR_TYPE_ACCELERATION_STRUCTURE_KHR, 1},
-        VkDescriptorPoolSize{VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 3},
-        VkDescriptorPoolSize{VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 1},
-        VkDescriptorPoolSize{VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 2},
+        VkDescriptorPoolSize{VK_DESCRIPTOR_TYPE_ACCELERATION_STRUCTURE_KHR, num_frames},
+        VkDescriptorPoolSize{VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 3 * num_frames},
+        VkDescriptorPoolSize{VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 2 * num_frames},
+        VkDescriptorPoolSize{VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 4 * num_frames},
         VkDescriptorPoolSize{VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
                              std::max(uint32_t(textures.size()), uint32_t(1))}};
 
     VkDescriptorPoolCreateInfo pool_create_info = {};
     pool_create_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
-    pool_create_info.maxSets = 6;
+    pool_create_info.maxSets = num_frames + 1;
     pool_create_info.poolSizeCount = pool_sizes.size();
     pool_create_info.pPoolSizes = pool_sizes.data();
     CHECK_VULKAN(vkCreateDescriptorPool(
@@ -821,7 +775,10 @@ void RenderVulkan::build_shader_descriptor_table()
     alloc_info.descriptorPool = desc_pool;
     alloc_info.descriptorSetCount = 1;
     alloc_info.pSetLayouts = &desc_layout;
-    CHECK_VULKAN(vkAllocateDescriptorSets(device->logical_device(), &alloc_info, &desc_set));
+    for (auto &frame : frames) {
+        CHECK_VULKAN(
+            vkAllocateDescriptorSets(device->logical_device(), &alloc_info, &frame.desc_set));
+    }
 
     alloc_info.pSetLayouts = &textures_desc_layout;
     CHECK_VULKAN(
@@ -832,16 +789,20 @@ void RenderVulkan::build_shader_descriptor_table()
         combined_samplers.emplace_back(t, sampler);
     }
 
-    auto updater = vkrt::DescriptorSetUpdater()
-                       .write_acceleration_structure(desc_set, 0, scene_bvh)
-                       .write_storage_image(desc_set, 1, render_target)
-                       .write_storage_image(desc_set, 2, accum_buffer)
-                       .write_ubo(desc_set, 3, view_param_buf)
-                       .write_ssbo(desc_set, 4, mat_params)
-                       .write_ssbo(desc_set, 5, light_params);
+    vkrt::DescriptorSetUpdater updater;
+    for (const auto &frame : frames) {
+        updater.write_acceleration_structure(frame.desc_set, 0, scene_bvh)
+            .write_storage_image(frame.desc_set, 1, render_target)
+            .write_storage_image(frame.desc_set, 2, accum_buffer)
+            .write_ubo(frame.desc_set, 3, frame.view_param_buf)
+            .write_ssbo(frame.desc_set, 4, mat_params)
+            .write_ssbo(frame.desc_set, 5, light_params)
+            .write_ssbo(frame.desc_set, 7, texture_handle_buf)
+            .write_ubo(frame.desc_set, 8, scene_geometry_params);
 #ifdef REPORT_RAY_STATS
-    updater.write_storage_image(desc_set, 6, ray_stats);
+        updater.write_ssbo(frame.desc_set, 6, frame.ray_stats_buf);
 #endif
+    }
 
     if (!combined_samplers.empty()) {
         updater.write_combined_sampler_array(textures_desc_set, 0, combined_samplers);
@@ -885,25 +846,10 @@ void RenderVulkan::build_shader_binding_table()
 
             HitGroupParams *params =
                 reinterpret_cast<HitGroupParams *>(shader_table.sbt_params(hg_name));
-
-            params->vert_buf =
-                meshes[inst.mesh_id]->geometries[j].vertex_buf->device_address();
-            params->idx_buf = meshes[inst.mesh_id]->geometries[j].index_buf->device_address();
-
-            if (meshes[inst.mesh_id]->geometries[j].normal_buf) {
-                params->normal_buf =
-                    meshes[inst.mesh_id]->geometries[j].normal_buf->device_address();
-                params->num_normals = 1;
-            } else {
-                params->num_normals = 0;
-            }
-
-            if (meshes[inst.mesh_id]->geometries[j].uv_buf) {
-                params->uv_buf = meshes[inst.mesh_id]->geometries[j].uv_buf->device_address();
-                params->num_uvs = 1;
-            } else {
-                params->num_uvs = 0;
-            }
+            params->vert_offset = geom.vertex_offset;
+            params->idx_offset = geom.index_offset;
+            params->normal_offset = geom.normal_offset;
+            params->uv_offset = geom.uv_offset;
             params->material_id = inst.material_ids[j];
         }
     }
@@ -937,7 +883,8 @@ void RenderVulkan::build_shader_binding_table()
     }
 }
 
-void RenderVulkan::update_view_parameters(const glm::vec3 &pos,
+void RenderVulkan::update_view_parameters(FrameResources &frame,
+                                          const glm::vec3 &pos,
                                           const glm::vec3 &dir,
                                           const glm::vec3 &up,
                                           const float fovy)
@@ -951,7 +898,7 @@ void RenderVulkan::update_view_parameters(const glm::vec3 &pos,
     const glm::vec3 dir_dv = -glm::normalize(glm::cross(dir_du, dir)) * img_plane_size.y;
     const glm::vec3 dir_top_left = dir - 0.5f * dir_du - 0.5f * dir_dv;
 
-    uint8_t *buf = static_cast<uint8_t *>(view_param_buf->map());
+    uint8_t *buf = static_cast<uint8_t *>(frame.view_param_buf->map());
     {
         glm::vec4 *vecs = reinterpret_cast<glm::vec4 *>(buf);
         vecs[0] = glm::vec4(pos, 0.f);
@@ -960,108 +907,274 @@ void RenderVulkan::update_view_parameters(const glm::vec3 &pos,
         vecs[3] = glm::vec4(dir_top_left, 0.f);
     }
     {
-        uint32_t *fid = reinterpret_cast<uint32_t *>(buf + 4 * sizeof(glm::vec4));
-        *fid = frame_id;
+        uint32_t *ids = reinterpret_cast<uint32_t *>(buf + 4 * sizeof(glm::vec4));
+        ids[0] = frame_id;
+        ids[1] = samples_per_launch;
+        ids[2] = accumulated_samples;
     }
-    view_param_buf->unmap();
+    frame.view_param_buf->unmap();
 }
 
-void RenderVulkan::record_command_buffers()
+void RenderVulkan::record_instance_update(FrameResources &frame)
 {
-    vkResetCommandPool(device->logical_device(),
-                       render_cmd_pool,
-                       VK_COMMAND_POOL_RESET_RELEASE_RESOURCES_BIT);
+    // The frame isn't in flight, so its copy of the instances can be overwritten
+    const size_t instances_size =
+        tlas_instances.size() * sizeof(VkAccelerationStructureInstanceKHR);
+    if (!frame.instance_upload_buf) {
+        frame.instance_upload_buf = vkrt::Buffer::host(*device,
+                                                       instances_size,
+                                                       VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+                                                       VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+    }
+    std::memcpy(frame.instance_upload_buf->map(), tlas_instances.data(), instances_size);
+    frame.instance_upload_buf->unmap();
 
     VkCommandBufferBeginInfo begin_info = {};
     begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-    CHECK_VULKAN(vkBeginCommandBuffer(render_cmd_buf, &begin_info));
-
-    vkCmdBindPipeline(
-        render_cmd_buf, VK_PIPELINE_BIND_POINT_RAY_TRACING_KHR, rt_pipeline.handle());
-
-    const std::vector<VkDescriptorSet> descriptor_sets = {desc_set, textures_desc_set};
-
-    vkCmdBindDescriptorSets(render_cmd_buf,
-                            VK_PIPELINE_BIND_POINT_RAY_TRACING_KHR,
-                            pipeline_layout,
-                            0,
-                            descriptor_sets.size(),
-                            descriptor_sets.data(),
-                            0,
-                            nullptr);
-
-    VkStridedDeviceAddressRegionKHR callable_table = {};
-    callable_table.deviceAddress = VK_NULL_HANDLE;
-
-    vkrt::CmdTraceRaysKHR(render_cmd_buf,
-                          &shader_table.raygen,
-                          &shader_table.miss,
-                          &shader_table.hitgroup,
-                          &callable_table,
-                          render_target->dims().x,
-                          render_target->dims().y,
-                          1);
-
-    // Queue a barrier for rendering to finish
-    vkCmdPipelineBarrier(render_cmd_buf,
-                         VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR,
-                         VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR,
+    begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+    CHECK_VULKAN(vkBeginCommandBuffer(frame.update_cmd_buf, &begin_info));
+
+    // The frames submitted before this one may still be tracing against the TLAS or
+    // refitting it, so wait for them before modifying the instances or the TLAS
+    VkMemoryBarrier barrier = {};
+    barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    barrier.srcAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR;
+    barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT |
+                            VK_ACCESS_ACCELERATION_STRUCTURE_READ_BIT_KHR |
+                            VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR;
+    vkCmdPipelineBarrier(frame.update_cmd_buf,
+                         VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR |
+                             VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
+                         VK_PIPELINE_STAGE_TRANSFER_BIT |
+                             VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
                          0,
+                         1,
+                         &barrier,
                          0,
                          nullptr,
                          0,
+                         nullptr);
+
+    VkBufferCopy copy = {};
+    copy.size = instances_size;
+    vkCmdCopyBuffer(frame.update_cmd_buf,
+                    frame.instance_upload_buf->handle(),
+                    scene_bvh->instance_buf->handle(),
+                    1,
+                    &copy);
+
+    // The build reads the instances we just copied in
+    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.dstAccessMask =
+        VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_ACCELERATION_STRUCTURE_READ_BIT_KHR;
+    vkCmdPipelineBarrier(frame.update_cmd_buf,
+                         VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
+                         0,
+                         1,
+                         &barrier,
+                         0,
                          nullptr,
                          0,
                          nullptr);
 
-    CHECK_VULKAN(vkEndCommandBuffer(render_cmd_buf));
-
-    CHECK_VULKAN(vkBeginCommandBuffer(readback_cmd_buf, &begin_info));
-
-    VkImageSubresourceLayers copy_subresource = {};
-    copy_subresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-    copy_subresource.mipLevel = 0;
-    copy_subresource.baseArrayLayer = 0;
-    copy_subresource.layerCount = 1;
-
-    VkBufferImageCopy img_copy = {};
-    img_copy.bufferOffset = 0;
-    img_copy.bufferRowLength = 0;
-    img_copy.bufferImageHeight = 0;
-    img_copy.imageSubresource = copy_subresource;
-    img_copy.imageOffset.x = 0;
-    img_copy.imageOffset.y = 0;
-    img_copy.imageOffset.z = 0;
-    img_copy.imageExtent.width = render_target->dims().x;
-    img_copy.imageExtent.height = render_target->dims().y;
-    img_copy.imageExtent.depth = 1;
-
-    vkCmdCopyImageToBuffer(readback_cmd_buf,
-                           render_target->image_handle(),
-                           VK_IMAGE_LAYOUT_GENERAL,
-                           img_readback_buf->handle(),
-                           1,
-                           &img_copy);
+    // The update ends with a barrier on the build, so the frame's rays see the new TLAS
+    const bool rebuild = tlas_refits >= tlas_rebuild_interval;
+    tlas_refits = rebuild ? 0 : tlas_refits + 1;
+    scene_bvh->enqueue_update(frame.update_cmd_buf, rebuild);
+
+    CHECK_VULKAN(vkEndCommandBuffer(frame.update_cmd_buf));
+}
+
+void RenderVulkan::record_command_buffers()
+{
+    vkResetCommandPool(device->logical_device(),
+                       render_cmd_pool,
+                       VK_COMMAND_POOL_RESET_RELEASE_RESOURCES_BIT);
+
+    for (auto &frame : frames) {
+        VkCommandBufferBeginInfo begin_info = {};
+        begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+        CHECK_VULKAN(vkBeginCommandBuffer(frame.render_cmd_buf, &begin_info));
+
+        if (timestamp_pool != VK_NULL_HANDLE) {
+            vkCmdResetQueryPool(
+                frame.render_cmd_buf, timestamp_pool, frame.timestamp_query, 4);
+        }
 
 #ifdef REPORT_RAY_STATS
-    img_copy.bufferOffset = 0;
-    img_copy.bufferRowLength = 0;
-    img_copy.bufferImageHeight = 0;
-    img_copy.imageSubresource = copy_subresource;
-    img_copy.imageOffset.x = 0;
-    img_copy.imageOffset.y = 0;
-    img_copy.imageOffset.z = 0;
-    img_copy.imageExtent.width = render_target->dims().x;
-    img_copy.imageExtent.height = render_target->dims().y;
-    img_copy.imageExtent.depth = 1;
-
-    vkCmdCopyImageToBuffer(readback_cmd_buf,
-                           ray_stats->image_handle(),
-                           VK_IMAGE_LAYOUT_GENERAL,
-                           ray_stats_readback_buf->handle(),
-                           1,
-                           &img_copy);
+        vkCmdFillBuffer(
+            frame.render_cmd_buf, frame.ray_stats_buf->handle(), 0, VK_WHOLE_SIZE, 0);
 #endif
 
-    CHECK_VULKAN(vkEndCommandBuffer(readback_cmd_buf));
+        // The previous frame's writes to the accumulation buffer and framebuffer, and its
+        // readback copies, must finish before we start writing them again
+        VkMemoryBarrier barrier = {};
+        barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+        barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_TRANSFER_WRITE_BIT;
+        barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+        vkCmdPipelineBarrier(frame.render_cmd_buf,
+                             VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR |
+                                 VK_PIPELINE_STAGE_TRANSFER_BIT,
+                             VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR,
+                             0,
+                             1,
+                             &barrier,
+                             0,
+                             nullptr,
+                             0,
+                             nullptr);
+
+        if (timestamp_pool != VK_NULL_HANDLE) {
+            vkCmdWriteTimestamp(frame.render_cmd_buf,
+                                VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR,
+                                timestamp_pool,
+                                frame.timestamp_query);
+        }
+
+        vkCmdBindPipeline(frame.render_cmd_buf,
+                          VK_PIPELINE_BIND_POINT_RAY_TRACING_KHR,
+                          rt_pipeline.handle());
+
+        const std::vector<VkDescriptorSet> descriptor_sets = {frame.desc_set,
+                                                              textures_desc_set};
+
+        vkCmdBindDescriptorSets(frame.render_cmd_buf,
+                                VK_PIPELINE_BIND_POINT_RAY_TRACING_KHR,
+                                pipeline_layout,
+                                0,
+                                descriptor_sets.size(),
+                                descriptor_sets.data(),
+                                0,
+                                nullptr);
+
+        VkStridedDeviceAddressRegionKHR callable_table = {};
+        callable_table.deviceAddress = VK_NULL_HANDLE;
+
+        vkrt::CmdTraceRaysKHR(frame.render_cmd_buf,
+                              &shader_table.raygen,
+                              &shader_table.miss,
+                              &shader_table.hitgroup,
+                              &callable_table,
+                              render_target->dims().x,
+                              render_target->dims().y,
+                              1);
+
+        if (timestamp_pool != VK_NULL_HANDLE) {
+            vkCmdWriteTimestamp(frame.render_cmd_buf,
+                                VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR,
+                                timestamp_pool,
+                                frame.timestamp_query + 1);
+        }
+
+#ifdef REPORT_RAY_STATS
+        // The ray counters are small, so they're always read back with the rendering
+        barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+        barrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+        vkCmdPipelineBarrier(frame.render_cmd_buf,
+                             VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR,
+                             VK_PIPELINE_STAGE_TRANSFER_BIT,
+                             0,
+                             1,
+                             &barrier,
+                             0,
+                             nullptr,
+                             0,
+                             nullptr);
+
+        VkBufferCopy ray_stats_copy = {};
+        ray_stats_copy.size = frame.ray_stats_buf->size();
+        vkCmdCopyBuffer(frame.render_cmd_buf,
+                        frame.ray_stats_buf->handle(),
+                        frame.ray_stats_readback_buf->handle(),
+                        1,
+                        &ray_stats_copy);
+
+        barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        barrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+        vkCmdPipelineBarrier(frame.render_cmd_buf,
+                             VK_PIPELINE_STAGE_TRANSFER_BIT,
+                             VK_PIPELINE_STAGE_HOST_BIT,
+                             0,
+                             1,
+                             &barrier,
+                             0,
+                             nullptr,
+                             0,
+                             nullptr);
+#endif
+
+        CHECK_VULKAN(vkEndCommandBuffer(frame.render_cmd_buf));
+
+        CHECK_VULKAN(vkBeginCommandBuffer(frame.readback_cmd_buf, &begin_info));
+
+        // Wait for rendering to finish before copying the framebuffer
+        barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+        barrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+        vkCmdPipelineBarrier(frame.readback_cmd_buf,
+                             VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR,
+                             VK_PIPELINE_STAGE_TRANSFER_BIT,
+                             0,
+                             1,
+                             &barrier,
+                             0,
+                             nullptr,
+                             0,
+                             nullptr);
+
+        if (timestamp_pool != VK_NULL_HANDLE) {
+            vkCmdWriteTimestamp(frame.readback_cmd_buf,
+                                VK_PIPELINE_STAGE_TRANSFER_BIT,
+                                timestamp_pool,
+                                frame.timestamp_query + 2);
+        }
+
+        VkImageSubresourceLayers copy_subresource = {};
+        copy_subresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+        copy_subresource.mipLevel = 0;
+        copy_subresource.baseArrayLayer = 0;
+        copy_subresource.layerCount = 1;
+
+        VkBufferImageCopy img_copy = {};
+        img_copy.bufferOffset = 0;
+        img_copy.bufferRowLength = 0;
+        img_copy.bufferImageHeight = 0;
+        img_copy.imageSubresource = copy_subresource;
+        img_copy.imageOffset.x = 0;
+        img_copy.imageOffset.y = 0;
+        img_copy.imageOffset.z = 0;
+        img_copy.imageExtent.width = render_target->dims().x;
+        img_copy.imageExtent.height = render_target->dims().y;
+        img_copy.imageExtent.depth = 1;
+
+        vkCmdCopyImageToBuffer(frame.readback_cmd_buf,
+                               render_target->image_handle(),
+                               VK_IMAGE_LAYOUT_GENERAL,
+                               frame.img_readback_buf->handle(),
+                               1,
+                               &img_copy);
+
+        if (timestamp_pool != VK_NULL_HANDLE) {
+            vkCmdWriteTimestamp(frame.readback_cmd_buf,
+                                VK_PIPELINE_STAGE_TRANSFER_BIT,
+                                timestamp_pool,
+                                frame.timestamp_query + 3);
+        }
+
+        // Make the copies visible to the host
+        barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        barrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+        vkCmdPipelineBarrier(frame.readback_cmd_buf,
+                             VK_PIPELINE_STAGE_TRANSFER_BIT,
+                             VK_PIPELINE_STAGE_HOST_BIT,
+                             0,
+                             1,
+                             &barrier,
+                             0,
+                             nullptr,
+                             0,
+                             nullptr);
+
+        CHECK_VULKAN(vkEndCommandBuffer(frame.readback_cmd_buf));
+    }
 }
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <chrono>
 #include <memory>
 #include <unordered_map>
 #include <vulkan/vulkan.h>
@@ -7,31 +8,82 @@
 #include "vulkan_utils.h"
 #include "vulkanrt_utils.h"
 
+// The hit group records index into the scene's shared geometry buffers, the normal and uv
+// offsets are -1 if the geometry doesn't have them
 struct HitGroupParams {
+    uint32_t vert_offset = 0;
+    uint32_t idx_offset = 0;
+    uint32_t normal_offset = -1;
+    uint32_t uv_offset = -1;
+    uint32_t material_id = 0;
+};
+
+struct SceneGeometryParams {
     uint64_t vert_buf = 0;
     uint64_t idx_buf = 0;
     uint64_t normal_buf = 0;
     uint64_t uv_buf = 0;
-    uint32_t num_normals = 0;
-    uint32_t num_uvs = 0;
-    uint32_t material_id = 0;
+};
+
+#ifdef REPORT_RAY_STATS
+// The ray counts of a frame, summed on the device by the raygen shader
+struct RayStats {
+    uint64_t total_rays = 0;
+    uint64_t shadow_rays = 0;
+    // The path rays traced at each bounce, starting with the camera rays
+    std::vector<uint64_t> bounce_rays;
+};
+#endif
+
+// The resources used by a frame while it's in flight
+struct FrameResources {
+    std::shared_ptr<vkrt::Buffer> view_param_buf, img_readback_buf;
+#ifdef REPORT_RAY_STATS
+    std::shared_ptr<vkrt::Buffer> ray_stats_buf, ray_stats_readback_buf;
+#endif
+    VkDescriptorSet desc_set = VK_NULL_HANDLE;
+    VkCommandBuffer render_cmd_buf = VK_NULL_HANDLE;
+    VkCommandBuffer readback_cmd_buf = VK_NULL_HANDLE;
+    // Uploads the moved instances and refits the TLAS before the frame is traced, only
+    // recorded and submitted when the instances have moved since the last frame
+    VkCommandBuffer update_cmd_buf = VK_NULL_HANDLE;
+    std::shared_ptr<vkrt::Buffer> instance_upload_buf;
+    VkFence fence = VK_NULL_HANDLE;
+    // The first of the frame's timestamp queries, which are written before and after the
+    // ray tracing and the readback copy
+    uint32_t timestamp_query = 0;
+
+    bool in_flight = false;
+    bool readback = false;
+    std::chrono::high_resolution_clock::time_point submit_time;
 };
 
 struct RenderVulkan : RenderBackend {
     std::shared_ptr<vkrt::Device> device;
 
-    std::shared_ptr<vkrt::Buffer> view_param_buf, img_readback_buf, mat_params, light_params;
+    std::shared_ptr<vkrt::Buffer> mat_params, light_params, texture_handle_buf;
+
+    // All the scene's geometry is packed into these buffers
+    std::shared_ptr<vkrt::Buffer> vertex_buf, index_buf, normal_buf, uv_buf,
+        scene_geometry_params;
 
     std::shared_ptr<vkrt::Texture2D> render_target, accum_buffer;
 
 #ifdef REPORT_RAY_STATS
-    std::shared_ptr<vkrt::Texture2D> ray_stats;
-    std::shared_ptr<vkrt::Buffer> ray_stats_readback_buf;
-    std::vector<uint16_t> ray_counts;
+    // The ray counts of the most recently completed frame
+    RayStats ray_stats;
 #endif
 
     std::vector<std::unique_ptr<vkrt::TriangleMesh>> meshes;
     std::unique_ptr<vkrt::TopLevelBVH> scene_bvh;
+    // The instances in the TLAS, kept to rewrite the instance buffer when they move
+    std::vector<VkAccelerationStructureInstanceKHR> tlas_instances;
+    // The TLAS is refit when instances move, and rebuilt after this many refits since
+    // refitting gradually degrades its quality
+    size_t tlas_rebuild_interval = 16;
+    size_t tlas_refits = 0;
+    // Set when the instances have moved, the next frame rendered uploads them
+    bool instances_changed = false;
     size_t total_geom = 0;
 
     std::vector<std::shared_ptr<vkrt::Texture2D>> textures;
@@ -41,8 +93,22 @@ struct RenderVulkan : RenderBackend {
     VkCommandBuffer command_buffer = VK_NULL_HANDLE;
 
     VkCommandPool render_cmd_pool = VK_NULL_HANDLE;
-    VkCommandBuffer render_cmd_buf = VK_NULL_HANDLE;
-    VkCommandBuffer readback_cmd_buf = VK_NULL_HANDLE;
+    VkCommandPool update_cmd_pool = VK_NULL_HANDLE;
+
+    /* Up to this many frames are submitted to the device before render waits on the oldest
+     * one, so the host and device work overlap. The image returned in img is from the most
+     * recently completed frame, unless the framebuffer readback was requested, in which case
+     * render waits for the frame it submitted.
+     */
+    const size_t frames_in_flight = 2;
+    std::vector<FrameResources> frames;
+    size_t current_frame = 0;
+    std::chrono::high_resolution_clock::time_point last_frame_completion;
+
+    // Null if the device's queue doesn't support timestamps
+    VkQueryPool timestamp_pool = VK_NULL_HANDLE;
+    // Mask of the valid bits of the queue's timestamps, the rest are undefined
+    uint64_t timestamp_mask = 0;
 
     vkrt::RTPipeline rt_pipeline;
     VkPipelineLayout pipeline_layout = VK_NULL_HANDLE;
@@ -50,17 +116,27 @@ struct RenderVulkan : RenderBackend {
     VkDescriptorSetLayout textures_desc_layout = VK_NULL_HANDLE;
 
     VkDescriptorPool desc_pool = VK_NULL_HANDLE;
-    // We need a set per varying size array of things we're sending
-    VkDescriptorSet desc_set = VK_NULL_HANDLE;
+    // We need a set per varying size array of things we're sending, the frames each have
+    // their own main descriptor set
     VkDescriptorSet textures_desc_set = VK_NULL_HANDLE;
 
     vkrt::ShaderBindingTable shader_table;
 
-    VkFence fence = VK_NULL_HANDLE;
-
     size_t frame_id = 0;
+    // The number of samples accumulated since the camera last changed
+    size_t accumulated_samples = 0;
     bool native_display = false;
 
+    // The directory the pipeline cache is loaded from and saved to, or empty to not cache
+    // the compiled pipeline
+    std::string pipeline_cache_dir;
+
+    /* The number of samples per pixel traced by each render call. Tracing several samples
+     * in one launch amortizes the cost of submitting the frame and reading it back, at the
+     * cost of a longer latency for each frame.
+     */
+    uint32_t samples_per_launch = 1;
+
     RenderVulkan(std::shared_ptr<vkrt::Device> device);
 
     RenderVulkan();
@@ -73,6 +149,10 @@ struct RenderVulkan : RenderBackend {
 
     void set_scene(const Scene &scene) override;
 
+    bool supports_instance_updates() const override;
+
+    void update_instance_transforms(const std::vector<glm::mat4> &transforms) override;
+
     RenderStats render(const glm::vec3 &pos,
                        const glm::vec3 &dir,
                        const glm::vec3 &up,
@@ -87,10 +167,20 @@ private:
 
     void build_shader_binding_table();
 
-    void update_view_parameters(const glm::vec3 &pos,
+    void update_view_parameters(FrameResources &frame,
+                                const glm::vec3 &pos,
                                 const glm::vec3 &dir,
                                 const glm::vec3 &up,
                                 const float fovy);
 
     void record_command_buffers();
+
+    // Record the frame's commands to upload the current instances and refit the TLAS
+    void record_instance_update(FrameResources &frame);
+
+    // Wait for the frame to finish and read back its results
+    void complete_frame(FrameResources &frame, RenderStats &stats);
+
+    // Wait for all the frames in flight to finish
+    void wait_for_frames();
 };
@@ -27,7 +27,8 @@ struct MaterialParams {
 
   float ior;
   float specular_transmission;
-  vec2 pad;
+  uint32_t texture_mask;
+  uint32_t texture_handles;
 };
 
 struct ViewParams {
@@ -36,6 +37,8 @@ struct ViewParams {
   vec4 cam_dv;
   vec4 cam_dir_top_left;
   int frame_id;
+  int samples_per_launch;
+  int accumulated_samples;
 };
 
 struct RayPayload {
@@ -43,6 +46,7 @@ struct RayPayload {
   float dist;
   vec2 uv;
   uint material_id;
+  // The triangle's texture LOD term for ray cones, set by the closest hit shader
   float pad;
 };
 
@@ -64,8 +68,22 @@ MaterialParams material_params[];
 [[using spirv: buffer, binding(5)]]
 QuadLight lights[];
 
-[[using spirv: uniform, writeonly, binding(6), format(r16ui)]]
-uimage2D ray_stats;
+// The frame's 64-bit ray counters as low and high words, updated with 32-bit atomics:
+// the total rays, the shadow rays, then the path rays at each bounce
+[[using spirv: buffer, binding(6)]]
+uvec2 ray_stats[];
+
+inline void add_ray_count(uint counter, uint count) {
+  if (count == 0)
+    return;
+  uint prev = atomicAdd(ray_stats[counter].x, count);
+  // Carry into the high word if the low word wrapped around
+  if (prev + count < prev)
+    atomicAdd(ray_stats[counter].y, 1);
+}
+
+[[using spirv: buffer, binding(7)]]
+uint32_t texture_handles[];
 
 [[using spirv: uniform, binding(0), set(1)]]
 sampler2D textures[];
@@ -80,47 +98,82 @@ bool occlusion_hit;
 uint32_t num_lights;
 
 
-inline float textured_scalar_param(float x, vec2 uv) {
-  const uint32_t mask = floatBitsToUint(x);
-  if (IS_TEXTURED_PARAM(mask) != 0) {
-    uint32_t tex_id = GET_TEXTURE_ID(mask);
-    uint32_t channel = GET_TEXTURE_CHANNEL(mask);
-    return texture(textures[tex_id], uv)[channel];
+// Sample the texture at the mip level matching the ray cone's footprint, uv_lod
+// is the footprint's log2 size in uv space which is scaled by the texture's size
+inline vec4 sample_texture(uint32_t tex_id, vec2 uv, float uv_lod) {
+  vec2 size = vec2(textureSize(textures[tex_id], 0));
+  float lod = uv_lod + 0.5f * log2(size.x * size.y);
+  return textureLod(textures[tex_id], uv, lod);
+}
+
+inline float textured_scalar_param(uint32_t mask, uint32_t param, float x,
+  uint32_t& handle_id, vec2 uv, float uv_lod) {
+  if (IS_TEXTURED_MATERIAL_PARAM(mask, param) != 0) {
+    uint32_t handle = texture_handles[handle_id++];
+    uint32_t tex_id = GET_TEXTURE_ID(handle);
+    uint32_t channel = GET_TEXTURE_CHANNEL(handle);
+    return sample_texture(tex_id, uv, uv_lod)[channel];
   }
   return x;
 }
 
-inline DisneyMaterial unpack_material(uint id, vec2 uv) {
+inline DisneyMaterial unpack_material(uint id, vec2 uv, float uv_lod) {
   MaterialParams p = material_params[id];
 
   DisneyMaterial mat;
+  mat.base_color = p.base_color;
+  mat.metallic = p.metallic;
+  mat.specular = p.specular;
+  mat.roughness = p.roughness;
+  mat.specular_tint = p.specular_tint;
+  mat.anisotropy = p.anisotropy;
+  mat.sheen = p.sheen;
+  mat.sheen_tint = p.sheen_tint;
+  mat.clearcoat = p.clearcoat;
+  mat.clearcoat_gloss = p.clearcoat_gloss;
+  mat.ior = p.ior;
+  mat.specular_transmission = p.specular_transmission;
+
+  uint32_t mask = p.texture_mask;
+  if (mask == 0) {
+    return mat;
+  }
 
-  uint32_t mask = floatBitsToUint(p.base_color.x);
-  if (IS_TEXTURED_PARAM(mask) != 0) {
-    uint32_t tex_id = GET_TEXTURE_ID(mask);
-    uint32_t channel = GET_TEXTURE_CHANNEL(mask);
-    mat.base_color = texture(textures[tex_id], uv).rgb;
-  } else {
-    mat.base_color = p.base_color;
+  // The handles are stored in parameter order for the textured parameters
+  uint32_t handle_id = p.texture_handles;
+  if (IS_TEXTURED_MATERIAL_PARAM(mask, MATERIAL_PARAM_BASE_COLOR) != 0) {
+    uint32_t tex_id = GET_TEXTURE_ID(texture_handles[handle_id++]);
+    mat.base_color = sample_texture(tex_id, uv, uv_lod).rgb;
   }
 
-  mat.metallic = textured_scalar_param(p.metallic, uv);
-  mat.specular = textured_scalar_param(p.specular, uv);
-  mat.roughness = textured_scalar_param(p.roughness, uv);
-  mat.specular_tint = textured_scalar_param(p.specular_tint, uv);
-  mat.anisotropy = textured_scalar_param(p.anisotropy, uv);
-  mat.sheen = textured_scalar_param(p.sheen, uv);
-  mat.sheen_tint = textured_scalar_param(p.sheen_tint, uv);
-  mat.clearcoat = textured_scalar_param(p.clearcoat, uv);
-  mat.clearcoat_gloss = textured_scalar_param(p.clearcoat_gloss, uv);
-  mat.ior = textured_scalar_param(p.ior, uv);
-  mat.specular_transmission = textured_scalar_param(p.specular_transmission, uv);
+  mat.metallic = textured_scalar_param(mask, MATERIAL_PARAM_METALLIC,
+    mat.metallic, handle_id, uv, uv_lod);
+  mat.specular = textured_scalar_param(mask, MATERIAL_PARAM_SPECULAR,
+    mat.specular, handle_id, uv, uv_lod);
+  mat.roughness = textured_scalar_param(mask, MATERIAL_PARAM_ROUGHNESS,
+    mat.roughness, handle_id, uv, uv_lod);
+  mat.specular_tint = textured_scalar_param(mask, MATERIAL_PARAM_SPECULAR_TINT,
+    mat.specular_tint, handle_id, uv, uv_lod);
+  mat.anisotropy = textured_scalar_param(mask, MATERIAL_PARAM_ANISOTROPY,
+    mat.anisotropy, handle_id, uv, uv_lod);
+  mat.sheen = textured_scalar_param(mask, MATERIAL_PARAM_SHEEN,
+    mat.sheen, handle_id, uv, uv_lod);
+  mat.sheen_tint = textured_scalar_param(mask, MATERIAL_PARAM_SHEEN_TINT,
+    mat.sheen_tint, handle_id, uv, uv_lod);
+  mat.clearcoat = textured_scalar_param(mask, MATERIAL_PARAM_CLEARCOAT,
+    mat.clearcoat, handle_id, uv, uv_lod);
+  mat.clearcoat_gloss = textured_scalar_param(mask, MATERIAL_PARAM_CLEARCOAT_GLOSS,
+    mat.clearcoat_gloss, handle_id, uv, uv_lod);
+  mat.ior = textured_scalar_param(mask, MATERIAL_PARAM_IOR,
+    mat.ior, handle_id, uv, uv_lod);
+  mat.specular_transmission = textured_scalar_param(mask, MATERIAL_PARAM_SPECULAR_TRANSMISSION,
+    mat.specular_transmission, handle_id, uv, uv_lod);
 
   return mat;
 }
 
 inline vec3 sample_direct_light(DisneyMaterial mat, vec3 hit_p, vec3 n, 
-  vec3 v_x, vec3 v_y, vec3 w_o, uint& ray_count, uint& rng) {
+  vec3 v_x, vec3 v_y, vec3 w_o, uint& shadow_rays, uint& rng) {
 
   vec3 illum = vec3(0.f);
 
@@ -148,7 +201,7 @@ inline vec3 sample_direct_light(DisneyMaterial mat, vec3 hit_p, vec3 n,
     glray_Trace(scene, occlusion_flags, 0xff, PRIMARY_RAY, 1, OCCLUSION_RAY,
       hit_p, EPSILON, light_dir, light_dist, OCCLUSION_RAY);
 
-    ++ray_count;
+    ++shadow_rays;
 
     if (light_pdf >= EPSILON && bsdf_pdf >= EPSILON && !occlusion_hit) {
       vec3 bsdf = disney_brdf(mat, n, w_o, light_dir, v_x, v_y);
@@ -175,7 +228,7 @@ inline vec3 sample_direct_light(DisneyMaterial mat, vec3 hit_p, vec3 n,
         glray_Trace(scene, occlusion_flags, 0xff, PRIMARY_RAY, 1, 
           OCCLUSION_RAY, hit_p, EPSILON, w_i, light_dist, OCCLUSION_RAY);
 
-        ++ray_count;
+        ++shadow_rays;
 
         if (!occlusion_hit) 
           illum += bsdf * light.emission.rgb * abs(dot(w_i, n)) * w / bsdf_pdf;
@@ -207,14 +260,20 @@ void rgen_shader() {
   float t_min = 0;
   float t_max = 1e20f;
 
-  uint ray_count = 0;
+  // Texture LODs are picked from a cone around the path with the pixel's spread
+  // angle, which is widened by the distance travelled along each segment
+  float pixel_spread = length(viewParams.cam_dv.xyz) / dims.y;
+  float cone_width = 0;
+
+  uint shadow_rays = 0;
+  uint bounce_rays[MAX_PATH_DEPTH] { };
   vec3 illum(0);
   vec3 path_throughput(1);
   for(int bounce = 0; bounce < MAX_PATH_DEPTH; bounce) {
     glray_Trace(scene, gl_RayFlagsOpaque, 0xff, PRIMARY_RAY, 1, PRIMARY_RAY,
       ray_origin, t_min, ray_dir, t_max, PRIMARY_RAY);
 
-    ++ray_count;
+    ++bounce_rays[bounce];
 
     // If we hit nothing, include the scene background color from the miss 
     // shader
@@ -225,7 +284,11 @@ void rgen_shader() {
 
     vec3 w_o = -ray_dir;
     vec3 hit_p = ray_origin + rayPayload.dist * ray_dir;
-    DisneyMaterial mat = unpack_material(rayPayload.material_id, rayPayload.uv);
+    cone_width += pixel_spread * rayPayload.dist;
+    float uv_lod = rayPayload.pad + log2(max(cone_width, 1e-8f) /
+      max(abs(dot(ray_dir, rayPayload.normal)), 1e-4f));
+    DisneyMaterial mat = unpack_material(rayPayload.material_id, rayPayload.uv,
+      uv_lod);
 
     vec3 v_x, v_y;
     vec3 v_z = rayPayload.normal;
@@ -236,7 +299,7 @@ void rgen_shader() {
     ortho_basis(v_x, v_y, v_z);
 
     illum += path_throughput * sample_direct_light(mat, hit_p, v_z, v_x,
-      v_y, w_o, ray_count, rng);
+      v_y, w_o, shadow_rays, rng);
 
     vec3 w_i;
     float pdf;
@@ -262,8 +325,16 @@ void rgen_shader() {
     }
   }
 
-  if constexpr(report_stats)
-    imageStore(ray_stats, pixel, uvec4(ray_count));
+  // Add the rays to the frame's counters once, instead of writing a per-pixel count
+  if constexpr(report_stats) {
+    uint total_rays = shadow_rays;
+    for(int i = 0; i < MAX_PATH_DEPTH; ++i) {
+      total_rays += bounce_rays[i];
+      add_ray_count(2 + i, bounce_rays[i]);
+    }
+    add_ray_count(0, total_rays);
+    add_ray_count(1, shadow_rays);
+  }
 }
 
 
@@ -276,14 +347,24 @@ void rgen_shader() {
 [[using spirv: rayPayloadIn, location(PRIMARY_RAY)]]
 RayPayload rayPayloadIn;
 
-struct SBT {
+struct SceneGeometry {
   // These are physical storage buffer pointers.
   const vec3* verts;
   const uvec3* indices;
   const vec3* normals;
   const vec2* uvs;
-  uint32_t num_normals;
-  uint32_t num_uvs;
+};
+
+[[using spirv: uniform, binding(8)]]
+SceneGeometry scene_geometry;
+
+struct SBT {
+  // Offsets of the geometry's data in the scene geometry buffers, the normal and
+  // uv offsets are -1 if the geometry doesn't have them
+  uint32_t vert_offset;
+  uint32_t idx_offset;
+  uint32_t normal_offset;
+  uint32_t uv_offset;
   uint32_t material_id;
 };
 
@@ -295,20 +376,32 @@ vec2 attrib;      // barycentric .y and .z coordinates of the hit.
 
 [[spirv::rchit]]
 void rchit_shader() {
-  uvec3 idx = sbt.indices[glray_PrimitiveID]; 
-  vec3  va  = sbt.verts[idx.x];
-  vec3  vb  = sbt.verts[idx.y];
-  vec3  vc  = sbt.verts[idx.z];
+  const vec3* verts = scene_geometry.verts + sbt.vert_offset;
+  uvec3 idx = scene_geometry.indices[sbt.idx_offset + glray_PrimitiveID]; 
+  vec3  va  = verts[idx.x];
+  vec3  vb  = verts[idx.y];
+  vec3  vc  = verts[idx.z];
   vec3  n   = normalize(cross(vb - va, vc - va));
 
   vec2 uv { };
-  if(sbt.num_uvs > 0) {
-    vec2 uva = sbt.uvs[idx.x];
-    vec2 uvb = sbt.uvs[idx.y];
-    vec2 uvc = sbt.uvs[idx.z];
+  float uv_lod = 0;
+  if(sbt.uv_offset != 0xffffffff) {
+    const vec2* uvs = scene_geometry.uvs + sbt.uv_offset;
+    vec2 uva = uvs[idx.x];
+    vec2 uvb = uvs[idx.y];
+    vec2 uvc = uvs[idx.z];
 
     vec3 bary(1 - attrib.x - attrib.y, attrib.xy);
     uv = mat3x2(uva, uvb, uvc) * bary;
+
+    // Half the log2 of the triangle's uv space area over its world space area
+    vec2 duv_b = uvb - uva;
+    vec2 duv_c = uvc - uva;
+    float uv_area = abs(duv_b.x * duv_c.y - duv_c.x * duv_b.y);
+    mat3 to_world = mat3(glray_ObjectToWorld);
+    float world_area = length(cross(to_world * (vb - va), to_world * (vc - va)));
+    if(uv_area > 0 && world_area > 0)
+      uv_lod = 0.5f * log2(uv_area / world_area);
   }
 
   mat3 inv_transp = transpose(mat3(glray_WorldToObject));
@@ -317,6 +410,7 @@ void rchit_shader() {
   rayPayloadIn.dist = glray_Tmax;
   rayPayloadIn.uv = uv;
   rayPayloadIn.material_id = sbt.material_id;
+  rayPayloadIn.pad = uv_lod;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -1,9 +1,16 @@
 #include "vulkan_utils.h"
+#include <algorithm>
 #include <array>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
 #include <iostream>
 #include <iterator>
+#include <sstream>
 #include <stdexcept>
 #include <vector>
+#include "util.h"
 #include "vulkanrt_utils.h"
 
 namespace vkrt {
@@ -82,11 +89,15 @@ Device::Device(const std::vector<std::string> &instance_extensions,
         props.properties = {};
         vkGetPhysicalDeviceProperties2(vk_physical_device, &props);
     }
+    vkGetPhysicalDeviceProperties(vk_physical_device, &device_props);
+    allocator = std::make_unique<MemoryAllocator>(
+        device, mem_props, device_props.limits.nonCoherentAtomSize);
 }
 
 Device::~Device()
 {
     if (vk_instance != VK_NULL_HANDLE) {
+        allocator = nullptr;
         vkDestroyDevice(device, nullptr);
         vkDestroyInstance(vk_instance, nullptr);
     }
@@ -97,9 +108,13 @@ Device::Device(Device &&d)
       vk_physical_device(d.vk_physical_device),
       device(d.device),
       queue(d.queue),
+      graphics_queue_index(d.graphics_queue_index),
+      queue_timestamp_valid_bits(d.queue_timestamp_valid_bits),
       mem_props(d.mem_props),
+      device_props(d.device_props),
       as_props(d.as_props),
-      rt_pipeline_props(rt_pipeline_props)
+      rt_pipeline_props(rt_pipeline_props),
+      allocator(std::move(d.allocator))
 {
     d.vk_instance = VK_NULL_HANDLE;
     d.vk_physical_device = VK_NULL_HANDLE;
@@ -110,6 +125,7 @@ Device::Device(Device &&d)
 Device &Device::operator=(Device &&d)
 {
     if (vk_instance != VK_NULL_HANDLE) {
+        allocator = nullptr;
         vkDestroyDevice(device, nullptr);
         vkDestroyInstance(vk_instance, nullptr);
     }
@@ -117,9 +133,13 @@ Device &Device::operator=(Device &&d)
     vk_physical_device = d.vk_physical_device;
     device = d.device;
     queue = d.queue;
+    graphics_queue_index = d.graphics_queue_index;
+    queue_timestamp_valid_bits = d.queue_timestamp_valid_bits;
     mem_props = d.mem_props;
+    device_props = d.device_props;
     as_props = d.as_props;
     rt_pipeline_props = d.rt_pipeline_props;
+    allocator = std::move(d.allocator);
 
     d.vk_instance = VK_NULL_HANDLE;
     d.vk_physical_device = VK_NULL_HANDLE;
@@ -154,6 +174,11 @@ uint32_t Device::queue_index() const
     return graphics_queue_index;
 }
 
+uint32_t Device::timestamp_valid_bits() const
+{
+    return queue_timestamp_valid_bits;
+}
+
 VkCommandPool Device::make_command_pool(VkCommandPoolCreateFlagBits flags)
 {
     VkCommandPool pool = VK_NULL_HANDLE;
@@ -176,23 +201,17 @@ uint32_t Device::memory_type_index(uint32_t type_filter, VkMemoryPropertyFlags p
     throw std::runtime_error("failed to find appropriate memory");
 }
 
-VkDeviceMemory Device::alloc(size_t nbytes, uint32_t type_filter, VkMemoryPropertyFlags props)
+MemoryAllocation Device::allocate(const VkMemoryRequirements &reqs,
+                                  VkMemoryPropertyFlags props,
+                                  bool optimal_tiling)
 {
-    VkMemoryAllocateInfo info = {};
-    info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-    info.allocationSize = nbytes;
-    info.memoryTypeIndex = memory_type_index(type_filter, props);
-
-    VkMemoryAllocateFlagsInfo flags = {};
-    flags.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_FLAGS_INFO;
-    if (props & VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT) {
-        flags.flags = VK_MEMORY_ALLOCATE_DEVICE_ADDRESS_BIT;
-        info.pNext = &flags;
-    }
+    return allocator->allocate(
+        reqs, memory_type_index(reqs.memoryTypeBits, props), optimal_tiling);
+}
 
-    VkDeviceMemory mem = VK_NULL_HANDLE;
-    CHECK_VULKAN(vkAllocateMemory(device, &info, nullptr, &mem));
-    return mem;
+MemoryAllocator &Device::memory_allocator()
+{
+    return *allocator;
 }
 
 const VkPhysicalDeviceMemoryProperties &Device::memory_properties() const
@@ -200,6 +219,11 @@ const VkPhysicalDeviceMemoryProperties &Device::memory_properties() const
     return mem_props;
 }
 
+const VkPhysicalDeviceProperties &Device::properties() const
+{
+    return device_props;
+}
+
 const VkPhysicalDeviceAccelerationStructurePropertiesKHR &
 Device::acceleration_structure_properties() const
 {
@@ -298,6 +322,7 @@ void Device::make_logical_device(const std::vector<std::string> &extensions)
     for (uint32_t i = 0; i < num_queue_families; ++i) {
         if (family_props[i].queueFlags & VK_QUEUE_GRAPHICS_BIT) {
             graphics_queue_index = i;
+            queue_timestamp_valid_bits = family_props[i].timestampValidBits;
             break;
         }
     }
@@ -394,9 +419,10 @@ std::shared_ptr<Buffer> Buffer::make_buffer(Device &device,
 
     VkMemoryRequirements mem_reqs = {};
     vkGetBufferMemoryRequirements(device.logical_device(), buf->buf, &mem_reqs);
-    buf->mem = device.alloc(mem_reqs.size, mem_reqs.memoryTypeBits, mem_props);
+    buf->mem = device.allocate(mem_reqs, mem_props, false);
 
-    vkBindBufferMemory(device.logical_device(), buf->buf, buf->mem, 0);
+    CHECK_VULKAN(
+        vkBindBufferMemory(device.logical_device(), buf->buf, buf->mem.mem, buf->mem.offset));
 
     return buf;
 }
@@ -405,7 +431,7 @@ Buffer::~Buffer()
 {
     if (buf != VK_NULL_HANDLE) {
         vkDestroyBuffer(vkdevice->logical_device(), buf, nullptr);
-        vkFreeMemory(vkdevice->logical_device(), mem, nullptr);
+        vkdevice->memory_allocator().free(mem);
     }
 }
 
@@ -418,7 +444,7 @@ Buffer::Buffer(Buffer &&b)
 {
     b.buf_size = 0;
     b.buf = VK_NULL_HANDLE;
-    b.mem = VK_NULL_HANDLE;
+    b.mem = MemoryAllocation();
     b.vkdevice = nullptr;
 }
 
@@ -426,7 +452,7 @@ Buffer &Buffer::operator=(Buffer &&b)
 {
     if (buf != VK_NULL_HANDLE) {
         vkDestroyBuffer(vkdevice->logical_device(), buf, nullptr);
-        vkFreeMemory(vkdevice->logical_device(), mem, nullptr);
+        vkdevice->memory_allocator().free(mem);
     }
     buf_size = b.buf_size;
     buf = b.buf;
@@ -436,7 +462,7 @@ Buffer &Buffer::operator=(Buffer &&b)
 
     b.buf_size = 0;
     b.buf = VK_NULL_HANDLE;
-    b.mem = VK_NULL_HANDLE;
+    b.mem = MemoryAllocation();
     b.vkdevice = nullptr;
     return *this;
 }
@@ -465,24 +491,22 @@ std::shared_ptr<Buffer> Buffer::device(Device &device,
 void *Buffer::map()
 {
     assert(host_visible);
-    void *mapping = nullptr;
-    CHECK_VULKAN(vkMapMemory(vkdevice->logical_device(), mem, 0, buf_size, 0, &mapping));
-    return mapping;
+    // The memory is persistently mapped by the allocator, we just need to make sure any
+    // device writes are visible
+    vkdevice->memory_allocator().invalidate(mem);
+    return mem.mapping;
 }
 
 void *Buffer::map(size_t offset, size_t size)
 {
-    assert(host_visible);
-    assert(offset + size < buf_size);
-    void *mapping = nullptr;
-    CHECK_VULKAN(vkMapMemory(vkdevice->logical_device(), mem, offset, size, 0, &mapping));
-    return mapping;
+    assert(offset + size <= buf_size);
+    return reinterpret_cast<uint8_t *>(map()) + offset;
 }
 
 void Buffer::unmap()
 {
     assert(host_visible);
-    vkUnmapMemory(vkdevice->logical_device(), mem);
+    vkdevice->memory_allocator().flush(mem);
 }
 
 size_t Buffer::size() const
@@ -508,12 +532,13 @@ Texture2D::~Texture2D()
     if (image != VK_NULL_HANDLE) {
         vkDestroyImageView(vkdevice->logical_device(), view, nullptr);
         vkDestroyImage(vkdevice->logical_device(), image, nullptr);
-        vkFreeMemory(vkdevice->logical_device(), mem, nullptr);
+        vkdevice->memory_allocator().free(mem);
     }
 }
 
 Texture2D::Texture2D(Texture2D &&t)
     : tdims(t.tdims),
+      mips(t.mips),
       img_format(t.img_format),
       img_layout(t.img_layout),
       image(t.image),
@@ -522,7 +547,7 @@ Texture2D::Texture2D(Texture2D &&t)
       vkdevice(t.vkdevice)
 {
     t.image = VK_NULL_HANDLE;
-    t.mem = VK_NULL_HANDLE;
+    t.mem = MemoryAllocation();
     t.view = VK_NULL_HANDLE;
     t.vkdevice = nullptr;
 }
@@ -532,9 +557,10 @@ Texture2D &Texture2D::operator=(Texture2D &&t)
     if (image != VK_NULL_HANDLE) {
         vkDestroyImageView(vkdevice->logical_device(), view, nullptr);
         vkDestroyImage(vkdevice->logical_device(), image, nullptr);
-        vkFreeMemory(vkdevice->logical_device(), mem, nullptr);
+        vkdevice->memory_allocator().free(mem);
     }
     tdims = t.tdims;
+    mips = t.mips;
     img_format = t.img_format;
     img_layout = t.img_layout;
     image = t.image;
@@ -543,6 +569,7 @@ Texture2D &Texture2D::operator=(Texture2D &&t)
     vkdevice = t.vkdevice;
 
     t.image = VK_NULL_HANDLE;
+    t.mem = MemoryAllocation();
     t.view = VK_NULL_HANDLE;
     t.vkdevice = nullptr;
     return *this;
@@ -551,11 +578,13 @@ Texture2D &Texture2D::operator=(Texture2D &&t)
 std::shared_ptr<Texture2D> Texture2D::device(Device &device,
                                              glm::uvec2 dims,
                                              VkFormat img_format,
-                                             VkImageUsageFlags usage)
+                                             VkImageUsageFlags usage,
+                                             uint32_t mip_levels)
 {
     auto texture = std::make_shared<Texture2D>();
     texture->img_format = img_format;
     texture->tdims = dims;
+    texture->mips = mip_levels;
     texture->vkdevice = &device;
 
     VkImageCreateInfo create_info = {};
@@ -565,7 +594,7 @@ std::shared_ptr<Texture2D> Texture2D::device(Device &device,
     create_info.extent.width = texture->tdims.x;
     create_info.extent.height = texture->tdims.y;
     create_info.extent.depth = 1;
-    create_info.mipLevels = 1;
+    create_info.mipLevels = texture->mips;
     create_info.arrayLayers = 1;
     create_info.samples = VK_SAMPLE_COUNT_1_BIT;
     create_info.tiling = VK_IMAGE_TILING_OPTIMAL;
@@ -576,10 +605,10 @@ std::shared_ptr<Texture2D> Texture2D::device(Device &device,
 
     VkMemoryRequirements mem_reqs = {};
     vkGetImageMemoryRequirements(device.logical_device(), texture->image, &mem_reqs);
-    texture->mem = device.alloc(
-        mem_reqs.size, mem_reqs.memoryTypeBits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+    texture->mem = device.allocate(mem_reqs, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, true);
 
-    CHECK_VULKAN(vkBindImageMemory(device.logical_device(), texture->image, texture->mem, 0));
+    CHECK_VULKAN(vkBindImageMemory(
+        device.logical_device(), texture->image, texture->mem.mem, texture->mem.offset));
 
     // An ImageView is only valid for certain image types, so check that the image being made
     // is one of those
@@ -602,7 +631,7 @@ std::shared_ptr<Texture2D> Texture2D::device(Device &device,
 
         view_create_info.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
         view_create_info.subresourceRange.baseMipLevel = 0;
-        view_create_info.subresourceRange.levelCount = 1;
+        view_create_info.subresourceRange.levelCount = texture->mips;
         view_create_info.subresourceRange.baseArrayLayer = 0;
         view_create_info.subresourceRange.layerCount = 1;
 
@@ -640,6 +669,11 @@ glm::uvec2 Texture2D::dims() const
     return tdims;
 }
 
+uint32_t Texture2D::mip_levels() const
+{
+    return mips;
+}
+
 VkImage Texture2D::image_handle() const
 {
     return image;
@@ -650,6 +684,427 @@ VkImageView Texture2D::view_handle() const
     return view;
 }
 
+StagingRing::StagingRing(Device &dev, size_t nbytes) : device(&dev)
+{
+    staging_buf = Buffer::host(*device,
+                               nbytes,
+                               VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+                               VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+    mapping = reinterpret_cast<uint8_t *>(staging_buf->map());
+
+    cmd_pool = device->make_command_pool(VK_COMMAND_POOL_CREATE_TRANSIENT_BIT);
+    VkCommandBufferAllocateInfo alloc_info = {};
+    alloc_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+    alloc_info.commandPool = cmd_pool;
+    alloc_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+    alloc_info.commandBufferCount = 1;
+    CHECK_VULKAN(vkAllocateCommandBuffers(device->logical_device(), &alloc_info, &cmd_buf));
+
+    VkFenceCreateInfo fence_info = {};
+    fence_info.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+    CHECK_VULKAN(vkCreateFence(device->logical_device(), &fence_info, nullptr, &fence));
+}
+
+StagingRing::~StagingRing()
+{
+    // Make sure any pending uploads aren't lost or still reading the staging buffer
+    if (recording) {
+        flush();
+    }
+    staging_buf->unmap();
+    vkDestroyFence(device->logical_device(), fence, nullptr);
+    vkDestroyCommandPool(device->logical_device(), cmd_pool, nullptr);
+}
+
+size_t StagingRing::reserve(size_t nbytes, size_t alignment)
+{
+    size_t start = align_to(offset, alignment);
+    if (start + nbytes > staging_buf->size()) {
+        flush();
+        start = 0;
+    }
+    offset = start + nbytes;
+    return start;
+}
+
+void StagingRing::upload(const void *data,
+                         size_t nbytes,
+                         const std::shared_ptr<Buffer> &dst,
+                         size_t dst_offset)
+{
+    const uint8_t *src = reinterpret_cast<const uint8_t *>(data);
+    // Uploads larger than the staging buffer are split up over multiple submissions
+    while (nbytes > 0) {
+        const size_t chunk_size = std::min(nbytes, staging_buf->size());
+        const size_t staging_offset = reserve(chunk_size, 16);
+        std::memcpy(mapping + staging_offset, src, chunk_size);
+
+        VkBufferCopy copy_cmd = {};
+        copy_cmd.srcOffset = staging_offset;
+        copy_cmd.dstOffset = dst_offset;
+        copy_cmd.size = chunk_size;
+        vkCmdCopyBuffer(command_buffer(), staging_buf->handle(), dst->handle(), 1, &copy_cmd);
+
+        src += chunk_size;
+        dst_offset += chunk_size;
+        nbytes -= chunk_size;
+    }
+}
+
+void StagingRing::upload(const std::shared_ptr<Texture2D> &dst, const void *data)
+{
+    const glm::uvec2 dims = dst->dims();
+    const size_t row_size = dst->pixel_size() * dims.x;
+    if (row_size > staging_buf->size()) {
+        throw std::runtime_error("Texture row does not fit in the staging buffer");
+    }
+
+    begin_texture_upload(*dst);
+
+    // Images larger than the staging buffer are uploaded in chunks of rows
+    const uint8_t *src = reinterpret_cast<const uint8_t *>(data);
+    const uint32_t chunk_rows = std::min(size_t(dims.y), staging_buf->size() / row_size);
+    for (uint32_t y = 0; y < dims.y; y += chunk_rows) {
+        const uint32_t rows = std::min(chunk_rows, dims.y - y);
+        const size_t staging_offset = reserve(rows * row_size, 16);
+        std::memcpy(mapping + staging_offset, src + y * row_size, rows * row_size);
+        copy_texture_rows(*dst, staging_offset, y, rows);
+    }
+
+    finish_texture_upload(*dst);
+}
+
+void StagingRing::upload(const std::vector<std::shared_ptr<Texture2D>> &dst,
+                         const std::vector<const void *> &data)
+{
+    auto texture_size = [&](const size_t i) {
+        return dst[i]->pixel_size() * dst[i]->dims().x * dst[i]->dims().y;
+    };
+
+    size_t next = 0;
+    while (next < dst.size()) {
+        // Reserve space for the textures until one doesn't fit in what's left of the
+        // staging buffer, which then starts the next batch
+        const size_t first = next;
+        std::vector<size_t> staging_offsets;
+        for (; next < dst.size(); ++next) {
+            const size_t nbytes = texture_size(next);
+            if (nbytes > staging_buf->size() ||
+                (next != first && align_to(offset, 16) + nbytes > staging_buf->size())) {
+                break;
+            }
+            staging_offsets.push_back(reserve(nbytes, 16));
+        }
+
+        // Textures larger than the whole staging buffer are uploaded in chunks on their own
+        if (next == first) {
+            upload(dst[next], data[next]);
+            ++next;
+            continue;
+        }
+
+        parallel_for_index(next - first, [&](const size_t i) {
+            std::memcpy(
+                mapping + staging_offsets[i], data[first + i], texture_size(first + i));
+        });
+
+        for (size_t i = first; i < next; ++i) {
+            begin_texture_upload(*dst[i]);
+            copy_texture_rows(*dst[i], staging_offsets[i - first], 0, dst[i]->dims().y);
+            finish_texture_upload(*dst[i]);
+        }
+    }
+}
+
+static VkImageMemoryBarrier texture_layout_barrier(const Texture2D &texture,
+                                                   uint32_t base_mip,
+                                                   uint32_t mip_count,
+                                                   VkImageLayout old_layout,
+                                                   VkImageLayout new_layout,
+                                                   VkAccessFlags src_access,
+                                                   VkAccessFlags dst_access)
+{
+    VkImageMemoryBarrier img_mem_barrier = {};
+    img_mem_barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+    img_mem_barrier.image = texture.image_handle();
+    img_mem_barrier.oldLayout = old_layout;
+    img_mem_barrier.newLayout = new_layout;
+    img_mem_barrier.srcAccessMask = src_access;
+    img_mem_barrier.dstAccessMask = dst_access;
+    img_mem_barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    img_mem_barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    img_mem_barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    img_mem_barrier.subresourceRange.baseMipLevel = base_mip;
+    img_mem_barrier.subresourceRange.levelCount = mip_count;
+    img_mem_barrier.subresourceRange.baseArrayLayer = 0;
+    img_mem_barrier.subresourceRange.layerCount = 1;
+    return img_mem_barrier;
+}
+
+void StagingRing::begin_texture_upload(const Texture2D &dst)
+{
+    const VkImageMemoryBarrier img_mem_barrier =
+        texture_layout_barrier(dst,
+                               0,
+                               dst.mip_levels(),
+                               VK_IMAGE_LAYOUT_UNDEFINED,
+                               VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                               0,
+                               VK_ACCESS_TRANSFER_WRITE_BIT);
+    vkCmdPipelineBarrier(command_buffer(),
+                         VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+                         VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         0,
+                         0,
+                         nullptr,
+                         0,
+                         nullptr,
+                         1,
+                         &img_mem_barrier);
+}
+
+void StagingRing::copy_texture_rows(const Texture2D &dst,
+                                    size_t staging_offset,
+                                    uint32_t first_row,
+                                    uint32_t rows)
+{
+    VkBufferImageCopy img_copy = {};
+    img_copy.bufferOffset = staging_offset;
+    img_copy.bufferRowLength = 0;
+    img_copy.bufferImageHeight = 0;
+    img_copy.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    img_copy.imageSubresource.mipLevel = 0;
+    img_copy.imageSubresource.baseArrayLayer = 0;
+    img_copy.imageSubresource.layerCount = 1;
+    img_copy.imageOffset.x = 0;
+    img_copy.imageOffset.y = first_row;
+    img_copy.imageOffset.z = 0;
+    img_copy.imageExtent.width = dst.dims().x;
+    img_copy.imageExtent.height = rows;
+    img_copy.imageExtent.depth = 1;
+
+    vkCmdCopyBufferToImage(command_buffer(),
+                           staging_buf->handle(),
+                           dst.image_handle(),
+                           VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                           1,
+                           &img_copy);
+}
+
+void StagingRing::finish_texture_upload(const Texture2D &dst)
+{
+    VkCommandBuffer cmd = command_buffer();
+
+    // Each level is filled by downsampling the one above it, which is moved to the transfer
+    // src layout once its writes are done
+    glm::ivec2 mip_dims = glm::ivec2(dst.dims());
+    for (uint32_t i = 1; i < dst.mip_levels(); ++i) {
+        const VkImageMemoryBarrier img_mem_barrier =
+            texture_layout_barrier(dst,
+                                   i - 1,
+                                   1,
+                                   VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                                   VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+                                   VK_ACCESS_TRANSFER_WRITE_BIT,
+                                   VK_ACCESS_TRANSFER_READ_BIT);
+        vkCmdPipelineBarrier(cmd,
+                             VK_PIPELINE_STAGE_TRANSFER_BIT,
+                             VK_PIPELINE_STAGE_TRANSFER_BIT,
+                             0,
+                             0,
+                             nullptr,
+                             0,
+                             nullptr,
+                             1,
+                             &img_mem_barrier);
+
+        const glm::ivec2 next_dims = glm::max(mip_dims / 2, glm::ivec2(1));
+        VkImageBlit blit = {};
+        blit.srcSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+        blit.srcSubresource.mipLevel = i - 1;
+        blit.srcSubresource.baseArrayLayer = 0;
+        blit.srcSubresource.layerCount = 1;
+        blit.srcOffsets[1].x = mip_dims.x;
+        blit.srcOffsets[1].y = mip_dims.y;
+        blit.srcOffsets[1].z = 1;
+        blit.dstSubresource = blit.srcSubresource;
+        blit.dstSubresource.mipLevel = i;
+        blit.dstOffsets[1].x = next_dims.x;
+        blit.dstOffsets[1].y = next_dims.y;
+        blit.dstOffsets[1].z = 1;
+        vkCmdBlitImage(cmd,
+                       dst.image_handle(),
+                       VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+                       dst.image_handle(),
+                       VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                       1,
+                       &blit,
+                       VK_FILTER_LINEAR);
+        mip_dims = next_dims;
+    }
+
+    // All but the last level were blitted from and are in the transfer src layout
+    const uint32_t last_mip = dst.mip_levels() - 1;
+    std::vector<VkImageMemoryBarrier> img_mem_barriers;
+    img_mem_barriers.push_back(texture_layout_barrier(dst,
+                                                      last_mip,
+                                                      1,
+                                                      VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                                                      VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+                                                      VK_ACCESS_TRANSFER_WRITE_BIT,
+                                                      VK_ACCESS_SHADER_READ_BIT));
+    if (last_mip > 0) {
+        img_mem_barriers.push_back(
+            texture_layout_barrier(dst,
+                                   0,
+                                   last_mip,
+                                   VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+                                   VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+                                   VK_ACCESS_TRANSFER_READ_BIT,
+                                   VK_ACCESS_SHADER_READ_BIT));
+    }
+    vkCmdPipelineBarrier(cmd,
+                         VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
+                         0,
+                         0,
+                         nullptr,
+                         0,
+                         nullptr,
+                         img_mem_barriers.size(),
+                         img_mem_barriers.data());
+}
+
+VkCommandBuffer StagingRing::command_buffer()
+{
+    if (!recording) {
+        VkCommandBufferBeginInfo begin_info = {};
+        begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+        begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+        CHECK_VULKAN(vkBeginCommandBuffer(cmd_buf, &begin_info));
+        recording = true;
+    }
+    return cmd_buf;
+}
+
+void StagingRing::barrier()
+{
+    VkMemoryBarrier barrier = {};
+    barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    barrier.srcAccessMask = VK_ACCESS_MEMORY_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_MEMORY_READ_BIT | VK_ACCESS_MEMORY_WRITE_BIT;
+
+    vkCmdPipelineBarrier(command_buffer(),
+                         VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
+                         VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
+                         0,
+                         1,
+                         &barrier,
+                         0,
+                         nullptr,
+                         0,
+                         nullptr);
+}
+
+void StagingRing::flush()
+{
+    offset = 0;
+    if (!recording) {
+        return;
+    }
+    recording = false;
+    CHECK_VULKAN(vkEndCommandBuffer(cmd_buf));
+
+    VkSubmitInfo submit_info = {};
+    submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    submit_info.commandBufferCount = 1;
+    submit_info.pCommandBuffers = &cmd_buf;
+    CHECK_VULKAN(vkQueueSubmit(device->graphics_queue(), 1, &submit_info, fence));
+    CHECK_VULKAN(vkWaitForFences(device->logical_device(), 1, &fence, true, UINT64_MAX));
+    CHECK_VULKAN(vkResetFences(device->logical_device(), 1, &fence));
+
+    vkResetCommandPool(
+        device->logical_device(), cmd_pool, VK_COMMAND_POOL_RESET_RELEASE_RESOURCES_BIT);
+}
+
+PipelineCache::PipelineCache(Device &dev, const std::string &directory) : device(&dev)
+{
+    const VkPhysicalDeviceProperties &props = device->properties();
+    std::stringstream ss;
+    ss << directory << "/vk_pipeline_cache_" << std::hex << std::setfill('0') << std::setw(4)
+       << props.vendorID << "_" << std::setw(4) << props.deviceID << "_" << std::setw(8)
+       << props.driverVersion << ".bin";
+    path = ss.str();
+
+    std::vector<uint8_t> data;
+    std::ifstream fin(path.c_str(), std::ios::binary);
+    if (fin) {
+        data = std::vector<uint8_t>(std::istreambuf_iterator<char>(fin),
+                                    std::istreambuf_iterator<char>());
+    }
+
+    // The header is the header size, header version, vendor ID, device ID and cache UUID
+    const size_t header_size = 4 * sizeof(uint32_t) + VK_UUID_SIZE;
+    if (data.size() >= header_size) {
+        std::array<uint32_t, 4> header;
+        std::memcpy(header.data(), data.data(), sizeof(header));
+        const bool valid = header[0] >= header_size &&
+                           header[1] == VK_PIPELINE_CACHE_HEADER_VERSION_ONE &&
+                           header[2] == props.vendorID && header[3] == props.deviceID &&
+                           std::memcmp(data.data() + sizeof(header),
+                                       props.pipelineCacheUUID,
+                                       VK_UUID_SIZE) == 0;
+        if (!valid) {
+            std::cout << "Discarding pipeline cache " << path
+                      << " made by a different device or driver\n";
+            data.clear();
+        }
+    } else {
+        data.clear();
+    }
+
+    VkPipelineCacheCreateInfo info = {};
+    info.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+    info.initialDataSize = data.size();
+    info.pInitialData = data.empty() ? nullptr : data.data();
+    CHECK_VULKAN(vkCreatePipelineCache(device->logical_device(), &info, nullptr, &cache));
+}
+
+PipelineCache::~PipelineCache()
+{
+    vkDestroyPipelineCache(device->logical_device(), cache, nullptr);
+}
+
+void PipelineCache::save()
+{
+    size_t size = 0;
+    CHECK_VULKAN(vkGetPipelineCacheData(device->logical_device(), cache, &size, nullptr));
+    std::vector<uint8_t> data(size, 0);
+    CHECK_VULKAN(vkGetPipelineCacheData(device->logical_device(), cache, &size, data.data()));
+
+    // Write to a temporary file and move it into place, so another process loading the cache
+    // never sees a partially written one
+    const std::string tmp_path = path + ".tmp";
+    {
+        std::ofstream fout(tmp_path.c_str(), std::ios::binary);
+        fout.write(reinterpret_cast<const char *>(data.data()), size);
+        if (!fout) {
+            std::cout << "Failed to write pipeline cache " << tmp_path << "\n";
+            return;
+        }
+    }
+    std::remove(path.c_str());
+    if (std::rename(tmp_path.c_str(), path.c_str()) != 0) {
+        std::cout << "Failed to save pipeline cache " << path << "\n";
+        std::remove(tmp_path.c_str());
+    }
+}
+
+VkPipelineCache PipelineCache::handle() const
+{
+    return cache;
+}
+
 ShaderModule::ShaderModule(Device &vkdevice, const uint32_t *code, size_t code_size)
     : device(&vkdevice)
 {
@@ -6,6 +6,7 @@
 #include <string>
 #include <vector>
 #include <vulkan/vulkan.h>
+#include "memory_allocator.h"
 #include <glm/glm.hpp>
 
 #define CHECK_VULKAN(FN)                                   \
@@ -38,11 +39,16 @@ class Device {
     VkQueue queue = VK_NULL_HANDLE;
 
     uint32_t graphics_queue_index = -1;
+    // The number of valid bits in the queue's timestamps, 0 if it doesn't support them
+    uint32_t queue_timestamp_valid_bits = 0;
 
     VkPhysicalDeviceMemoryProperties mem_props = {};
+    VkPhysicalDeviceProperties device_props = {};
     VkPhysicalDeviceAccelerationStructurePropertiesKHR as_props = {};
     VkPhysicalDeviceRayTracingPipelinePropertiesKHR rt_pipeline_props = {};
 
+    std::unique_ptr<MemoryAllocator> allocator;
+
 public:
     Device(const std::vector<std::string> &instance_extensions = std::vector<std::string>{},
            const std::vector<std::string> &logical_device_extensions =
@@ -63,14 +69,22 @@ public:
 
     VkQueue graphics_queue();
     uint32_t queue_index() const;
+    uint32_t timestamp_valid_bits() const;
 
     VkCommandPool make_command_pool(
         VkCommandPoolCreateFlagBits flags = (VkCommandPoolCreateFlagBits)0);
 
     uint32_t memory_type_index(uint32_t type_filter, VkMemoryPropertyFlags props) const;
-    VkDeviceMemory alloc(size_t nbytes, uint32_t type_filter, VkMemoryPropertyFlags props);
+
+    // Sub-allocate memory for a buffer or image from the device's memory allocator
+    MemoryAllocation allocate(const VkMemoryRequirements &reqs,
+                              VkMemoryPropertyFlags props,
+                              bool optimal_tiling);
+
+    MemoryAllocator &memory_allocator();
 
     const VkPhysicalDeviceMemoryProperties &memory_properties() const;
+    const VkPhysicalDeviceProperties &properties() const;
     const VkPhysicalDeviceAccelerationStructurePropertiesKHR &
     acceleration_structure_properties() const;
     const VkPhysicalDeviceRayTracingPipelinePropertiesKHR &raytracing_pipeline_properties()
@@ -87,7 +101,7 @@ private:
 class Buffer {
     size_t buf_size = 0;
     VkBuffer buf = VK_NULL_HANDLE;
-    VkDeviceMemory mem = VK_NULL_HANDLE;
+    MemoryAllocation mem;
     Device *vkdevice = nullptr;
     bool host_visible = false;
 
@@ -134,10 +148,11 @@ public:
 
 class Texture2D {
     glm::uvec2 tdims = glm::uvec2(0);
+    uint32_t mips = 1;
     VkFormat img_format;
     VkImageLayout img_layout = VK_IMAGE_LAYOUT_UNDEFINED;
     VkImage image = VK_NULL_HANDLE;
-    VkDeviceMemory mem = VK_NULL_HANDLE;
+    MemoryAllocation mem;
     VkImageView view = VK_NULL_HANDLE;
     Device *vkdevice = nullptr;
 
@@ -154,17 +169,113 @@ public:
     static std::shared_ptr<Texture2D> device(Device &device,
                                              glm::uvec2 dims,
                                              VkFormat img_format,
-                                             VkImageUsageFlags usage);
+                                             VkImageUsageFlags usage,
+                                             uint32_t mip_levels = 1);
 
     // Size of one pixel, in bytes
     size_t pixel_size() const;
     VkFormat pixel_format() const;
     glm::uvec2 dims() const;
+    uint32_t mip_levels() const;
 
     VkImage image_handle() const;
     VkImageView view_handle() const;
 };
 
+/* A persistently mapped host buffer used to stage uploads to device buffers and images.
+ * The copies are recorded into a single command buffer which is only submitted when the
+ * staging buffer fills up or on flush, and completion is waited on with a fence instead of
+ * draining the queue. Other work can be recorded into the same command buffer through
+ * command_buffer() to have it run in order with the uploads.
+ */
+class StagingRing {
+    Device *device = nullptr;
+    std::shared_ptr<Buffer> staging_buf;
+    uint8_t *mapping = nullptr;
+    size_t offset = 0;
+
+    VkCommandPool cmd_pool = VK_NULL_HANDLE;
+    VkCommandBuffer cmd_buf = VK_NULL_HANDLE;
+    VkFence fence = VK_NULL_HANDLE;
+    bool recording = false;
+
+    // Reserve space in the staging buffer, flushing the pending work if it's full
+    size_t reserve(size_t nbytes, size_t alignment);
+
+    // Move all the texture's mip levels to the transfer dst layout
+    void begin_texture_upload(const Texture2D &dst);
+
+    // Copy rows of mip level 0 from the staging buffer into the texture
+    void copy_texture_rows(const Texture2D &dst,
+                           size_t staging_offset,
+                           uint32_t first_row,
+                           uint32_t rows);
+
+    // Blit down the rest of the texture's mip levels from level 0 and move it to the
+    // shader read only optimal layout
+    void finish_texture_upload(const Texture2D &dst);
+
+public:
+    StagingRing(Device &device, size_t nbytes = 64 * 1024 * 1024);
+    ~StagingRing();
+
+    StagingRing(const StagingRing &) = delete;
+    StagingRing &operator=(const StagingRing &) = delete;
+
+    // Copy the data into the buffer at dst_offset. The buffer must be kept alive until the
+    // next flush
+    void upload(const void *data,
+                size_t nbytes,
+                const std::shared_ptr<Buffer> &dst,
+                size_t dst_offset = 0);
+
+    /* Copy the pixel data into the texture, which must be in the undefined layout. The
+     * remaining mip levels are generated from the data with linear blits, so textures with
+     * more than one level must support being blitted from and to. The texture will be in
+     * the shader read only optimal layout once the upload is done, and must be kept alive
+     * until the next flush
+     */
+    void upload(const std::shared_ptr<Texture2D> &dst, const void *data);
+
+    /* Upload a set of textures as above. As many textures as fit are staged at once, with
+     * the copies into the staging buffer done in parallel
+     */
+    void upload(const std::vector<std::shared_ptr<Texture2D>> &dst,
+                const std::vector<const void *> &data);
+
+    // Get the command buffer being recorded, beginning a new one if needed
+    VkCommandBuffer command_buffer();
+
+    // Make the writes of the commands recorded so far visible to the ones recorded after
+    void barrier();
+
+    // Submit the recorded commands and wait for them to complete
+    void flush();
+};
+
+/* A VkPipelineCache persisted to a file in a directory. The file name includes the device's
+ * vendor and device IDs and the driver version, and cached data whose header doesn't match
+ * the device's pipeline cache UUID is discarded, so a stale cache is never handed to the
+ * driver.
+ */
+class PipelineCache {
+    Device *device = nullptr;
+    VkPipelineCache cache = VK_NULL_HANDLE;
+    std::string path;
+
+public:
+    PipelineCache(Device &device, const std::string &directory);
+    ~PipelineCache();
+
+    PipelineCache(const PipelineCache &) = delete;
+    PipelineCache &operator=(const PipelineCache &) = delete;
+
+    // Write the cache contents back to the file
+    void save();
+
+    VkPipelineCache handle() const;
+};
+
 struct ShaderModule {
     Device *device = nullptr;
     VkShaderModule module = VK_NULL_HANDLE;
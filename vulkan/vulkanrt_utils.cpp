@@ -11,36 +11,70 @@ namespace vkrt {
 
 Geometry::Geometry(std::shared_ptr<Buffer> verts,
                    std::shared_ptr<Buffer> indices,
-                   std::shared_ptr<Buffer> normal_buf,
-                   std::shared_ptr<Buffer> uv_buf,
+                   std::shared_ptr<Buffer> normals,
+                   std::shared_ptr<Buffer> uvs,
                    uint32_t geom_flags)
-    : vertex_buf(verts), index_buf(indices), normal_buf(normal_buf), uv_buf(uv_buf)
+    : Geometry(verts,
+               0,
+               verts->size() / sizeof(glm::vec3),
+               indices,
+               0,
+               indices->size() / sizeof(glm::uvec3),
+               geom_flags)
+{
+    normal_buf = normals;
+    uv_buf = uvs;
+    if (normal_buf) {
+        normal_offset = 0;
+    }
+    if (uv_buf) {
+        uv_offset = 0;
+    }
+}
+
+Geometry::Geometry(std::shared_ptr<Buffer> verts,
+                   uint32_t vertex_offset,
+                   uint32_t vertex_count,
+                   std::shared_ptr<Buffer> indices,
+                   uint32_t index_offset,
+                   uint32_t triangle_count,
+                   uint32_t geom_flags)
+    : vertex_buf(verts),
+      index_buf(indices),
+      vertex_offset(vertex_offset),
+      index_offset(index_offset),
+      vertex_count(vertex_count),
+      triangle_count(triangle_count)
 {
     geom_desc.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_KHR;
     geom_desc.geometryType = VK_GEOMETRY_TYPE_TRIANGLES_KHR;
     geom_desc.flags = geom_flags;
 
+    // The indices are relative to the geometry's first vertex, so the vertex data starts at
+    // the geometry's range in the buffer
     geom_desc.geometry.triangles.sType =
         VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_TRIANGLES_DATA_KHR;
     geom_desc.geometry.triangles.vertexFormat = VK_FORMAT_R32G32B32_SFLOAT;
-    geom_desc.geometry.triangles.vertexData.deviceAddress = vertex_buf->device_address();
+    geom_desc.geometry.triangles.vertexData.deviceAddress =
+        vertex_buf->device_address() + vertex_offset * sizeof(glm::vec3);
     geom_desc.geometry.triangles.vertexStride = sizeof(glm::vec3);
     geom_desc.geometry.triangles.maxVertex = num_vertices();
 
     geom_desc.geometry.triangles.indexType = VK_INDEX_TYPE_UINT32;
-    geom_desc.geometry.triangles.indexData.deviceAddress = index_buf->device_address();
+    geom_desc.geometry.triangles.indexData.deviceAddress =
+        index_buf->device_address() + index_offset * sizeof(glm::uvec3);
 
     geom_desc.geometry.triangles.transformData.deviceAddress = 0;
 }
 
 uint32_t Geometry::num_vertices() const
 {
-    return vertex_buf->size() / sizeof(glm::vec3);
+    return vertex_count;
 }
 
 uint32_t Geometry::num_triangles() const
 {
-    return index_buf->size() / sizeof(glm::uvec3);
+    return triangle_count;
 }
 
 TriangleMesh::TriangleMesh(Device &dev, std::vector<Geometry> geoms, uint32_t build_flags)
@@ -62,15 +96,9 @@ TriangleMesh::~TriangleMesh()
     }
 }
 
-void TriangleMesh::enqueue_build(VkCommandBuffer &cmd_buf)
+VkAccelerationStructureBuildSizesInfoKHR TriangleMesh::build_sizes() const
 {
-    // Determine how much memory the acceleration structure will need
-    VkAccelerationStructureBuildGeometryInfoKHR build_info = {};
-    build_info.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR;
-    build_info.type = VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR;
-    build_info.flags = build_flags;
-    build_info.geometryCount = geom_descs.size();
-    build_info.pGeometries = geom_descs.data();
+    const VkAccelerationStructureBuildGeometryInfoKHR build_info = build_geometry_info();
 
     std::vector<uint32_t> primitive_counts;
     std::transform(geometries.begin(),
@@ -85,50 +113,78 @@ void TriangleMesh::enqueue_build(VkCommandBuffer &cmd_buf)
                                           &build_info,
                                           primitive_counts.data(),
                                           &build_size_info);
+    return build_size_info;
+}
+
+bool TriangleMesh::compaction_enabled() const
+{
+    return build_flags & VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_COMPACTION_BIT_KHR;
+}
 
+VkAccelerationStructureBuildGeometryInfoKHR TriangleMesh::build_geometry_info() const
+{
+    VkAccelerationStructureBuildGeometryInfoKHR build_info = {};
+    build_info.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR;
+    build_info.type = VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR;
+    build_info.flags = build_flags;
+    build_info.mode = VK_BUILD_ACCELERATION_STRUCTURE_MODE_BUILD_KHR;
+    build_info.dstAccelerationStructure = bvh;
+    build_info.geometryCount = geom_descs.size();
+    build_info.pGeometries = geom_descs.data();
+    return build_info;
+}
+
+std::vector<VkAccelerationStructureBuildRangeInfoKHR> TriangleMesh::build_ranges() const
+{
+    std::vector<VkAccelerationStructureBuildRangeInfoKHR> build_offset_info;
+    std::transform(geometries.begin(),
+                   geometries.end(),
+                   std::back_inserter(build_offset_info),
+                   [](const Geometry &g) {
+                       VkAccelerationStructureBuildRangeInfoKHR offset = {};
+                       offset.primitiveCount = g.num_triangles();
+                       offset.primitiveOffset = 0;
+                       offset.firstVertex = 0;
+                       offset.transformOffset = 0;
+                       return offset;
+                   });
+    return build_offset_info;
+}
+
+void TriangleMesh::create_bvh(size_t bvh_size)
+{
     bvh_buf = Buffer::device(*device,
-                             build_size_info.accelerationStructureSize,
+                             bvh_size,
                              VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT |
                                  VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT |
                                  VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_STORAGE_BIT_KHR);
 
-    scratch_buf = Buffer::device(
-        *device,
-        build_size_info.buildScratchSize,
-        VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT);
-
-    // Create the acceleration structure
     VkAccelerationStructureCreateInfoKHR as_create_info = {};
     as_create_info.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_CREATE_INFO_KHR;
     as_create_info.buffer = bvh_buf->handle();
-    as_create_info.size = build_size_info.accelerationStructureSize;
+    as_create_info.size = bvh_size;
     as_create_info.type = VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR;
     CHECK_VULKAN(CreateAccelerationStructureKHR(
         device->logical_device(), &as_create_info, nullptr, &bvh));
+}
+
+void TriangleMesh::enqueue_build(VkCommandBuffer &cmd_buf)
+{
+    // Determine how much memory the acceleration structure will need
+    const VkAccelerationStructureBuildSizesInfoKHR build_size_info = build_sizes();
+
+    scratch_buf = Buffer::device(
+        *device,
+        build_size_info.buildScratchSize,
+        VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT);
+
+    create_bvh(build_size_info.accelerationStructureSize);
 
     // Enqueue the acceleration structure build
-    VkAccelerationStructureBuildGeometryInfoKHR accel_build_info = {};
-    accel_build_info.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR;
-    accel_build_info.type = VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR;
-    accel_build_info.flags = build_flags;
-    accel_build_info.mode = VK_BUILD_ACCELERATION_STRUCTURE_MODE_BUILD_KHR;
-    accel_build_info.dstAccelerationStructure = bvh;
-    accel_build_info.geometryCount = geom_descs.size();
-    accel_build_info.pGeometries = geom_descs.data();
+    VkAccelerationStructureBuildGeometryInfoKHR accel_build_info = build_geometry_info();
     accel_build_info.scratchData.deviceAddress = scratch_buf->device_address();
 
-    std::vector<VkAccelerationStructureBuildRangeInfoKHR> build_offset_info;
-    std::transform(geometries.begin(),
-                   geometries.end(),
-                   std::back_inserter(build_offset_info),
-                   [](const Geometry &g) {
-                       VkAccelerationStructureBuildRangeInfoKHR offset = {};
-                       offset.primitiveCount = g.num_triangles();
-                       offset.primitiveOffset = 0;
-                       offset.firstVertex = 0;
-                       offset.transformOffset = 0;
-                       return offset;
-                   });
+    std::vector<VkAccelerationStructureBuildRangeInfoKHR> build_offset_info = build_ranges();
 
     VkAccelerationStructureBuildRangeInfoKHR *build_offset_info_ptr = build_offset_info.data();
     // Enqueue the build commands into the command buffer
@@ -154,7 +210,7 @@ void TriangleMesh::enqueue_build(VkCommandBuffer &cmd_buf)
                          nullptr);
 
     // Read the compacted size if we're compacting
-    if (build_flags & VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_COMPACTION_BIT_KHR) {
+    if (compaction_enabled()) {
         VkQueryPoolCreateInfo pool_ci = {};
         pool_ci.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
         pool_ci.queryType = VK_QUERY_TYPE_ACCELERATION_STRUCTURE_COMPACTED_SIZE_KHR;
@@ -177,7 +233,7 @@ void TriangleMesh::enqueue_build(VkCommandBuffer &cmd_buf)
 
 void TriangleMesh::enqueue_compaction(VkCommandBuffer &cmd_buf)
 {
-    if (!(build_flags & VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_COMPACTION_BIT_KHR)) {
+    if (!compaction_enabled()) {
         return;
     }
     uint64_t compacted_size = 0;
@@ -189,7 +245,11 @@ void TriangleMesh::enqueue_compaction(VkCommandBuffer &cmd_buf)
                                        &compacted_size,
                                        sizeof(uint64_t),
                                        VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WAIT_BIT));
+    enqueue_compacted_copy(cmd_buf, compacted_size);
+}
 
+void TriangleMesh::enqueue_compacted_copy(VkCommandBuffer &cmd_buf, uint64_t compacted_size)
+{
     compacted_buf = Buffer::device(*device,
                                    compacted_size,
                                    VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT |
@@ -219,7 +279,7 @@ void TriangleMesh::finalize()
 
     // Compaction is done, so swap the old handle with the compacted one and free the old
     // output memory
-    if (build_flags & VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_COMPACTION_BIT_KHR) {
+    if (compaction_enabled()) {
         vkDestroyQueryPool(device->logical_device(), query_pool, nullptr);
         query_pool = VK_NULL_HANDLE;
 
@@ -236,6 +296,148 @@ void TriangleMesh::finalize()
     handle = GetAccelerationStructureDeviceAddressKHR(device->logical_device(), &addr_info);
 }
 
+BatchedBVHBuild::BatchedBVHBuild(Device &dev, const std::vector<TriangleMesh *> &meshes)
+    : device(&dev), meshes(meshes)
+{
+}
+
+BatchedBVHBuild::~BatchedBVHBuild()
+{
+    if (query_pool != VK_NULL_HANDLE) {
+        vkDestroyQueryPool(device->logical_device(), query_pool, nullptr);
+    }
+}
+
+void BatchedBVHBuild::enqueue_build(VkCommandBuffer &cmd_buf)
+{
+    if (meshes.empty()) {
+        return;
+    }
+
+    // Lay out each mesh's scratch space in the shared buffer
+    const size_t scratch_alignment = device->acceleration_structure_properties()
+                                         .minAccelerationStructureScratchOffsetAlignment;
+    std::vector<size_t> scratch_offsets;
+    size_t scratch_size = 0;
+    for (auto *m : meshes) {
+        const VkAccelerationStructureBuildSizesInfoKHR build_size_info = m->build_sizes();
+        m->create_bvh(build_size_info.accelerationStructureSize);
+
+        scratch_offsets.push_back(scratch_size);
+        scratch_size = align_to(scratch_size + build_size_info.buildScratchSize,
+                                scratch_alignment);
+        if (m->compaction_enabled()) {
+            compacted_meshes.push_back(m);
+        }
+    }
+
+    // The buffer's device address may not meet the scratch alignment, so pad it to let
+    // us shift the start of the scratch space up to the next aligned address
+    scratch_buf = Buffer::device(*device,
+                                 scratch_size + scratch_alignment,
+                                 VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+                                     VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT);
+    const VkDeviceAddress scratch_base =
+        align_to(scratch_buf->device_address(), scratch_alignment);
+
+    std::vector<VkAccelerationStructureBuildGeometryInfoKHR> build_infos;
+    std::vector<std::vector<VkAccelerationStructureBuildRangeInfoKHR>> build_ranges;
+    std::vector<const VkAccelerationStructureBuildRangeInfoKHR *> build_range_ptrs;
+    for (size_t i = 0; i < meshes.size(); ++i) {
+        VkAccelerationStructureBuildGeometryInfoKHR build_info =
+            meshes[i]->build_geometry_info();
+        build_info.scratchData.deviceAddress = scratch_base + scratch_offsets[i];
+        build_infos.push_back(build_info);
+        build_ranges.push_back(meshes[i]->build_ranges());
+    }
+    std::transform(build_ranges.begin(),
+                   build_ranges.end(),
+                   std::back_inserter(build_range_ptrs),
+                   [](const std::vector<VkAccelerationStructureBuildRangeInfoKHR> &r) {
+                       return r.data();
+                   });
+
+    CmdBuildAccelerationStructuresKHR(
+        cmd_buf, build_infos.size(), build_infos.data(), build_range_ptrs.data());
+
+    // Memory barrier to have subsequent commands wait on build completion
+    VkMemoryBarrier barrier = {};
+    barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    barrier.srcAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR |
+                            VK_ACCESS_ACCELERATION_STRUCTURE_READ_BIT_KHR;
+    barrier.dstAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR |
+                            VK_ACCESS_ACCELERATION_STRUCTURE_READ_BIT_KHR;
+
+    vkCmdPipelineBarrier(cmd_buf,
+                         VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
+                         VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
+                         0,
+                         1,
+                         &barrier,
+                         0,
+                         nullptr,
+                         0,
+                         nullptr);
+
+    if (compacted_meshes.empty()) {
+        return;
+    }
+
+    // Read the compacted sizes of all the meshes being compacted
+    VkQueryPoolCreateInfo pool_ci = {};
+    pool_ci.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+    pool_ci.queryType = VK_QUERY_TYPE_ACCELERATION_STRUCTURE_COMPACTED_SIZE_KHR;
+    pool_ci.queryCount = compacted_meshes.size();
+    CHECK_VULKAN(vkCreateQueryPool(device->logical_device(), &pool_ci, nullptr, &query_pool));
+
+    std::vector<VkAccelerationStructureKHR> compacted_bvhs;
+    std::transform(compacted_meshes.begin(),
+                   compacted_meshes.end(),
+                   std::back_inserter(compacted_bvhs),
+                   [](const TriangleMesh *m) { return m->bvh; });
+
+    vkCmdResetQueryPool(cmd_buf, query_pool, 0, compacted_meshes.size());
+    CmdWriteAccelerationStructuresPropertiesKHR(
+        cmd_buf,
+        compacted_bvhs.size(),
+        compacted_bvhs.data(),
+        VK_QUERY_TYPE_ACCELERATION_STRUCTURE_COMPACTED_SIZE_KHR,
+        query_pool,
+        0);
+}
+
+void BatchedBVHBuild::enqueue_compaction(VkCommandBuffer &cmd_buf)
+{
+    if (compacted_meshes.empty()) {
+        return;
+    }
+    std::vector<uint64_t> compacted_sizes(compacted_meshes.size(), 0);
+    CHECK_VULKAN(vkGetQueryPoolResults(device->logical_device(),
+                                       query_pool,
+                                       0,
+                                       compacted_sizes.size(),
+                                       compacted_sizes.size() * sizeof(uint64_t),
+                                       compacted_sizes.data(),
+                                       sizeof(uint64_t),
+                                       VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WAIT_BIT));
+
+    for (size_t i = 0; i < compacted_meshes.size(); ++i) {
+        compacted_meshes[i]->enqueue_compacted_copy(cmd_buf, compacted_sizes[i]);
+    }
+}
+
+void BatchedBVHBuild::finalize()
+{
+    for (auto *m : meshes) {
+        m->finalize();
+    }
+    scratch_buf = nullptr;
+    if (query_pool != VK_NULL_HANDLE) {
+        vkDestroyQueryPool(device->logical_device(), query_pool, nullptr);
+        query_pool = VK_NULL_HANDLE;
+    }
+}
+
 TopLevelBVH::TopLevelBVH(Device &dev,
                          std::shared_ptr<Buffer> &inst_buf,
                          const std::vector<Instance> &instances,
@@ -256,14 +458,7 @@ TopLevelBVH::~TopLevelBVH()
 
 void TopLevelBVH::enqueue_build(VkCommandBuffer &cmd_buf)
 {
-    VkAccelerationStructureGeometryKHR instance_desc = {};
-    instance_desc.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_KHR;
-    instance_desc.geometryType = VK_GEOMETRY_TYPE_INSTANCES_KHR;
-    instance_desc.flags = 0;
-    instance_desc.geometry.instances.sType =
-        VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_INSTANCES_DATA_KHR;
-    instance_desc.geometry.instances.arrayOfPointers = false;
-    instance_desc.geometry.instances.data.deviceAddress = instance_buf->device_address();
+    const VkAccelerationStructureGeometryKHR instance_desc = instance_geometry();
 
     // Determine how much memory the acceleration structure will need
     VkAccelerationStructureBuildGeometryInfoKHR build_info = {};
@@ -273,13 +468,13 @@ void TopLevelBVH::enqueue_build(VkCommandBuffer &cmd_buf)
     build_info.geometryCount = 1;
     build_info.pGeometries = &instance_desc;
 
-    const uint32_t instance_desc_count = 1;
-    VkAccelerationStructureBuildSizesInfoKHR build_size_info = {};
+    const uint32_t instance_count = instances.size();
+    VkAccelerationStructureBuildSizesInfoKHR &build_size_info = build_sizes;
     build_size_info.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_SIZES_INFO_KHR;
     GetAccelerationStructureBuildSizesKHR(device->logical_device(),
                                           VK_ACCELERATION_STRUCTURE_BUILD_TYPE_DEVICE_KHR,
                                           &build_info,
-                                          &instance_desc_count,
+                                          &instance_count,
                                           &build_size_info);
 
     bvh_buf = Buffer::device(*device,
@@ -323,6 +518,66 @@ void TopLevelBVH::enqueue_build(VkCommandBuffer &cmd_buf)
     // Enqueue the build commands into the command buffer
     CmdBuildAccelerationStructuresKHR(cmd_buf, 1, &accel_build_info, &build_offset_info_ptr);
 
+    enqueue_barrier(cmd_buf);
+}
+
+void TopLevelBVH::enqueue_update(VkCommandBuffer &cmd_buf, bool rebuild)
+{
+    if (!(build_flags & VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_UPDATE_BIT_KHR) && !rebuild) {
+        throw std::runtime_error("TopLevelBVH must be built with ALLOW_UPDATE to be refit");
+    }
+
+    /* The scratch space is kept between updates, since they're typically done every frame.
+     * It's sized for both refits and rebuilds up front, since an update still in flight
+     * may be using it when the next one is recorded
+     */
+    const VkDeviceSize scratch_size =
+        std::max(build_sizes.buildScratchSize, build_sizes.updateScratchSize);
+    if (!scratch_buf || scratch_buf->size() < scratch_size) {
+        scratch_buf = Buffer::device(
+            *device,
+            scratch_size,
+            VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT);
+    }
+
+    const VkAccelerationStructureGeometryKHR instance_desc = instance_geometry();
+
+    VkAccelerationStructureBuildGeometryInfoKHR accel_build_info = {};
+    accel_build_info.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR;
+    accel_build_info.type = VK_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL_KHR;
+    accel_build_info.flags = build_flags;
+    accel_build_info.mode = rebuild ? VK_BUILD_ACCELERATION_STRUCTURE_MODE_BUILD_KHR
+                                    : VK_BUILD_ACCELERATION_STRUCTURE_MODE_UPDATE_KHR;
+    accel_build_info.srcAccelerationStructure = rebuild ? VK_NULL_HANDLE : bvh;
+    accel_build_info.dstAccelerationStructure = bvh;
+    accel_build_info.geometryCount = 1;
+    accel_build_info.pGeometries = &instance_desc;
+    accel_build_info.scratchData.deviceAddress = scratch_buf->device_address();
+
+    VkAccelerationStructureBuildRangeInfoKHR build_offset_info = {};
+    build_offset_info.primitiveCount = instances.size();
+
+    VkAccelerationStructureBuildRangeInfoKHR *build_offset_info_ptr = &build_offset_info;
+    CmdBuildAccelerationStructuresKHR(cmd_buf, 1, &accel_build_info, &build_offset_info_ptr);
+
+    enqueue_barrier(cmd_buf);
+}
+
+VkAccelerationStructureGeometryKHR TopLevelBVH::instance_geometry() const
+{
+    VkAccelerationStructureGeometryKHR instance_desc = {};
+    instance_desc.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_KHR;
+    instance_desc.geometryType = VK_GEOMETRY_TYPE_INSTANCES_KHR;
+    instance_desc.flags = 0;
+    instance_desc.geometry.instances.sType =
+        VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_INSTANCES_DATA_KHR;
+    instance_desc.geometry.instances.arrayOfPointers = false;
+    instance_desc.geometry.instances.data.deviceAddress = instance_buf->device_address();
+    return instance_desc;
+}
+
+void TopLevelBVH::enqueue_barrier(VkCommandBuffer &cmd_buf)
+{
     // Enqueue a barrier on the build
     VkMemoryBarrier barrier = {};
     barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
@@ -437,6 +692,12 @@ RTPipelineBuilder &RTPipelineBuilder::set_recursion_depth(uint32_t depth)
     return *this;
 }
 
+RTPipelineBuilder &RTPipelineBuilder::set_cache(VkPipelineCache c)
+{
+    cache = c;
+    return *this;
+}
+
 RTPipeline RTPipelineBuilder::build(Device &device)
 {
     std::vector<VkPipelineShaderStageCreateInfo> shader_info;
@@ -486,7 +747,7 @@ RTPipeline RTPipelineBuilder::build(Device &device)
     pipeline_create_info.layout = layout;
     CHECK_VULKAN(CreateRayTracingPipelinesKHR(device.logical_device(),
                                               VK_NULL_HANDLE,
-                                              VK_NULL_HANDLE,
+                                              cache,
                                               1,
                                               &pipeline_create_info,
                                               nullptr,
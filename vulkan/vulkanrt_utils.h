@@ -12,6 +12,14 @@ namespace vkrt {
 
 struct Geometry {
     std::shared_ptr<Buffer> vertex_buf, index_buf, normal_buf, uv_buf;
+    // The geometry's range of elements in each buffer, which may be shared with other
+    // geometries. The normal and uv offsets are -1 if the geometry doesn't have them
+    uint32_t vertex_offset = 0;
+    uint32_t index_offset = 0;
+    uint32_t normal_offset = -1;
+    uint32_t uv_offset = -1;
+    uint32_t vertex_count = 0;
+    uint32_t triangle_count = 0;
     VkAccelerationStructureGeometryKHR geom_desc = {};
 
     Geometry() = default;
@@ -22,6 +30,16 @@ struct Geometry {
              std::shared_ptr<Buffer> uv_buf,
              uint32_t geom_flags = VK_GEOMETRY_OPAQUE_BIT_KHR);
 
+    // Make a geometry from a range of vertices and triangles in shared buffers, the normal
+    // and uv ranges can be set after if the geometry has them
+    Geometry(std::shared_ptr<Buffer> vertex_buf,
+             uint32_t vertex_offset,
+             uint32_t vertex_count,
+             std::shared_ptr<Buffer> index_buf,
+             uint32_t index_offset,
+             uint32_t triangle_count,
+             uint32_t geom_flags = VK_GEOMETRY_OPAQUE_BIT_KHR);
+
     uint32_t num_vertices() const;
 
     uint32_t num_triangles() const;
@@ -38,6 +56,18 @@ class TriangleMesh {
     VkQueryPool query_pool = VK_NULL_HANDLE;
     VkAccelerationStructureKHR compacted_bvh = VK_NULL_HANDLE;
 
+    friend class BatchedBVHBuild;
+
+    VkAccelerationStructureBuildGeometryInfoKHR build_geometry_info() const;
+
+    std::vector<VkAccelerationStructureBuildRangeInfoKHR> build_ranges() const;
+
+    // Allocate the BVH output memory and create the acceleration structure
+    void create_bvh(size_t bvh_size);
+
+    // Create the compacted acceleration structure and enqueue the copy into it
+    void enqueue_compacted_copy(VkCommandBuffer &cmd_buf, uint64_t compacted_size);
+
 public:
     std::vector<Geometry> geometries;
     VkAccelerationStructureKHR bvh = VK_NULL_HANDLE;
@@ -59,6 +89,11 @@ public:
     TriangleMesh(const TriangleMesh &) = delete;
     TriangleMesh &operator=(const TriangleMesh &) = delete;
 
+    // Query the memory needed to build the BVH
+    VkAccelerationStructureBuildSizesInfoKHR build_sizes() const;
+
+    bool compaction_enabled() const;
+
     /* After calling build the commands are placed in the command list
      * with a barrier to wait on the completion of the build
      */
@@ -77,12 +112,54 @@ public:
     void finalize();
 };
 
+/* Builds a set of bottom level BVHs with a single vkCmdBuildAccelerationStructuresKHR call.
+ * Their scratch space is sub-allocated from one shared buffer and their compacted sizes are
+ * read back through one query pool, so a scene's meshes can be built and compacted with a
+ * couple of submissions instead of a few per mesh.
+ */
+class BatchedBVHBuild {
+    Device *device = nullptr;
+    std::vector<TriangleMesh *> meshes;
+    std::shared_ptr<Buffer> scratch_buf;
+    VkQueryPool query_pool = VK_NULL_HANDLE;
+    // The meshes being compacted, in the order of their queries in the pool
+    std::vector<TriangleMesh *> compacted_meshes;
+
+public:
+    // The meshes must stay alive until the build is finalized
+    BatchedBVHBuild(Device &dev, const std::vector<TriangleMesh *> &meshes);
+    ~BatchedBVHBuild();
+
+    BatchedBVHBuild(const BatchedBVHBuild &) = delete;
+    BatchedBVHBuild &operator=(const BatchedBVHBuild &) = delete;
+
+    /* Enqueue the builds of all the meshes, followed by a barrier on their completion and
+     * the compacted size queries of the meshes which allow compaction
+     */
+    void enqueue_build(VkCommandBuffer &cmd_buf);
+
+    /* Enqueue the compaction copies. The builds must have been enqueued and completed so
+     * the compacted sizes are available
+     */
+    void enqueue_compaction(VkCommandBuffer &cmd_buf);
+
+    /* Swap the meshes over to their compacted BVHs and release the scratch space. The
+     * compaction copies must have completed
+     */
+    void finalize();
+};
+
 class TopLevelBVH {
     Device *device = nullptr;
     VkBuildAccelerationStructureFlagBitsKHR build_flags =
         (VkBuildAccelerationStructureFlagBitsKHR)0;
 
     std::shared_ptr<Buffer> bvh_buf, scratch_buf;
+    VkAccelerationStructureBuildSizesInfoKHR build_sizes = {};
+
+    VkAccelerationStructureGeometryKHR instance_geometry() const;
+
+    void enqueue_barrier(VkCommandBuffer &cmd_buf);
 
 public:
     std::shared_ptr<Buffer> instance_buf;
@@ -112,6 +189,14 @@ public:
      */
     void enqueue_build(VkCommandBuffer &cmd_buf);
 
+    /* Enqueue an update of the BVH in place after the instance buffer has been rewritten
+     * with the same number of instances. The BVH must have been built with the allow
+     * update flag. A refit is much faster than a build but the BVH quality degrades as the
+     * instances move, so a full rebuild into the same acceleration structure can be
+     * requested instead.
+     */
+    void enqueue_update(VkCommandBuffer &cmd_buf, bool rebuild = false);
+
     // Free the BVH build scratch space
     void finalize();
 
@@ -152,6 +237,7 @@ class RTPipelineBuilder {
     std::vector<ShaderGroup> shaders;
     VkPipelineLayout layout = VK_NULL_HANDLE;
     uint32_t recursion_depth = 1;
+    VkPipelineCache cache = VK_NULL_HANDLE;
 
 public:
     RTPipelineBuilder &set_raygen(const std::string &name,
@@ -170,6 +256,9 @@ public:
 
     RTPipelineBuilder &set_recursion_depth(uint32_t depth);
 
+    // Optionally look up and store the compiled pipeline in the cache
+    RTPipelineBuilder &set_cache(VkPipelineCache cache);
+
     RTPipeline build(Device &device);
 };
 